@@ -105,6 +105,40 @@ __m128 Y = _mm_movehdup_ps(X);
 SET(CMAKE_REQUIRED_FLAGS "")
 ENDMACRO(CHECK_SSE3)
 
+
+MACRO(CHECK_AVX2)
+IF(CMAKE_COMPILER_IS_GNUCC)
+  SET(AVX2_FLAGS "-mavx2")
+ENDIF(CMAKE_COMPILER_IS_GNUCC)
+
+SET(CMAKE_REQUIRED_FLAGS "${SSE3_FLAGS} ${AVX2_FLAGS}")
+CHECK_C_SOURCE_COMPILES(
+"#include <immintrin.h>
+int main() {
+__m256i X = _mm256_setzero_si256();
+__m256i Y = _mm256_max_epu8(X, X);
+}
+" HAVE_AVX2)
+SET(CMAKE_REQUIRED_FLAGS "")
+ENDMACRO(CHECK_AVX2)
+
+
+MACRO(CHECK_FMA)
+IF(CMAKE_COMPILER_IS_GNUCC)
+  SET(FMA_FLAGS "-mfma")
+ENDIF(CMAKE_COMPILER_IS_GNUCC)
+
+SET(CMAKE_REQUIRED_FLAGS "${SSE3_FLAGS} ${AVX2_FLAGS} ${FMA_FLAGS}")
+CHECK_C_SOURCE_COMPILES(
+"#include <immintrin.h>
+int main() {
+__m256 X = _mm256_setzero_ps();
+__m256 Y = _mm256_fmadd_ps(X, X, X);
+}
+" HAVE_FMA)
+SET(CMAKE_REQUIRED_FLAGS "")
+ENDMACRO(CHECK_FMA)
+
 MACRO(CHECK_ALTIVEC)
 IF(CMAKE_COMPILER_IS_GNUCC)
   SET(ALTIVEC_FLAGS "-maltivec")
@@ -28,6 +28,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <limits.h>
 
 #ifdef _WIN32
 #include <io.h>
@@ -38,6 +39,7 @@
 #include "pcm.h"
 #include "helptext.h"
 #include "opts.h"
+#include "threading.h"
 
 static const int acmod_to_ch[8] = { 2, 1, 2, 3, 3, 4, 4, 5 };
 
@@ -70,6 +72,10 @@ print_simd_in_use(FILE *out, AftenSimdInstructions *simd_instructions)
         fprintf(out, " SSE3");
     if (simd_instructions->ssse3)
         fprintf(out, " SSSE3");
+    if (simd_instructions->avx2)
+        fprintf(out, " AVX2");
+    if (simd_instructions->fma)
+        fprintf(out, " FMA");
     if (simd_instructions->amd_3dnow)
         fprintf(out, " 3DNOW");
     if (simd_instructions->amd_3dnowext)
@@ -81,12 +87,305 @@ print_simd_in_use(FILE *out, AftenSimdInstructions *simd_instructions)
     fprintf(out, "\n");
 }
 
+/**
+ * Number of frames each segment encodes ahead of its first output frame.
+ * This lets the input filters and the bit allocation settle to roughly the
+ * state a serial encode would have at that point in the stream.
+ */
+#define SEGMENT_WARMUP_FRAMES 16
+
+typedef struct SegmentContext {
+    AftenContext s;
+    PcmContext pf;
+    FILE *ifp[A52_NUM_SPEAKERS];
+    int num_files;
+    void (*remap)(void *samples, int n, int ch,
+                  A52SampleFormat fmt, int acmod);
+    FLOAT *fwav;
+    int last;               ///< last segment, which reads until end of input
+    int skip_frames;        ///< warm-up frames that are encoded but discarded
+    int out_frames;         ///< frames to output (unless last segment)
+    uint8_t *out;           ///< coded output of this segment
+    size_t out_size;
+    size_t out_alloc;
+    uint32_t frame_cnt;     ///< output frame count
+    uint32_t bytecount;
+    FLOAT qual, bw, ba;
+    int error;
+#ifndef NO_THREADS
+    THREAD thread;
+#endif
+} SegmentContext;
+
+/**
+ * Sets up one segment: opens its own handles on the input files, seeks to
+ * the start of its warm-up frames and initializes its encoder with the 256
+ * samples preceding them.
+ * @param frame_start  first frame this segment outputs, counted from the
+ *                     first sample after the initial samples
+ */
+static int
+segment_init(SegmentContext *seg, CommandOptions *opts, AftenContext *s,
+             PcmContext *pf, int base, uint64_t frame_start)
+{
+    uint64_t warm_start, pos;
+    int i, nr;
+
+    seg->num_files = opts->num_input_files;
+    for (i = 0; i < seg->num_files; i++) {
+        seg->ifp[i] = fopen(opts->infile[i], "rb");
+        if (!seg->ifp[i]) {
+            fprintf(stderr, "error opening input file: %s\n", opts->infile[i]);
+            return -1;
+        }
+    }
+    if (pcm_init(&seg->pf, seg->num_files, seg->ifp, pf->read_format,
+                 opts->raw_input ? PCM_FORMAT_RAW : PCM_FORMAT_UNKNOWN)) {
+        fprintf(stderr, "invalid input file(s)\n");
+        return -1;
+    }
+    if (opts->raw_input) {
+        pcm_set_source_params(&seg->pf, opts->raw_ch, opts->raw_fmt,
+                              opts->raw_order, opts->raw_sr);
+    }
+
+    seg->fwav = calloc(A52_SAMPLES_PER_FRAME * s->channels, sizeof(FLOAT));
+    if (!seg->fwav)
+        return -1;
+
+    warm_start = frame_start - MIN(frame_start, SEGMENT_WARMUP_FRAMES);
+    seg->skip_frames = (int)(frame_start - warm_start);
+    pos = base + warm_start * A52_SAMPLES_PER_FRAME;
+
+    seg->s = *s;
+    seg->s.system.n_threads = 1;
+    seg->s.initial_samples = NULL;
+    seg->s.start_frame = (int)warm_start;
+    if (pos >= 256) {
+        // same initial samples a serial encode would have in its delay buffer
+        if (pcm_seek_samples(&seg->pf, pos - 256, PCM_SEEK_SET))
+            return -1;
+        nr = pcm_read_samples(&seg->pf, seg->fwav, 256);
+        if (nr != 256)
+            return -1;
+        if (seg->remap)
+            seg->remap(seg->fwav, nr, s->channels, s->sample_format, s->acmod);
+        seg->s.initial_samples = seg->fwav;
+    }
+    if (aften_encode_init(&seg->s)) {
+        fprintf(stderr, "error initializing encoder\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+segment_append(SegmentContext *seg, const uint8_t *frame, int fs)
+{
+    if (seg->out_size + fs > seg->out_alloc) {
+        size_t size = MAX(seg->out_alloc * 2, 65536);
+        uint8_t *out = realloc(seg->out, size);
+        if (!out)
+            return -1;
+        seg->out = out;
+        seg->out_alloc = size;
+    }
+    memcpy(seg->out + seg->out_size, frame, fs);
+    seg->out_size += fs;
+    return 0;
+}
+
+static int
+segment_encode(void *arg)
+{
+    SegmentContext *seg = arg;
+    AftenContext *s = &seg->s;
+    uint8_t frame[A52_MAX_CODED_FRAME_SIZE];
+    int nr, fs, frames = 0;
+    int total = seg->skip_frames + seg->out_frames;
+
+    do {
+        nr = pcm_read_samples(&seg->pf, seg->fwav, A52_SAMPLES_PER_FRAME);
+        if (nr < 0 || (!seg->last && nr != A52_SAMPLES_PER_FRAME)) {
+            fprintf(stderr, "error reading input\n");
+            seg->error = 1;
+            break;
+        }
+        if (seg->remap)
+            seg->remap(seg->fwav, nr, s->channels, s->sample_format, s->acmod);
+
+        fs = aften_encode_frame(s, frame, seg->fwav, nr);
+        if (fs < 0) {
+            seg->error = 1;
+            break;
+        } else if (fs > 0) {
+            if (frames++ < seg->skip_frames)
+                continue;
+            if (segment_append(seg, frame, fs)) {
+                seg->error = 1;
+                break;
+            }
+            seg->frame_cnt++;
+            seg->bytecount += fs;
+            seg->qual += s->status.quality;
+            seg->bw += s->status.bwcode;
+            seg->ba += s->status.bit_alloc_calls;
+        }
+    } while (seg->last ? (nr > 0 || fs > 0 || !frames) : frames < total);
+
+    return seg->error;
+}
+
+static void
+segment_close(SegmentContext *seg)
+{
+    int i;
+
+    aften_encode_close(&seg->s);
+    pcm_close(&seg->pf);
+    for (i = 0; i < seg->num_files; i++) {
+        if (seg->ifp[i])
+            fclose(seg->ifp[i]);
+    }
+    free(seg->fwav);
+    free(seg->out);
+}
+
+/**
+ * Returns the number of segments the input can be split into, or 0 if it
+ * has to be encoded serially.
+ */
+static int
+segment_count(CommandOptions *opts, PcmContext *pf, int base)
+{
+    uint64_t frames;
+    int i;
+
+    if (opts->segments < 2)
+        return 0;
+    for (i = 0; i < opts->num_input_files; i++) {
+        if (!strncmp(opts->infile[i], "-", 2) || !pf->pcm_file[i].seekable)
+            break;
+    }
+    if (i < opts->num_input_files || opts->read_to_eof || !pf->samples) {
+        fprintf(stderr, "segments need seekable input of known length. "
+                        "encoding serially.\n");
+        return 0;
+    }
+    if (pf->samples <= (uint64_t)base)
+        return 0;
+    // every segment but the last has to end on a full frame
+    frames = (pf->samples - base) / A52_SAMPLES_PER_FRAME;
+    return (int)MIN(frames, (uint64_t)opts->segments);
+}
+
+/**
+ * Encodes the input as independent segments in parallel and writes them to
+ * the output in order. The statistics of all segments are summed up in
+ * @p total, which must be zeroed by the caller.
+ */
+static int
+encode_segments(CommandOptions *opts, AftenContext *s, PcmContext *pf,
+                void (*remap)(void *samples, int n, int ch,
+                              A52SampleFormat fmt, int acmod),
+                int n_segs, FILE *ofp, SegmentContext *total)
+{
+    SegmentContext *segs;
+    int base = opts->pad_start ? 0 : 256;
+    uint64_t seg_frames = ((pf->samples - base) / A52_SAMPLES_PER_FRAME) / n_segs;
+    int i, n_init, ret_val = 0;
+
+    segs = calloc(n_segs, sizeof(SegmentContext));
+    if (!segs)
+        return -1;
+
+    for (n_init = 0; n_init < n_segs; n_init++) {
+        SegmentContext *seg = &segs[n_init];
+        seg->remap = remap;
+        seg->last = (n_init == n_segs - 1);
+        seg->out_frames = (int)seg_frames;
+        if (segment_init(seg, opts, s, pf, base, n_init * seg_frames)) {
+            n_init++;
+            ret_val = -1;
+            goto end;
+        }
+    }
+
+    print_simd_in_use(stderr, &segs[0].s.system.wanted_simd_instructions);
+    fprintf(stderr, "Threads: %i (segments)\n\n", n_segs);
+
+#ifndef NO_THREADS
+    for (i = 0; i < n_segs; i++)
+        thread_create(&segs[i].thread, segment_encode, &segs[i]);
+#endif
+    // write each segment as soon as it is done, keeping the stream order
+    for (i = 0; i < n_segs; i++) {
+        SegmentContext *seg = &segs[i];
+#ifndef NO_THREADS
+        thread_join(seg->thread);
+#else
+        segment_encode(seg);
+#endif
+        if (seg->error) {
+            fprintf(stderr, "Error encoding segment %d\n", i);
+            ret_val = -1;
+        }
+        if (ret_val)
+            continue;
+        fwrite(seg->out, 1, seg->out_size, ofp);
+        total->frame_cnt += seg->frame_cnt;
+        total->bytecount += seg->bytecount;
+        total->qual += seg->qual;
+        total->bw += seg->bw;
+        total->ba += seg->ba;
+    }
+end:
+    for (i = 0; i < n_init; i++)
+        segment_close(&segs[i]);
+    free(segs);
+    return ret_val;
+}
+
+/**
+ * Reads the statistics of the first pass. Returns NULL on failure.
+ */
+static uint8_t *
+read_pass_log(const char *name, int *size)
+{
+    FILE *fp;
+    uint8_t *buf;
+    long len;
+
+    fp = fopen(name, "rb");
+    if (!fp) {
+        fprintf(stderr, "error opening pass log file: %s\n", name);
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    buf = NULL;
+    if (len > 0 && len <= INT_MAX)
+        buf = malloc(len);
+    if (!buf || fread(buf, 1, len, fp) != (size_t)len) {
+        fprintf(stderr, "error reading pass log file: %s\n", name);
+        free(buf);
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+    *size = (int)len;
+
+    return buf;
+}
+
 int
 main(int argc, char **argv)
 {
     void (*aften_remap)(void *samples, int n, int ch,
                         A52SampleFormat fmt, int acmod) = NULL;
     uint8_t *frame = NULL;
+    uint8_t *pass_stats = NULL;
     FLOAT *fwav = NULL;
     int nr, fs, err;
     FILE *ifp[A52_NUM_SPEAKERS];
@@ -95,7 +394,7 @@ main(int argc, char **argv)
     CommandOptions opts;
     AftenContext s;
     uint32_t samplecount, bytecount, t0, t1, percent;
-    FLOAT kbps, qual, bw;
+    FLOAT kbps, qual, bw, ba;
     int frame_cnt;
     int input_file_format;
     enum PcmSampleFormat read_format;
@@ -104,6 +403,7 @@ main(int argc, char **argv)
     clock_t current_clock;
     clock_t last_update_clock = clock() - update_clock_span;
     int ret_val = 0;
+    int n_segs;
     int i;
 
     opts.s = &s;
@@ -228,8 +528,25 @@ main(int argc, char **argv)
     s.sample_format = A52_SAMPLE_FMT_FLT;
 #endif
 
-    // open output file
-    if (!strncmp(opts.outfile, "-", 2)) {
+    if (s.params.pass && opts.segments > 1) {
+        fprintf(stderr, "segments cannot be used with two-pass encoding\n");
+        goto error_end;
+    }
+    if (s.params.pass == 2) {
+        pass_stats = read_pass_log(opts.passlog, &s.params.pass_stats_size);
+        if (!pass_stats)
+            goto error_end;
+        s.params.pass_stats = pass_stats;
+    }
+
+    // open output file. the first pass writes its statistics instead.
+    if (s.params.pass == 1) {
+        ofp = fopen(opts.passlog, "wb");
+        if (!ofp) {
+            fprintf(stderr, "error opening pass log file: %s\n", opts.passlog);
+            goto error_end;
+        }
+    } else if (!strncmp(opts.outfile, "-", 2)) {
 #ifdef _WIN32
         _setmode(_fileno(stdout), _O_BINARY);
 #endif
@@ -252,23 +569,39 @@ main(int argc, char **argv)
         fprintf(stderr, "\n\n");
     }
 
+    if (opts.chmap == 0)
+        aften_remap = aften_remap_wav_to_a52;
+    else if (opts.chmap == 2)
+        aften_remap = aften_remap_mpeg_to_a52;
+
+    samplecount = bytecount = t0 = t1 = percent = 0;
+    qual = bw = ba = 0.0;
+    frame_cnt = 0;
+
+    n_segs = segment_count(&opts, &pf, opts.pad_start ? 0 : 256);
+    if (n_segs > 1) {
+        SegmentContext total;
+        memset(&total, 0, sizeof(total));
+        if (encode_segments(&opts, &s, &pf, aften_remap, n_segs, ofp, &total))
+            goto error_end;
+        samplecount = total.frame_cnt * A52_SAMPLES_PER_FRAME;
+        bytecount = total.bytecount;
+        qual = total.qual;
+        bw = total.bw;
+        ba = total.ba;
+        frame_cnt = total.frame_cnt;
+        goto print_stats;
+    }
+
     // allocate memory for coded frame and sample buffer
     frame = calloc(A52_MAX_CODED_FRAME_SIZE, 1);
     fwav = calloc(A52_SAMPLES_PER_FRAME * s.channels, sizeof(FLOAT));
     if (frame == NULL || fwav == NULL)
         goto error_end;
 
-    samplecount = bytecount = t0 = t1 = percent = 0;
-    qual = bw = 0.0;
-    frame_cnt = 0;
     fs = 0;
     nr = 0;
 
-    if (opts.chmap == 0)
-        aften_remap = aften_remap_wav_to_a52;
-    else if (opts.chmap == 2)
-        aften_remap = aften_remap_mpeg_to_a52;
-
     // Don't pad start with zero samples, use input audio instead.
     if (!opts.pad_start) {
         int diff;
@@ -292,7 +625,9 @@ main(int argc, char **argv)
     print_simd_in_use(stderr, &s.system.wanted_simd_instructions);
 
     // print number of threads used
-    fprintf(stderr, "Threads: %i\n\n", s.system.n_threads);
+    fprintf(stderr, "Threads: %i%s\n\n", s.system.n_threads,
+            (s.system.n_threads > 1 &&
+             s.system.threading_mode == AFTEN_THREADS_INTRA) ? " (intra-frame)" : "");
 
     do {
         nr = pcm_read_samples(&pf, fwav, A52_SAMPLES_PER_FRAME);
@@ -310,6 +645,7 @@ main(int argc, char **argv)
                 bytecount += fs;
                 qual += s.status.quality;
                 bw += s.status.bwcode;
+                ba += s.status.bit_alloc_calls;
                 if (s.verbose == 1) {
                     current_clock = clock();
                     if (current_clock - last_update_clock >= update_clock_span) {
@@ -332,9 +668,9 @@ main(int argc, char **argv)
                         last_update_clock = current_clock;
                     }
                 } else if (s.verbose == 2) {
-                    fprintf(stderr, "frame: %7d | q: %4d | bw: %2d | bitrate: %3d kbps\n",
+                    fprintf(stderr, "frame: %7d | q: %4d | bw: %2d | bitrate: %3d kbps | ba: %2d\n",
                             frame_cnt, s.status.quality, s.status.bwcode,
-                            s.status.bit_rate);
+                            s.status.bit_rate, s.status.bit_alloc_calls);
                 }
             }
             fwrite(frame, 1, fs, ofp);
@@ -342,6 +678,7 @@ main(int argc, char **argv)
         }
     } while (nr > 0 || fs > 0 || !frame_cnt);
 
+print_stats:
     if (s.verbose >= 1) {
         if (samplecount > 0) {
             kbps = (bytecount * FCONST(8.0) * pf.sample_rate) / (FCONST(1000.0) * samplecount);
@@ -356,7 +693,8 @@ main(int argc, char **argv)
             fprintf(stderr, "\n");
             fprintf(stderr, "average quality:   %4.1f\n", (qual / frame_cnt));
             fprintf(stderr, "average bandwidth: %2.1f\n", (bw / frame_cnt));
-            fprintf(stderr, "average bitrate:   %4.1f kbps\n\n", kbps);
+            fprintf(stderr, "average bitrate:   %4.1f kbps\n", kbps);
+            fprintf(stderr, "average bit allocation passes: %4.1f\n\n", (ba / frame_cnt));
         }
     }
     goto end;
@@ -369,6 +707,9 @@ end:
     if (frame)
         free(frame);
 
+    if (pass_stats)
+        free(pass_stats);
+
         pcm_close(&pf);
     for (i = 0; i < opts.num_input_files; i++) {
         if (ifp[i])
@@ -27,7 +27,7 @@
 
 static const char *usage_heading = "usage: aften [options] <input.wav> <output.ac3>\n";
 
-#define HELP_OPTIONS_COUNT 43
+#define HELP_OPTIONS_COUNT 53
 
 static const char *help_options[HELP_OPTIONS_COUNT] = {
 "    [-h]           Print out list of commandline options\n",
@@ -44,21 +44,54 @@ static const char *help_options[HELP_OPTIONS_COUNT] = {
 "    [-threads #]   Number of parallel threads to use\n"
 "                       0 = detect number of CPUs (default)\n",
 
+"    [-threadmode #] How threads share the work\n"
+"                       0 = each thread encodes whole frames (default)\n"
+"                       1 = threads share each frame for low latency\n",
+
+"    [-segments #]  Split a seekable input file into # independently encoded\n"
+"                       segments, each in its own thread (default: 0 = off)\n",
+
+"    [-pin X]       Pin worker threads to CPUs: none (default), compact,\n"
+"                       scatter or a comma-separated list of CPU numbers\n",
+
 "    [-nosimd X]    Comma-separated list of SIMD instruction sets not to use\n"
-"                       Available sets are mmx, sse, sse2, sse3 and altivec.\n"
+"                       Available sets are mmx, sse, sse2, sse3, avx2, fma\n"
+"                       and altivec.\n"
 "                       No spaces are allowed between the sets and the commas.\n",
 
 "    [-b #]         CBR bitrate in kbps (default: about 96kbps per channel)\n",
 
 "    [-q #]         VBR quality [0 - 1023] (default: 240)\n",
 
+"    [-abr #]       ABR average bitrate in kbps (default: same as CBR)\n",
+
+"    [-pass #]      Two-pass encoding pass (default: 0 = single pass)\n"
+"                       1 = write statistics to the pass log file\n"
+"                       2 = encode in ABR mode using the pass log file\n",
+
+"    [-passlog X]   Pass log file (default: aften2pass.log)\n",
+
+"    [-size #]      Output size in bytes for the second pass\n"
+"                       (default: 0 = use the ABR bitrate)\n",
+
 "    [-fba #]       Fast bit allocation (default: 0)\n"
 "                       0 = more accurate encoding\n"
 "                       1 = faster encoding\n",
 
+"    [-spec #]      Bit allocation values tried at once (default: 0 = off)\n"
+"                       2 to 8, one per thread with -threadmode 1\n",
+
+"    [-snralloc #]  SNR offset allocation (default: 0 = one for all channels)\n"
+"                       1 = per channel\n"
+"                       2 = per channel and block\n",
+
 "    [-exps #]      Exponent strategy search size (default: 8)\n"
 "                       1 to 32 (lower is faster, higher is better quality)\n",
 
+"    [-expsopt #]   Optimal exponent strategy (default: 0)\n"
+"                       0 = search the -exps pre-defined sets\n"
+"                       1 = best strategy for each block\n",
+
 "    [-pad #]       Start-of-stream padding\n"
 "                       0 = no padding\n"
 "                       1 = 256 samples of padding (default)\n",
@@ -233,7 +266,7 @@ static const char *console_options[CONSOLE_OPTIONS_COUNT] = {
 "                       2 - Shows the statistics for each frame.\n"
 };
 
-#define ENCODING_OPTIONS_COUNT 12
+#define ENCODING_OPTIONS_COUNT 22
 
 static const char encoding_heading[18] = "ENCODING OPTIONS\n";
 static const char *encoding_options[ENCODING_OPTIONS_COUNT] = {
@@ -244,11 +277,40 @@ static const char *encoding_options[ENCODING_OPTIONS_COUNT] = {
 "                       value of 0 is the default and indicates that Aften\n"
 "                       should try to detect the number of CPUs.\n",
 
+"    [-threadmode #] Threading mode\n"
+"                       0 - Each thread encodes whole frames. This is the\n"
+"                           fastest mode, but each thread holds up to 4 frames,\n"
+"                           which delays the output. This is the default.\n"
+"                       1 - All threads work together on a single frame. Each\n"
+"                           frame is output as soon as its input was read,\n"
+"                           which is useful for live encoding.\n",
+
+"    [-segments #]  Segment-parallel encoding\n"
+"                       Splits the input into # segments on frame boundaries\n"
+"                       and encodes each one in its own thread with its own\n"
+"                       encoder. Each segment starts a few frames early so the\n"
+"                       encoder state is settled when its first frame is\n"
+"                       written. This scales better than -threads on machines\n"
+"                       with many CPUs, but requires seekable input of known\n"
+"                       length. 0 (default) disables it.\n",
+
+"    [-pin X]       Thread pinning\n"
+"                       Binds each worker thread to one CPU, which keeps its\n"
+"                       caches warm and its buffers in local memory.\n"
+"                       none    - Let the system place threads (default).\n"
+"                       compact - Fill all hardware threads of a core, then\n"
+"                                 the next core, then the next package.\n"
+"                       scatter - One thread per core, spread over packages,\n"
+"                                 before SMT siblings are used.\n"
+"                       A comma-separated list of CPU numbers without spaces\n"
+"                       pins thread i to the i-th CPU of the list.\n",
+
 "    [-nosimd X]    Comma-separated list of SIMD instruction sets not to use\n"
 "                       Aften will auto-detect available SIMD instruction sets\n"
 "                       for your CPU, so you shouldn't need to disable sets\n"
 "                       explicitly - unless for speed or debugging reasons.\n"
-"                       Available sets are mmx, sse, sse2, sse3 and altivec.\n"
+"                       Available sets are mmx, sse, sse2, sse3, avx2, fma\n"
+"                       and altivec.\n"
 "                       No spaces are allowed between the sets and the commas.\n"
 "                       Example: -nosimd sse2,sse3\n",
 
@@ -268,6 +330,33 @@ static const char *encoding_options[ENCODING_OPTIONS_COUNT] = {
 "                       value.  This scale will most likely be replaced in the\n"
 "                       future with a better quality measurement.\n",
 
+"    [-abr #]       ABR average bitrate\n"
+"                       Selects average bitrate mode, in which each frame gets\n"
+"                       the size it needs while the bitrate averaged over about\n"
+"                       one second is kept at the given value in kbps.  Any\n"
+"                       bitrate from 32 to 640 kbps can be used.  A value of 0\n"
+"                       selects the same bitrate as the CBR default.\n",
+
+"    [-pass #]      Two-pass encoding\n"
+"                       The first pass (-pass 1) only analyzes the input and\n"
+"                       writes statistics for each frame to the pass log file\n"
+"                       instead of the output file.  The second pass (-pass 2)\n"
+"                       encodes in ABR mode, with frame sizes planned from the\n"
+"                       statistics to meet the -abr or -b bitrate or the -size\n"
+"                       given over the whole file.  Both passes need the same\n"
+"                       input and options, apart from the bitrate.  The\n"
+"                       bandwidth is taken from the first pass.\n",
+
+"    [-passlog X]   Pass log file\n"
+"                       File for the statistics of the first pass.  The\n"
+"                       default is aften2pass.log.\n",
+
+"    [-size #]      Output size\n"
+"                       Size of the output in bytes for the second pass.  The\n"
+"                       frame sizes are chosen to come as close to it as they\n"
+"                       can without going over.  The default of 0 uses the -abr\n"
+"                       bitrate instead.\n",
+
 "    [-fba #]      Fast bit allocation\n"
 "                       Fast bit allocation is a less-accurate search method\n"
 "                       for CBR bit allocation.  It only narrows down the SNR\n"
@@ -276,6 +365,27 @@ static const char *encoding_options[ENCODING_OPTIONS_COUNT] = {
 "                       may not give the same results each time when using\n"
 "                       parallel encoding.\n",
 
+"    [-spec #]     Speculative bit allocation\n"
+"                       The bit allocation search counts the bits for # SNR\n"
+"                       values at once instead of one after the other.  With\n"
+"                       intra-frame threading (-threadmode 1), each value is\n"
+"                       counted on its own thread, which lowers the encoding\n"
+"                       latency of each frame on a machine with idle CPUs.\n"
+"                       The output is the same as without this option.  The\n"
+"                       default of 0 turns it off, otherwise it can be 2 to 8.\n",
+
+"    [-snralloc #] SNR offset allocation\n"
+"                       The fine SNR offset can be set for each channel.  With\n"
+"                       this option, the bits left over by the common SNR\n"
+"                       offset of a frame go to the channels which code the\n"
+"                       most mantissas more finely per bit, instead of being\n"
+"                       wasted.  Mode 2 also sets them separately for the\n"
+"                       blocks where the fast gain codes change, which are the\n"
+"                       only blocks that can send new SNR offsets.\n"
+"                       0 = one SNR offset for all channels (default)\n"
+"                       1 = per channel\n"
+"                       2 = per channel and block\n",
+
 "    [-exps #]     Exponent strategy search size\n"
 "                       The encoder determines the best combination of\n"
 "                       exponent strategies for a frame by searching through\n"
@@ -284,6 +394,16 @@ static const char *encoding_options[ENCODING_OPTIONS_COUNT] = {
 "                       value can range from 1 (lower quality but faster) to\n"
 "                       32 (higher quality but slower).  The default value is 8.\n",
 
+"    [-expsopt #]  Optimal exponent strategy\n"
+"                       Instead of searching the pre-defined exponent strategy\n"
+"                       sets, the strategy of each block is chosen freely to\n"
+"                       give the lowest sum of exponent error and exponent\n"
+"                       bits over the whole frame.  This finds combinations\n"
+"                       which are not in the list, and is a little slower\n"
+"                       than -exps 32.  -exps is ignored when this is used.\n"
+"                       0 = search the pre-defined sets (default)\n"
+"                       1 = best strategy for each block\n",
+
 "    [-pad #]      Start-of-stream padding\n"
 "                       The AC-3 format uses an overlap/add cycle for encoding\n"
 "                       each block.  By default, Aften pads the delay buffer\n"
@@ -309,7 +429,7 @@ static const char *encoding_options[ENCODING_OPTIONS_COUNT] = {
 "                       default setting.\n"
 "                       When -2 is used, a bandwidth is chosen for each frame\n"
 "                       based on CBR frame size and a target quality of 240.\n"
-"                       Variable bandwidth cannot be used with VBR mode.\n",
+"                       Variable bandwidth can only be used with CBR mode.\n",
 
 "    [-wmin #]      Minimum bandwidth\n"
 "                       For variable bandwidth mode (-2), this option sets the\n"
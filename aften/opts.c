@@ -29,6 +29,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stddef.h>
+#include <limits.h>
 
 #include "opts.h"
 #include "pcm.h"
@@ -160,10 +161,14 @@ parse_nosimd(PARSE_PARAMS)
             wanted_simd_instructions->sse2 = 0;
         else if (!strncmp(&simd[i], "sse3", 5))
             wanted_simd_instructions->sse3 = 0;
+        else if (!strncmp(&simd[i], "avx2", 5))
+            wanted_simd_instructions->avx2 = 0;
+        else if (!strncmp(&simd[i], "fma", 4))
+            wanted_simd_instructions->fma = 0;
         else if (!strncmp(&simd[i], "altivec", 8))
             wanted_simd_instructions->altivec = 0;
         else {
-            fprintf(stderr, "invalid simd instruction set: %s. must be mmx, sse, sse2, sse3 or altivec.\n", &simd[i]);
+            fprintf(stderr, "invalid simd instruction set: %s. must be mmx, sse, sse2, sse3, avx2, fma or altivec.\n", &simd[i]);
             return 1;
         }
         if (last)
@@ -172,6 +177,55 @@ parse_nosimd(PARSE_PARAMS)
     return 0;
 }
 
+static int
+parse_pin(PARSE_PARAMS)
+{
+    AftenSystemParams *system = &opts->s->system;
+    char *p = param;
+    int n = 0;
+
+    if (!strncmp(param, "none", 5)) {
+        system->pin_policy = AFTEN_PIN_NONE;
+        return 0;
+    } else if (!strncmp(param, "compact", 8)) {
+        system->pin_policy = AFTEN_PIN_COMPACT;
+        return 0;
+    } else if (!strncmp(param, "scatter", 8)) {
+        system->pin_policy = AFTEN_PIN_SCATTER;
+        return 0;
+    }
+
+    // comma-separated list of CPU numbers
+    while (1) {
+        char *endp;
+        long cpu = strtol(p, &endp, 10);
+        if (endp == p || cpu < 0 || n >= MAX_NUM_THREADS ||
+                (*endp && *endp != ',')) {
+            fprintf(stderr, "invalid parameter -pin %s. must be none, compact, "
+                            "scatter or a list of at most %d CPUs.\n",
+                    param, MAX_NUM_THREADS);
+            return 1;
+        }
+        opts->pin_cpus[n++] = cpu;
+        if (!*endp)
+            break;
+        p = endp + 1;
+    }
+    system->pin_policy = AFTEN_PIN_LIST;
+    system->pin_cpus = opts->pin_cpus;
+    system->n_pin_cpus = n;
+
+    return 0;
+}
+
+static int
+parse_abr(PARSE_PARAMS)
+{
+    opts->s->params.encoding_mode = AFTEN_ENC_MODE_ABR;
+    return parse_integer_value(atoi(param), item->min, item->max, arg,
+                               &opts->s->params.bitrate);
+}
+
 static int
 parse_q(PARSE_PARAMS)
 {
@@ -297,6 +351,13 @@ parse_ch(PARSE_PARAMS)
     return 0;
 }
 
+static int
+parse_passlog(PARSE_PARAMS)
+{
+    opts->passlog = param;
+    return 0;
+}
+
 static int
 parse_raw_fmt(PARSE_PARAMS)
 {
@@ -354,7 +415,7 @@ parse_xbsi2_opt(PARSE_PARAMS)
     return parse_simple_int_s(arg, param, item, opts, priv);
 }
 
-#define OPTION_ITEM_COUNT 43
+#define OPTION_ITEM_COUNT 53
 
 /**
  * list of commandline options, in alphabetical order.
@@ -362,6 +423,7 @@ parse_xbsi2_opt(PARSE_PARAMS)
 static const OptionItem options_list[OPTION_ITEM_COUNT] = {
 //     NAME         FLAGS                         MIN             MAX   PARSE FUNCTION      OFFSET
 //    ------       -------                       -----           ----- ----------------    --------
+    { "abr",        OPTION_FLAGS_NONE,              0,            640,  parse_abr,          0                                                   },
     { "acmod",      OPTION_FLAGS_NONE,              0,              7,  parse_simple_int_s, offsetof(AftenContext, acmod)                       },
     { "adconvtyp",  OPTION_FLAGS_NONE,              0,              1,  parse_simple_int_s, offsetof(AftenContext, meta.adconvtyp)              },
     { "b",          OPTION_FLAGS_NONE,              0,            640,  parse_simple_int_s, offsetof(AftenContext, params.bitrate)              },
@@ -378,6 +440,7 @@ static const OptionItem options_list[OPTION_ITEM_COUNT] = {
     { "dsurexmod",  OPTION_FLAGS_NONE,              0,              2,  parse_xbsi2_opt,    offsetof(AftenContext, meta.dsurexmod)              },
     { "dynrng",     OPTION_FLAGS_NONE,              0,              5,  parse_simple_int_s, offsetof(AftenContext, params.dynrng_profile)       },
     { "exps",       OPTION_FLAGS_NONE,              1,             32,  parse_simple_int_s, offsetof(AftenContext, params.expstr_search)        },
+    { "expsopt",    OPTION_FLAGS_NONE,              0,              1,  parse_simple_int_s, offsetof(AftenContext, params.expstr_optimal)       },
     { "fba",        OPTION_FLAGS_NONE,              0,              1,  parse_simple_int_s, offsetof(AftenContext, params.bitalloc_fast)        },
     { "h",          OPTION_FLAG_NO_PARAM,           0,              0,  parse_h,            0                                                   },
     { "lfe",        OPTION_FLAGS_NONE,              0,              1,  parse_simple_int_s, offsetof(AftenContext, lfe)                         },
@@ -390,13 +453,21 @@ static const OptionItem options_list[OPTION_ITEM_COUNT] = {
     { "m",          OPTION_FLAGS_NONE,              0,              1,  parse_simple_int_s, offsetof(AftenContext, params.use_rematrixing)      },
     { "nosimd",     OPTION_FLAGS_NONE,              0,              0,  parse_nosimd,       0                                                   },
     { "pad",        OPTION_FLAGS_NONE,              0,              1,  parse_simple_int_o, offsetof(CommandOptions, pad_start)                 },
+    { "pass",       OPTION_FLAGS_NONE,              0,              2,  parse_simple_int_s, offsetof(AftenContext, params.pass)                 },
+    { "passlog",    OPTION_FLAGS_NONE,              0,              0,  parse_passlog,      0                                                   },
+    { "pin",        OPTION_FLAGS_NONE,              0,              0,  parse_pin,          0                                                   },
     { "q",          OPTION_FLAGS_NONE,              0,           1023,  parse_q,            0                                                   },
     { "raw_ch",     OPTION_FLAGS_NONE,              1,              6,  parse_raw_option,   offsetof(CommandOptions, raw_ch)                    },
     { "raw_fmt",    OPTION_FLAGS_NONE,              0,              0,  parse_raw_fmt,      0                                                   },
     { "raw_sr",     OPTION_FLAGS_NONE,              1,          48000,  parse_raw_option,   offsetof(CommandOptions, raw_sr)                    },
     { "readtoeof",  OPTION_FLAGS_NONE,              0,              1,  parse_simple_int_o, offsetof(CommandOptions, read_to_eof)               },
     { "s",          OPTION_FLAGS_NONE,              0,              1,  parse_simple_int_s, offsetof(AftenContext, params.use_block_switching)  },
+    { "segments",   OPTION_FLAGS_NONE,              0,MAX_NUM_SEGMENTS, parse_simple_int_o, offsetof(CommandOptions, segments)                  },
+    { "size",       OPTION_FLAGS_NONE,              0,        INT_MAX,  parse_simple_int_s, offsetof(AftenContext, params.target_size)         },
     { "smix",       OPTION_FLAGS_NONE,              0,              2,  parse_simple_int_s, offsetof(AftenContext, meta.surmixlev)              },
+    { "spec",       OPTION_FLAGS_NONE,              0,              8,  parse_simple_int_s, offsetof(AftenContext, params.bitalloc_spec)        },
+    { "snralloc",   OPTION_FLAGS_NONE,              0,              2,  parse_simple_int_s, offsetof(AftenContext, params.snr_alloc)            },
+    { "threadmode", OPTION_FLAGS_NONE,              0,              1,  parse_simple_int_s, offsetof(AftenContext, system.threading_mode)       },
     { "threads",    OPTION_FLAGS_NONE,              0,MAX_NUM_THREADS,  parse_simple_int_s, offsetof(AftenContext, system.n_threads)            },
     { "v",          OPTION_FLAGS_NONE,              0,              2,  parse_simple_int_s, offsetof(AftenContext, verbose)                     },
     { "version",    OPTION_FLAG_NO_PARAM,           0,              0,  parse_version,      0                                                   },
@@ -422,8 +493,10 @@ parse_commandline(int argc, char **argv, CommandOptions *opts)
     opts->num_input_files = 0;
     memset(opts->infile, 0, A52_NUM_SPEAKERS * sizeof(char *));
     opts->outfile = NULL;
+    opts->passlog = "aften2pass.log";
     opts->pad_start = 1;
     opts->read_to_eof = 0;
+    opts->segments = 0;
     opts->raw_input = 0;
     opts->raw_fmt = PCM_SAMPLE_FMT_S16;
     opts->raw_order = PCM_BYTE_ORDER_LE;
@@ -31,15 +31,19 @@
 #include "pcm.h"
 
 #define A52_NUM_SPEAKERS 9
+#define MAX_NUM_SEGMENTS 256
 
 typedef struct {
     int chmap;
     int num_input_files;
     char *infile[A52_NUM_SPEAKERS];
     char *outfile;
+    const char *passlog;
     AftenContext *s;
     int pad_start;
     int read_to_eof;
+    int segments;
+    int pin_cpus[MAX_NUM_THREADS];
     int raw_input;
     enum PcmSampleFormat raw_fmt;
     int raw_order;
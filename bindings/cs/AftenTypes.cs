@@ -57,7 +57,49 @@ namespace Aften
 		/// <summary>
 		/// VBR
 		/// </summary>
-		Vbr
+		Vbr,
+		/// <summary>
+		/// ABR
+		/// </summary>
+		Abr
+	}
+
+	/// <summary>
+	/// Aften Threading Mode
+	/// </summary>
+	public enum ThreadingMode
+	{
+		/// <summary>
+		/// Each thread encodes whole frames
+		/// </summary>
+		Frame = 0,
+		/// <summary>
+		/// All threads work together on a single frame
+		/// </summary>
+		Intra
+	}
+
+	/// <summary>
+	/// Aften Thread Pinning Policy
+	/// </summary>
+	public enum PinPolicy
+	{
+		/// <summary>
+		/// Threads are placed by the operating system
+		/// </summary>
+		None = 0,
+		/// <summary>
+		/// Fill the hardware threads of one core before the next core
+		/// </summary>
+		Compact,
+		/// <summary>
+		/// One thread per core before using SMT siblings
+		/// </summary>
+		Scatter,
+		/// <summary>
+		/// Use the CPUs in PinCpus
+		/// </summary>
+		List
 	}
 
 	/// <summary>
@@ -225,6 +267,14 @@ namespace Aften
 		/// PowerPC Altivec
 		/// </summary>
 		public bool Altivec;
+		/// <summary>
+		/// AVX2
+		/// </summary>
+		public bool Avx2;
+		/// <summary>
+		/// FMA
+		/// </summary>
+		public bool Fma;
 	}
 
 	/// <summary>
@@ -240,6 +290,53 @@ namespace Aften
 		/// </summary>
 		public int ThreadsCount;
 
+		/// <summary>
+		/// Threading mode.
+		/// Frame : each thread encodes whole frames. This gives the
+		///         best throughput, but output is delayed by up to
+		///         4 frames per thread.
+		/// Intra : all threads work together on a single frame, so
+		///         each frame is returned by the same call which
+		///         passed its samples. Use this for low latency.
+		/// default is Frame
+		/// </summary>
+		public ThreadingMode ThreadingMode;
+
+		/// <summary>
+		/// Shared worker threads.
+		/// If set, frames are encoded by the threads of this pool instead of
+		/// threads owned by the context. ThreadsCount then is the number of frame
+		/// slots the context may keep busy at once; 0 means one per pool thread.
+		/// Only the frame threading mode can be used with a pool.
+		/// default is IntPtr.Zero
+		/// </summary>
+		public IntPtr Pool;
+
+		/// <summary>
+		/// Thread pinning policy.
+		/// None    : threads are placed by the operating system
+		/// Compact : fill the hardware threads of one core, then the
+		///           next core, then the next package
+		/// Scatter : one thread per core, spread over the packages,
+		///           before using SMT siblings
+		/// List    : thread i runs on PinCpus[i % PinCpusCount]
+		/// Threads of a pool are not pinned.
+		/// default is None
+		/// </summary>
+		public PinPolicy PinPolicy;
+
+		/// <summary>
+		/// Pointer to the CPU numbers used with PinPolicy.List
+		/// default is IntPtr.Zero
+		/// </summary>
+		public IntPtr PinCpus;
+
+		/// <summary>
+		/// Number of entries in PinCpus
+		/// default is 0
+		/// </summary>
+		public int PinCpusCount;
+
 		/// <summary>
 		/// Available SIMD instruction sets; shouldn't be modified
 		/// </summary>
@@ -260,6 +357,7 @@ namespace Aften
 		/// Bitrate selection mode.
 		/// AFTEN_ENC_MODE_CBR : constant bitrate
 		/// AFTEN_ENC_MODE_VBR : variable bitrate
+		/// AFTEN_ENC_MODE_ABR : average bitrate
 		/// default is CBR
 		/// </summary>
 		public EncodingMode EncodingMode;
@@ -312,6 +410,9 @@ namespace Aften
 		/// default is 0
 		/// For CBR mode, this selects bitrate based on the number of channels.
 		/// For VBR mode, this sets the maximum bitrate to 640 kbps.
+		/// In ABR mode this is the average bitrate to keep. Any value between
+		/// the lowest and the highest valid bitrate can be used, and 0 selects
+		/// the same bitrate as in CBR mode.
 		/// </summary>
 		public int Bitrate;
 
@@ -382,6 +483,74 @@ namespace Aften
 		/// default is 60.
 		/// </summary>
 		public int MaximumBandwidthCode;
+
+		/// <summary>
+		/// Two-pass encoding.
+		/// 0 : single pass
+		/// 1 : first pass. Only the analysis is run, and instead of coded frames
+		///     the encoding functions hand back the statistics of each frame,
+		///     which are to be stored in order for the second pass.
+		/// 2 : second pass, in ABR mode. The frame sizes are planned from the
+		///     statistics in PassStats, to meet the average bitrate or the size
+		///     given in TargetSize.
+		/// Both passes need the same input and encoding parameters, apart from
+		/// the bitrate. The second pass uses the bandwidth of the first one.
+		/// default is 0
+		/// </summary>
+		public int Pass;
+
+		/// <summary>
+		/// Statistics from the first pass, for the second pass.
+		/// They are only read by aften_encode_init().
+		/// default is IntPtr.Zero
+		/// </summary>
+		public IntPtr PassStats;
+
+		/// <summary>
+		/// Size of PassStats in bytes.
+		/// default is 0
+		/// </summary>
+		public int PassStatsSize;
+
+		/// <summary>
+		/// Size of the coded stream in bytes for the second pass.
+		/// The frame sizes are chosen to come as close to it as they can
+		/// without going over. 0 means the average bitrate is used instead.
+		/// default is 0
+		/// </summary>
+		public int TargetSize;
+
+		/// <summary>
+		/// Speculative bit allocation
+		/// Number of snroffst values which the bit allocation search counts at
+		/// once. In intra-frame threading mode, each of them is counted on its own
+		/// thread, which shortens the search of each frame if there are idle
+		/// CPUs, at the cost of more work in total. The output does not change.
+		/// 0 turns this off, otherwise 2 to 8 values can be used.
+		/// default is 0
+		/// </summary>
+		public int SpeculativeBitAllocation;
+
+		/// <summary>
+		/// SNR offset allocation
+		/// 0 = one SNR offset for all channels
+		/// 1 = fine SNR offset per channel
+		/// 2 = fine SNR offset per channel and per run of blocks which starts
+		///     where the fast gain codes change
+		/// Bits left over by the common SNR offset are handed to the channels
+		/// whose next fine step codes the most mantissas more finely per bit.
+		/// default is 0
+		/// </summary>
+		public int SnrOffsetAllocation;
+
+		/// <summary>
+		/// Optimal exponent strategy
+		/// 0 = search the pre-defined exponent strategy sets (see ExponentStrategySearchSize)
+		/// 1 = choose the strategy of each block freely, for the lowest sum of
+		///     exponent error and exponent bits over the whole frame
+		/// default is 0
+		/// </summary>
+		public int OptimalExponentStrategy;
 	}
 
 	/// <summary>
@@ -482,6 +651,11 @@ namespace Aften
 		/// BandwidthCode
 		/// </summary>
 		public int BandwidthCode;
+
+		/// <summary>
+		/// Number of bit allocation passes it took to find the frame's snroffst
+		/// </summary>
+		public int BitAllocCalls;
 	}
 
 	/// <summary>
@@ -561,6 +735,26 @@ namespace Aften
 		/// </summary>
 		private IntPtr InitialSamples;
 
+		/// <summary>
+		/// Position in the stream of the first frame to encode
+		/// </summary>
+		private int StartFrame;
+
+		/// <summary>
+		/// Asynchronous encoding; not supported by the bindings yet
+		/// </summary>
+		private int Async;
+
+		/// <summary>
+		/// Frame callback for asynchronous encoding
+		/// </summary>
+		private IntPtr FrameCallback;
+
+		/// <summary>
+		/// Passed to the frame callback
+		/// </summary>
+		private IntPtr CallbackOpaque;
+
 		/// <summary>
 		/// Used internally by the encoder. The user should leave this alone.
 		/// It is allocated in aften_encode_init and free'd in aften_encode_close.
@@ -83,6 +83,7 @@ typedef struct A52Block {
     int dithflag[A52_MAX_CHANNELS];
     int dynrng;
     uint8_t exp[A52_MAX_CHANNELS][256];
+    uint8_t raw_exp[A52_MAX_CHANNELS][256]; /* extracted, before encoding */
     int16_t psd[A52_MAX_CHANNELS][256];
     int16_t mask[A52_MAX_CHANNELS][50];
     uint8_t exp_strategy[A52_MAX_CHANNELS];
@@ -91,6 +92,7 @@ typedef struct A52Block {
     uint8_t bap[A52_MAX_CHANNELS][256];
     uint16_t qmant[A52_MAX_CHANNELS][256];
     int fgaincod[A52_MAX_CHANNELS];
+    int fsnroffst[A52_MAX_CHANNELS];
     int write_snr;
 } A52Block;
 
@@ -107,7 +109,6 @@ typedef struct A52Frame {
     int bit_rate;
     int bwcode;
 
-    FLOAT input_audio[A52_MAX_CHANNELS][A52_SAMPLES_PER_FRAME];
     A52Block blocks[A52_NUM_BLOCKS];
     int frame_bits;
     int exp_bits;
@@ -120,9 +121,11 @@ typedef struct A52Frame {
     int sgaincod, sdecaycod, fdecaycod, dbkneecod, floorcod;
     A52BitAllocParams bit_alloc;
     int csnroffst;
-    int fsnroffst;
+    int bit_alloc_calls;
     int ncoefs[A52_MAX_CHANNELS];
-    int expstr_set[A52_MAX_CHANNELS];
+    int exp_ncoefs[A52_MAX_CHANNELS];   // ncoefs the exponents are encoded for
+    int bit_alloc_ready[A52_MAX_CHANNELS]; // psd and mask match the exponents
+    int expstr_set[A52_MAX_CHANNELS];   // -1 if not a pre-defined set
     uint8_t rematflg[4];
 } A52Frame;
 
@@ -43,12 +43,19 @@ int nexpgrptab[3][256] = {{0}};
 static const uint8_t rematbndtab[5] = { 13, 25, 37, 61, 252 };
 
 
+static void filter_samples(A52Context *ctx, A52InputFrame *input);
+static void plan_frame_size(A52Context *ctx, A52InputFrame *input);
+static int count_frame_size(A52Context *ctx);
 static void copy_samples(A52ThreadContext *tctx);
-static int convert_samples_from_src(A52ThreadContext *tctx, const void *vsrc,
-                                    int count);
+static int convert_samples_from_src(A52Context *ctx,
+                                    FLOAT dest[A52_MAX_CHANNELS][A52_SAMPLES_PER_FRAME],
+                                    const void *vsrc, int count);
 
 static int begin_encode_frame(A52ThreadContext *tctx);
 static int begin_transcode_frame(A52ThreadContext *tctx);
+static void run_frame_tasks_serial(A52ThreadContext *tctx, A52FrameTask task,
+                                   int n_tasks);
+static int uses_job_queue(A52Context *ctx);
 
 static int
 prepare_transcode_common(A52ThreadContext *tctx, const void *input_frame_buffer,
@@ -78,17 +85,24 @@ prepare_transcode_common(A52ThreadContext *tctx, const void *input_frame_buffer,
 
 #ifndef NO_THREADS
 static int threaded_worker(void* vtctx);
+static int task_worker(void* vtctx);
+static int pool_worker(void* vpool);
+static int deliver_worker(void* vctx);
+static void pool_lock(AftenPool *pool);
+static void pool_unlock(AftenPool *pool);
+static void run_frame_tasks_pool(A52ThreadContext *tctx, A52FrameTask task,
+                                 int n_tasks);
 
 static int
-prepare_encode(A52ThreadContext *tctx, const void *samples, int count, UNUSED(int *info))
+prepare_encode(A52Context *ctx, A52Job *job, const void *samples, int count, UNUSED(int *info))
 {
-    A52Context *ctx = tctx->ctx;
     // append extra silent frame if final frame is > 1280 samples, to flush 256 samples in mdct
     if (ctx->last_samples_count <= (A52_SAMPLES_PER_FRAME - 256) && ctx->last_samples_count != -1) {
-        tctx->state = END;
-        --ctx->ts.threads_running;
+        ctx->ts.flushing = 1;
     } else { // convert sample format and de-interleave channels
-        convert_samples_from_src(tctx, samples, count);
+        convert_samples_from_src(ctx, job->input.audio, samples, count);
+        filter_samples(ctx, &job->input);
+        plan_frame_size(ctx, &job->input);
         ctx->last_samples_count = count;
     }
 
@@ -96,17 +110,16 @@ prepare_encode(A52ThreadContext *tctx, const void *samples, int count, UNUSED(in
 }
 
 static int
-prepare_transcode(A52ThreadContext *tctx, const void *input_frame_buffer, int input_frame_buffer_size, int *want_bytes)
+prepare_transcode(A52Context *ctx, UNUSED(A52Job *job), const void *input_frame_buffer, int input_frame_buffer_size, int *want_bytes)
 {
     if (!input_frame_buffer_size) {
-        tctx->state = END;
-        --tctx->ctx->ts.threads_running;
+        ctx->ts.flushing = 1;
         *want_bytes = 0;
 
         return 0;
     }
 
-    return prepare_transcode_common(tctx, input_frame_buffer, input_frame_buffer_size, want_bytes);
+    return prepare_transcode_common(ctx->tctx, input_frame_buffer, input_frame_buffer_size, want_bytes);
 }
 #endif
 
@@ -141,6 +154,12 @@ set_available_simd_instructions(AftenSimdInstructions *simd_instructions)
 #ifdef HAVE_SSE3
     simd_instructions->sse3 = cpu_caps_have_sse3();
 #endif
+#ifdef HAVE_AVX2
+    simd_instructions->avx2 = cpu_caps_have_avx2();
+#endif
+#ifdef HAVE_FMA
+    simd_instructions->fma = cpu_caps_have_fma();
+#endif
 /* Following SIMD code doesn't exist yet, so don't set it available */
 #if 0
 #ifdef HAVE_SSSE3
@@ -179,6 +198,11 @@ aften_set_defaults(AftenContext *s)
     set_available_simd_instructions(&s->system.available_simd_instructions);
     s->system.wanted_simd_instructions = s->system.available_simd_instructions;
     s->system.n_threads = 0;
+    s->system.threading_mode = AFTEN_THREADS_FRAME;
+    s->system.pool = NULL;
+    s->system.pin_policy = AFTEN_PIN_NONE;
+    s->system.pin_cpus = NULL;
+    s->system.n_pin_cpus = 0;
 
     s->verbose = 1;
     s->channels = -1;
@@ -203,6 +227,13 @@ aften_set_defaults(AftenContext *s)
     s->params.dynrng_profile = DYNRNG_PROFILE_NONE;
     s->params.min_bwcode = 0;
     s->params.max_bwcode = 60;
+    s->params.pass = 0;
+    s->params.pass_stats = NULL;
+    s->params.pass_stats_size = 0;
+    s->params.target_size = 0;
+    s->params.bitalloc_spec = 0;
+    s->params.snr_alloc = 0;
+    s->params.expstr_optimal = 0;
 
     s->meta.cmixlev = 0;
     s->meta.surmixlev = 0;
@@ -222,8 +253,14 @@ aften_set_defaults(AftenContext *s)
     s->status.quality = 0;
     s->status.bit_rate = 0;
     s->status.bwcode = 0;
+    s->status.bit_alloc_calls = 0;
 
     s->initial_samples = NULL;
+    s->start_frame = 0;
+
+    s->async = 0;
+    s->frame_callback = NULL;
+    s->callback_opaque = NULL;
 }
 
 int
@@ -245,6 +282,10 @@ aften_encode_init(AftenContext *s)
         fprintf(stderr, "error allocating memory for A52Context\n");
         return -1;
     }
+#ifndef NO_THREADS
+    // aften_encode_close() may run after any failure below
+    ctx->notify_fd[0] = ctx->notify_fd[1] = -1;
+#endif
     mdct_init(ctx);
     s->private_context = ctx;
     ctx->params = s->params;
@@ -355,9 +396,14 @@ found:
 
     ctx->last_samples_count = -1;
 
+    // the second pass always averages, a constant bitrate becomes the average
+    if (ctx->params.pass == 2 && ctx->params.encoding_mode == AFTEN_ENC_MODE_CBR)
+        ctx->params.encoding_mode = AFTEN_ENC_MODE_ABR;
+
     // bitrate & frame size
     brate = s->params.bitrate;
-    if (ctx->params.encoding_mode == AFTEN_ENC_MODE_CBR) {
+    if (ctx->params.encoding_mode == AFTEN_ENC_MODE_CBR ||
+            ctx->params.encoding_mode == AFTEN_ENC_MODE_ABR) {
         if (brate == 0) {
             switch (ctx->n_channels) {
                 case 1: brate =  96; break;
@@ -367,28 +413,41 @@ found:
                 case 5: brate = 448; break;
             }
         }
-    } else if (ctx->params.encoding_mode == AFTEN_ENC_MODE_VBR) {
+    }
+    if (ctx->params.encoding_mode == AFTEN_ENC_MODE_VBR) {
         if (s->params.quality < 0 || s->params.quality > 1023) {
             fprintf(stderr, "invalid quality setting\n");
             return -1;
         }
-    } else {
+    } else if (ctx->params.encoding_mode == AFTEN_ENC_MODE_ABR) {
+        if (brate < (a52_bitrate_tab[0] >> ctx->halfratecod) ||
+                brate > (a52_bitrate_tab[18] >> ctx->halfratecod)) {
+            fprintf(stderr, "invalid bitrate\n");
+            return -1;
+        }
+    } else if (ctx->params.encoding_mode != AFTEN_ENC_MODE_CBR) {
         return -1;
     }
 
-    for (i = 0; i < 19; i++) {
-        if ((a52_bitrate_tab[i] >> ctx->halfratecod) == brate)
-            break;
-    }
-    if (i == 19) {
-        if (ctx->params.encoding_mode == AFTEN_ENC_MODE_CBR) {
-            fprintf(stderr, "invalid bitrate\n");
-            return -1;
+    if (ctx->params.encoding_mode == AFTEN_ENC_MODE_ABR) {
+        // any frame size may be used to keep the average
+        ctx->frmsizecod = 37;
+        ctx->target_bitrate = brate;
+    } else {
+        for (i = 0; i < 19; i++) {
+            if ((a52_bitrate_tab[i] >> ctx->halfratecod) == brate)
+                break;
+        }
+        if (i == 19) {
+            if (ctx->params.encoding_mode == AFTEN_ENC_MODE_CBR) {
+                fprintf(stderr, "invalid bitrate\n");
+                return -1;
+            }
+            i = 18;
         }
-        i = 18;
+        ctx->frmsizecod = i*2;
+        ctx->target_bitrate = a52_bitrate_tab[i] >> ctx->halfratecod;
     }
-    ctx->frmsizecod = i*2;
-    ctx->target_bitrate = a52_bitrate_tab[i] >> ctx->halfratecod;
 
     if (ctx->params.expstr_search < 1 || ctx->params.expstr_search > 32) {
         fprintf(stderr, "invalid exponent strategy search size: %d\n",
@@ -399,12 +458,12 @@ found:
     crc_init();
     a52_window_init(&ctx->winf);
     exponent_init(&ctx->expf);
+    bit_alloc_init(&ctx->baf);
     dynrng_init();
 
-    last_quality = 240;
     if (ctx->params.encoding_mode == AFTEN_ENC_MODE_VBR)
         last_quality = ctx->params.quality;
-    else if (ctx->params.encoding_mode == AFTEN_ENC_MODE_CBR)
+    else
         last_quality = ((((ctx->target_bitrate/ctx->n_channels)*35)/24)+95)+(25*ctx->halfratecod);
 
     if (s->params.bwcode < -2 || s->params.bwcode > 60) {
@@ -421,8 +480,8 @@ found:
                 fprintf(stderr, "invalid min/max bandwidth code\n");
                 return -1;
             }
-            if (ctx->params.encoding_mode == AFTEN_ENC_MODE_VBR) {
-                fprintf(stderr, "variable bandwidth mode cannot be used with variable bitrate mode\n");
+            if (ctx->params.encoding_mode != AFTEN_ENC_MODE_CBR) {
+                fprintf(stderr, "variable bandwidth mode can only be used with constant bitrate mode\n");
                 return -1;
             }
         }
@@ -432,6 +491,49 @@ found:
         ctx->fixed_bwcode = ctx->params.bwcode;
     }
 
+    if (ctx->params.bitalloc_spec < 0 || ctx->params.bitalloc_spec == 1 ||
+            ctx->params.bitalloc_spec > A52_SNR_CANDIDATES) {
+        fprintf(stderr, "invalid speculative bit allocation: %d\n",
+                ctx->params.bitalloc_spec);
+        return -1;
+    }
+
+    if (ctx->params.snr_alloc < 0 || ctx->params.snr_alloc > 2) {
+        fprintf(stderr, "invalid SNR offset allocation: %d\n",
+                ctx->params.snr_alloc);
+        return -1;
+    }
+
+    if (ctx->params.expstr_optimal < 0 || ctx->params.expstr_optimal > 1) {
+        fprintf(stderr, "invalid optimal exponent strategy: %d\n",
+                ctx->params.expstr_optimal);
+        return -1;
+    }
+
+    if (s->start_frame < 0) {
+        fprintf(stderr, "invalid start frame: %d\n", s->start_frame);
+        return -1;
+    }
+
+    if (ctx->params.pass < 0 || ctx->params.pass > 2 ||
+            ctx->params.target_size < 0) {
+        fprintf(stderr, "invalid two-pass encoding parameters\n");
+        return -1;
+    }
+    if (ctx->params.pass && ctx->params.bwcode == -2) {
+        fprintf(stderr, "variable bandwidth mode cannot be used with two-pass encoding\n");
+        return -1;
+    }
+    if (ctx->params.pass == 2) {
+        if (ctx->params.encoding_mode != AFTEN_ENC_MODE_ABR) {
+            fprintf(stderr, "the second pass cannot be used with VBR mode\n");
+            return -1;
+        }
+        // takes the bandwidth code of the first pass
+        if (plan_second_pass(ctx))
+            return -1;
+    }
+
     if (s->mode == AFTEN_ENCODE) {
         // can't do block switching with low sample rate due to the high-pass filter
         if (ctx->sample_rate <= 16000)
@@ -509,58 +611,151 @@ found:
         }
     }
 
+    ctx->last_quality = last_quality;
+    ctx->snr_slope = 32 * ctx->n_channels;
+    ctx->last_exp_bits = -1;
+    ctx->snr_weight = 0;
+
     // Initialize thread specific contexts
+    if (s->system.threading_mode != AFTEN_THREADS_FRAME &&
+            s->system.threading_mode != AFTEN_THREADS_INTRA) {
+        fprintf(stderr, "invalid threading mode\n");
+        return -1;
+    }
+    ctx->threading_mode = s->system.threading_mode;
+    if (s->system.pin_policy < AFTEN_PIN_NONE || s->system.pin_policy > AFTEN_PIN_LIST) {
+        fprintf(stderr, "invalid thread pinning policy\n");
+        return -1;
+    }
+    if (s->system.pin_policy == AFTEN_PIN_LIST &&
+            (!s->system.pin_cpus || s->system.n_pin_cpus <= 0)) {
+        fprintf(stderr, "thread pinning with a CPU list needs pin_cpus\n");
+        return -1;
+    }
+    ctx->run_frame_tasks = run_frame_tasks_serial;
+    if (s->system.pool) {
+#ifndef NO_THREADS
+        if (ctx->threading_mode != AFTEN_THREADS_FRAME) {
+            fprintf(stderr, "a shared thread pool needs frame threading mode\n");
+            return -1;
+        }
+        ctx->shared_pool = s->system.pool;
+        pool_lock(ctx->shared_pool);
+        ctx->shared_pool->n_contexts++;
+        pool_unlock(ctx->shared_pool);
+        if (s->system.n_threads <= 0)
+            s->system.n_threads = ctx->shared_pool->n_threads;
+#else
+        fprintf(stderr, "libaften was built without thread support\n");
+        return -1;
+#endif
+    }
+    if (s->async) {
+#ifndef NO_THREADS
+        if (ctx->threading_mode != AFTEN_THREADS_FRAME || s->mode != AFTEN_ENCODE) {
+            fprintf(stderr, "asynchronous encoding needs frame threading mode\n");
+            return -1;
+        }
+        ctx->async = 1;
+        ctx->frame_callback = s->frame_callback;
+        ctx->callback_opaque = s->callback_opaque;
+#else
+        fprintf(stderr, "libaften was built without thread support\n");
+        return -1;
+#endif
+    }
+#ifndef NO_THREADS
+    // workers post the descriptor when there is no callback to wait for
+    if (ctx->async && !ctx->frame_callback && thread_notify_init(ctx->notify_fd)) {
+        fprintf(stderr, "error creating the notification descriptor\n");
+        return -1;
+    }
+#endif
     ctx->n_threads = (s->system.n_threads > 0) ? s->system.n_threads : get_ncpus();
     ctx->n_threads = MIN(ctx->n_threads, MAX_NUM_THREADS);
     s->system.n_threads = ctx->n_threads;
     ctx->tctx = calloc(sizeof(A52ThreadContext), ctx->n_threads);
+#ifndef NO_THREADS
+    {
+        int cpus[MAX_NUM_THREADS];
+        // only threads owned by the context are pinned: not the calling
+        // thread, which runs the first intra-frame worker, nor pool threads
+        thread_plan_cpus(ctx->shared_pool ? AFTEN_PIN_NONE : s->system.pin_policy,
+                         s->system.pin_cpus, s->system.n_pin_cpus,
+                         cpus, ctx->n_threads);
+        for (j = 0; j < ctx->n_threads; j++) {
+            if (ctx->threading_mode == AFTEN_THREADS_INTRA)
+                ctx->tctx[j].cpu = j ? cpus[j-1] : -1;
+            else
+                ctx->tctx[j].cpu = uses_job_queue(ctx) ? cpus[j] : -1;
+        }
+    }
+#endif
 
     for (j = 0; j < ctx->n_threads; j++) {
         A52ThreadContext *cur_tctx = &ctx->tctx[j];
         cur_tctx->ctx = ctx;
         cur_tctx->thread_num = j;
 
-        mdct_thread_init(cur_tctx);
-
-        cur_tctx->bit_cnt = 0;
-        cur_tctx->sample_cnt = 0;
-
-        cur_tctx->last_quality = last_quality;
-
-        if (ctx->n_threads > 1) {
-            cur_tctx->state = START;
-
-            posix_cond_init(&cur_tctx->ts.enter_cond);
-            posix_cond_init(&cur_tctx->ts.confirm_cond);
-            posix_cond_init(&cur_tctx->ts.samples_cond);
+        // a pinned worker allocates its own buffers once it runs on its CPU,
+        // so that they are placed in the memory of that node
+#ifndef NO_THREADS
+        if (cur_tctx->cpu < 0)
+#endif
+            mdct_thread_init(cur_tctx);
 
-            posix_mutex_init(&cur_tctx->ts.enter_mutex);
-            posix_mutex_init(&cur_tctx->ts.confirm_mutex);
+        cur_tctx->input = &ctx->input;
+    }
+    ctx->input.last_quality = last_quality;
+    ctx->bit_cnt = 0;
+    ctx->sample_cnt = 0;
+    ctx->frame_cnt = 0;
+    // the frame sizes only depend on the position in the stream
+    if (ctx->params.encoding_mode == AFTEN_ENC_MODE_CBR) {
+        for (i = 0; i < s->start_frame; i++)
+            count_frame_size(ctx);
+    }
+#ifndef NO_THREADS
+    if (uses_job_queue(ctx)) {
+        unsigned int size = A52_JOB_RING_SIZE * ctx->n_threads;
 
-            windows_event_init(&cur_tctx->ts.ready_event);
-            windows_event_init(&cur_tctx->ts.enter_event);
-            windows_event_init(&cur_tctx->ts.samples_event);
+        ctx->jobs = calloc(sizeof(A52Job), size);
+        if (!ctx->jobs)
+            return -1;
+        job_queue_init(&ctx->queue, size);
+        for (j = 0; j < (int)size; j++) {
+            thread_waiter_init(&ctx->jobs[j].rc_waiter);
+            ctx->jobs[j].input.last_quality = last_quality;
+        }
 
-            posix_mutex_lock(&cur_tctx->ts.enter_mutex);
-            thread_create(&cur_tctx->ts.thread, threaded_worker, cur_tctx);
-            posix_cond_wait(&cur_tctx->ts.enter_cond, &cur_tctx->ts.enter_mutex);
-            posix_mutex_unlock(&cur_tctx->ts.enter_mutex);
-            windows_event_wait(&cur_tctx->ts.ready_event);
-            windows_event_set(&cur_tctx->ts.ready_event);
+        // with a shared pool the pool threads pick up the jobs and borrow
+        // an idle thread context to encode each one with
+        for (j = 0; j < ctx->n_threads; j++) {
+            A52ThreadContext *cur_tctx = &ctx->tctx[j];
+            if (ctx->shared_pool) {
+                cur_tctx->pool_next = ctx->pool_idle;
+                ctx->pool_idle = cur_tctx;
+            } else {
+                thread_create(&cur_tctx->ts.thread, threaded_worker, cur_tctx);
+            }
         }
     }
-    for (j = 0; j < ctx->n_threads; j++) {
-#ifdef HAVE_POSIX_THREADS
-        ctx->tctx[j].ts.next_samples_cond = &ctx->tctx[(j + 1) % ctx->n_threads].ts.samples_cond;
-#endif
-#ifdef HAVE_WINDOWS_THREADS
-        ctx->tctx[j].ts.next_samples_event = &ctx->tctx[(j + 1) % ctx->n_threads].ts.samples_event;
-#endif
+    if (ctx->frame_callback) {
+        thread_waiter_init(&ctx->deliver_waiter);
+        thread_create(&ctx->deliver_thread, deliver_worker, ctx);
     }
-    if (ctx->n_threads > 1) {
-        posix_mutex_init(&ctx->ts.samples_mutex);
-        windows_cs_init(&ctx->ts.samples_cs);
+    if (ctx->n_threads > 1 && ctx->threading_mode == AFTEN_THREADS_INTRA) {
+        // the calling thread encodes every frame with the first thread
+        // context, the other threads only run tasks for it.
+        ctx->run_frame_tasks = run_frame_tasks_pool;
+        thread_waiter_init(&ctx->pool.finish);
+        for (j = 1; j < ctx->n_threads; j++) {
+            A52ThreadContext *cur_tctx = &ctx->tctx[j];
+            thread_waiter_init(&cur_tctx->task_waiter);
+            thread_create(&cur_tctx->ts.thread, task_worker, cur_tctx);
+        }
     }
+#endif
 
     switch(s->mode) {
     case AFTEN_ENCODE:
@@ -573,13 +768,10 @@ found:
             FLOAT *samples = malloc(A52_SAMPLES_PER_FRAME * ctx->n_all_channels * sizeof(FLOAT));
             memset(samples, 0, (A52_SAMPLES_PER_FRAME - 256) * ctx->n_all_channels * sizeof(FLOAT));
             memcpy(samples + (A52_SAMPLES_PER_FRAME - 256) * ctx->n_all_channels, s->initial_samples, 256 * ctx->n_all_channels * sizeof(FLOAT));
-            convert_samples_from_src(&ctx->tctx[0], samples, A52_SAMPLES_PER_FRAME);
+            convert_samples_from_src(ctx, ctx->input.audio, samples, A52_SAMPLES_PER_FRAME);
             free(samples);
-            // copy samples with filters applied
-            // HACK: set threads temporarily to 1 to avoid locking
-            ctx->n_threads = 1;
-            copy_samples(&ctx->tctx[0]);
-            ctx->n_threads = s->system.n_threads;
+            // run filters to set up filter state and last samples
+            filter_samples(ctx, &ctx->input);
         }
         break;
     case AFTEN_TRANSCODE:
@@ -626,6 +818,8 @@ frame_init(A52ThreadContext *tctx)
         frame->frame_size = frame->frame_size_min;
     }
 
+    frame->bit_alloc_calls = 0;
+
     if (ctx->params.bwcode == -2)
         frame->bwcode = 60;
     else
@@ -916,7 +1110,7 @@ output_audio_blocks(A52ThreadContext *tctx)
         if (block->write_snr) {
             bitwriter_writebits(bw, 6, frame->csnroffst);
             for (ch = 0; ch < ctx->n_all_channels; ch++) {
-                bitwriter_writebits(bw, 4, frame->fsnroffst);
+                bitwriter_writebits(bw, 4, block->fsnroffst[ch]);
                 bitwriter_writebits(bw, 3, block->fgaincod[ch]);
             }
         }
@@ -991,99 +1185,91 @@ output_frame_end(A52ThreadContext *tctx)
     return (fs << 1);
 }
 
+/**
+ * Runs the input filters over one frame of converted audio.
+ * This is the only place where filter state and the tail of the previous
+ * frame are touched, so it has to be called in input order. In threaded
+ * mode it runs on the caller's thread before the frame is handed to a
+ * worker.
+ */
 static void
-copy_samples(A52ThreadContext *tctx)
+filter_samples(A52Context *ctx, A52InputFrame *input)
 {
-    A52Context *ctx = tctx->ctx;
-    A52Frame *frame = &tctx->frame;
-    FLOAT buffer[A52_SAMPLES_PER_FRAME];
-    FLOAT *in_audio;
-    FLOAT *out_audio;
-    FLOAT *temp;
-    int ch, blk;
-#define SWAP_BUFFERS temp=in_audio;in_audio=out_audio;out_audio=temp;
-
-#ifndef NO_THREADS
-    if (ctx->n_threads > 1) {
-        posix_mutex_lock(&ctx->ts.samples_mutex);
-
-        windows_cs_enter(&ctx->ts.samples_cs);
-
-        while (ctx->ts.samples_thread_num != tctx->thread_num) {
-            posix_cond_wait(&tctx->ts.samples_cond, &ctx->ts.samples_mutex);
+    FLOAT *audio;
+    int ch;
 
-            windows_cs_leave(&ctx->ts.samples_cs);
-            windows_event_wait(&tctx->ts.samples_event);
-            windows_cs_enter(&ctx->ts.samples_cs);
-        }
-        windows_event_reset(&tctx->ts.samples_event);
-    }
-#endif
     for (ch = 0; ch < ctx->n_all_channels; ch++) {
-        out_audio = buffer;
-        in_audio = frame->input_audio[ch];
+        audio = input->audio[ch];
         // DC-removal high-pass filter
         if (ctx->params.use_dc_filter) {
-            filter_run(&ctx->dc_filter[ch], out_audio, in_audio,
+            filter_run(&ctx->dc_filter[ch], audio, audio,
                        A52_SAMPLES_PER_FRAME);
-            SWAP_BUFFERS
         }
         if (ch < ctx->n_channels) {
             // channel bandwidth filter
             if (ctx->params.use_bw_filter) {
-                filter_run(&ctx->bw_filter[ch], out_audio, in_audio,
+                filter_run(&ctx->bw_filter[ch], audio, audio,
                            A52_SAMPLES_PER_FRAME);
-                SWAP_BUFFERS
             }
             // block-switching high-pass filter
             if (ctx->params.use_block_switching) {
-                filter_run(&ctx->bs_filter[ch], out_audio, in_audio,
-                           A52_SAMPLES_PER_FRAME);
-                memcpy(frame->blocks[0].transient_samples[ch],
+                filter_run(&ctx->bs_filter[ch], input->transient_audio[ch],
+                           audio, A52_SAMPLES_PER_FRAME);
+                memcpy(input->last_transient_audio[ch],
                        ctx->last_transient_samples[ch], 256 * sizeof(FLOAT));
-                memcpy(&frame->blocks[0].transient_samples[ch][256], out_audio,
-                       256 * sizeof(FLOAT));
-                for (blk = 1; blk < A52_NUM_BLOCKS; blk++) {
-                    memcpy(frame->blocks[blk].transient_samples[ch],
-                           &out_audio[256*(blk-1)], 512 * sizeof(FLOAT));
-                }
                 memcpy(ctx->last_transient_samples[ch],
-                       &out_audio[256*5], 256 * sizeof(FLOAT));
+                       &input->transient_audio[ch][256*5], 256 * sizeof(FLOAT));
             }
         } else {
             // LFE bandwidth low-pass filter
             if (ctx->params.use_lfe_filter) {
                 assert(ch == ctx->lfe_channel);
-                filter_run(&ctx->lfe_filter, out_audio, in_audio,
+                filter_run(&ctx->lfe_filter, audio, audio,
                            A52_SAMPLES_PER_FRAME);
-                SWAP_BUFFERS
             }
         }
 
-        memcpy(frame->blocks[0].input_samples[ch], ctx->last_samples[ch],
+        memcpy(input->last_audio[ch], ctx->last_samples[ch],
+               256 * sizeof(FLOAT));
+        memcpy(ctx->last_samples[ch], &audio[256*5], 256 * sizeof(FLOAT));
+    }
+}
+
+/**
+ * Lays out the filtered input audio into the overlapping blocks.
+ */
+static void
+copy_samples(A52ThreadContext *tctx)
+{
+    A52Context *ctx = tctx->ctx;
+    A52Frame *frame = &tctx->frame;
+    A52InputFrame *input = tctx->input;
+    int ch, blk;
+
+    for (ch = 0; ch < ctx->n_all_channels; ch++) {
+        FLOAT *audio = input->audio[ch];
+
+        if (ch < ctx->n_channels && ctx->params.use_block_switching) {
+            FLOAT *transient_audio = input->transient_audio[ch];
+            memcpy(frame->blocks[0].transient_samples[ch],
+                   input->last_transient_audio[ch], 256 * sizeof(FLOAT));
+            memcpy(&frame->blocks[0].transient_samples[ch][256],
+                   transient_audio, 256 * sizeof(FLOAT));
+            for (blk = 1; blk < A52_NUM_BLOCKS; blk++) {
+                memcpy(frame->blocks[blk].transient_samples[ch],
+                       &transient_audio[256*(blk-1)], 512 * sizeof(FLOAT));
+            }
+        }
+
+        memcpy(frame->blocks[0].input_samples[ch], input->last_audio[ch],
                256 * sizeof(FLOAT));
-        memcpy(&frame->blocks[0].input_samples[ch][256], in_audio,
+        memcpy(&frame->blocks[0].input_samples[ch][256], audio,
                256 * sizeof(FLOAT));
         for (blk = 1; blk < A52_NUM_BLOCKS; blk++) {
-            memcpy(frame->blocks[blk].input_samples[ch], &in_audio[256*(blk-1)],
+            memcpy(frame->blocks[blk].input_samples[ch], &audio[256*(blk-1)],
                    512 * sizeof(FLOAT));
         }
-        memcpy(ctx->last_samples[ch],
-               &in_audio[256*5], 256 * sizeof(FLOAT));
-    }
-#ifndef NO_THREADS
-    if (ctx->n_threads > 1) {
-        ++ctx->ts.samples_thread_num;
-        ctx->ts.samples_thread_num %= ctx->n_threads;
-
-        posix_cond_signal(tctx->ts.next_samples_cond);
-        posix_mutex_unlock(&ctx->ts.samples_mutex);
-
-        windows_event_set(tctx->ts.next_samples_event);
-        windows_cs_leave(&ctx->ts.samples_cs);
     }
-#endif
-#undef SWAP_BUFFERS
 }
 
 /* determines block length by detecting transients */
@@ -1132,33 +1318,40 @@ detect_transient(FLOAT *in)
     return 0;
 }
 
+/**
+ * Runs transient detection and the MDCT for a single block of one channel.
+ * The MDCT scratch buffers of the executing thread are used, so blocks can
+ * be transformed by any thread of the intra-frame pool.
+ */
+static void
+generate_coefs_blk_ch(A52ThreadContext *tctx, int task, int worker)
+{
+    A52Context *ctx = tctx->ctx;
+    A52ThreadContext *mdct_tctx = worker ? &ctx->tctx[worker] : tctx;
+    int ch = task / A52_NUM_BLOCKS;
+    A52Block *block = &tctx->frame.blocks[task % A52_NUM_BLOCKS];
+    int i;
+
+    if (ctx->params.use_block_switching)
+        block->blksw[ch] = detect_transient(block->transient_samples[ch]);
+    else
+        block->blksw[ch] = 0;
+    ctx->winf.apply_a52_window(block->input_samples[ch]);
+    if (block->blksw[ch])
+        ctx->mdct_ctx_256.mdct(mdct_tctx, block->mdct_coef[ch], block->input_samples[ch]);
+    else
+        ctx->mdct_ctx_512.mdct(mdct_tctx, block->mdct_coef[ch], block->input_samples[ch]);
+    for (i = tctx->frame.ncoefs[ch]; i < 256; i++)
+        block->mdct_coef[ch][i] = 0.0;
+}
+
 static void
 generate_coefs(A52ThreadContext *tctx)
 {
     A52Context *ctx = tctx->ctx;
-    A52Block *block;
-    void (*mdct_256)(struct A52ThreadContext *tctx, FLOAT *out, FLOAT *in) =
-        ctx->mdct_ctx_256.mdct;
-    void (*mdct_512)(struct A52ThreadContext *tctx, FLOAT *out, FLOAT *in) =
-        ctx->mdct_ctx_512.mdct;
-    int blk, ch, i;
 
-    for (ch = 0; ch < ctx->n_all_channels; ch++) {
-        for (blk = 0; blk < A52_NUM_BLOCKS; blk++) {
-            block = &tctx->frame.blocks[blk];
-            if (ctx->params.use_block_switching)
-                block->blksw[ch] = detect_transient(block->transient_samples[ch]);
-            else
-                block->blksw[ch] = 0;
-            ctx->winf.apply_a52_window(block->input_samples[ch]);
-            if (block->blksw[ch])
-                mdct_256(tctx, block->mdct_coef[ch], block->input_samples[ch]);
-            else
-                mdct_512(tctx, block->mdct_coef[ch], block->input_samples[ch]);
-            for (i = tctx->frame.ncoefs[ch]; i < 256; i++)
-                block->mdct_coef[ch][i] = 0.0;
-        }
-    }
+    ctx->run_frame_tasks(tctx, generate_coefs_blk_ch,
+                         ctx->n_all_channels * A52_NUM_BLOCKS);
 }
 
 static void
@@ -1215,22 +1408,50 @@ calc_rematrixing(A52ThreadContext *tctx)
     }
 }
 
+/**
+ * Decides whether the next CBR frame gets the extra word and adds the frame
+ * to the bit and sample counts the decision is based on.
+ */
+static int
+count_frame_size(A52Context *ctx)
+{
+    uint32_t kbps = ctx->target_bitrate * 1000;
+    uint32_t srate = ctx->sample_rate;
+    int frame_size_min = ctx->target_bitrate * 96000 / ctx->sample_rate;
+    int add;
+
+    while (ctx->bit_cnt >= kbps && ctx->sample_cnt >= srate) {
+        ctx->bit_cnt -= kbps;
+        ctx->sample_cnt -= srate;
+    }
+    add = !!(ctx->bit_cnt * srate < ctx->sample_cnt * kbps);
+
+    ctx->bit_cnt += (frame_size_min + add) * 16;
+    ctx->sample_cnt += A52_SAMPLES_PER_FRAME;
+    return add;
+}
+
+/**
+ * Numbers the next frame and decides on its fractional frame size in CBR.
+ * This runs in stream order on the thread passing the input, so the frame
+ * sizes do not depend on which thread encodes a frame.
+ */
+static void
+plan_frame_size(A52Context *ctx, A52InputFrame *input)
+{
+    input->frame_num = ctx->frame_cnt++;
+    input->frame_size_add = 0;
+    if (ctx->params.encoding_mode == AFTEN_ENC_MODE_CBR)
+        input->frame_size_add = count_frame_size(ctx);
+}
+
 /** Adjust for fractional frame sizes in CBR mode */
 static void
 adjust_frame_size(A52ThreadContext *tctx)
 {
-    A52Context *ctx = tctx->ctx;
     A52Frame *f = &tctx->frame;
-    uint32_t kbps = f->bit_rate * 1000;
-    uint32_t srate = ctx->sample_rate;
-    int add;
 
-    while (tctx->bit_cnt >= kbps && tctx->sample_cnt >= srate) {
-        tctx->bit_cnt -= kbps;
-        tctx->sample_cnt -= srate;
-    }
-    add = !!(tctx->bit_cnt * srate < tctx->sample_cnt * kbps);
-    f->frame_size = f->frame_size_min + add;
+    f->frame_size = f->frame_size_min + tctx->input->frame_size_add;
 }
 
 static void
@@ -1291,6 +1512,15 @@ begin_encode_frame(A52ThreadContext *tctx)
     return 0;
 }
 
+static void
+run_frame_tasks_serial(A52ThreadContext *tctx, A52FrameTask task, int n_tasks)
+{
+    int i;
+
+    for (i = 0; i < n_tasks; i++)
+        task(tctx, i, 0);
+}
+
 static int
 process_frame(A52ThreadContext *tctx, uint8_t *output_frame_buffer)
 {
@@ -1316,9 +1546,21 @@ process_frame(A52ThreadContext *tctx, uint8_t *output_frame_buffer)
         a52_process_exponents(tctx);
         // run bit allocation at q=240 to calculate bandwidth
         vbw_bit_allocation(tctx);
+        // encode exponents again where the bandwidth has changed
+        a52_reprocess_exponents(tctx);
+    } else {
+        a52_process_exponents(tctx);
     }
 
-    a52_process_exponents(tctx);
+    if (ctx->params.pass == 1) {
+        // the first pass hands back the frame statistics instead
+        tctx->framesize = write_pass_stats(tctx, output_frame_buffer);
+        tctx->status.quality = frame->quality;
+        tctx->status.bit_rate = frame->bit_rate;
+        tctx->status.bwcode = frame->bwcode;
+        tctx->status.bit_alloc_calls = frame->bit_alloc_calls;
+        return 0;
+    }
 
     if (ctx->params.encoding_mode == AFTEN_ENC_MODE_CBR)
         adjust_frame_size(tctx);
@@ -1331,14 +1573,11 @@ process_frame(A52ThreadContext *tctx, uint8_t *output_frame_buffer)
 
     quantize_mantissas(tctx);
 
-    // increment counters
-    tctx->bit_cnt += frame->frame_size * 16;
-    tctx->sample_cnt += A52_SAMPLES_PER_FRAME;
-
     // update encoding status
     tctx->status.quality = frame->quality;
     tctx->status.bit_rate = frame->bit_rate;
     tctx->status.bwcode = frame->bwcode;
+    tctx->status.bit_alloc_calls = frame->bit_alloc_calls;
 
     output_frame_header(tctx, output_frame_buffer);
     output_audio_blocks(tctx);
@@ -1348,19 +1587,65 @@ process_frame(A52ThreadContext *tctx, uint8_t *output_frame_buffer)
 }
 
 static int
-convert_samples_from_src(A52ThreadContext *tctx, const void *vsrc, int count)
+convert_samples_from_src(A52Context *ctx,
+                         FLOAT dest[A52_MAX_CHANNELS][A52_SAMPLES_PER_FRAME],
+                         const void *vsrc, int count)
 {
-    A52Context *ctx = tctx->ctx;
-    ctx->fmt_convert_from_src(tctx->frame.input_audio, vsrc, ctx->n_all_channels, count);
+    ctx->fmt_convert_from_src(dest, vsrc, ctx->n_all_channels, count);
     if (count < A52_SAMPLES_PER_FRAME) {
         int ch;
         for (ch = 0; ch < ctx->n_all_channels; ch++)
-            memset(&tctx->frame.input_audio[ch][count], 0, (A52_SAMPLES_PER_FRAME - count) * sizeof(FLOAT));
+            memset(&dest[ch][count], 0, (A52_SAMPLES_PER_FRAME - count) * sizeof(FLOAT));
     }
     return 0;
 }
 
 #ifndef NO_THREADS
+static void
+encode_job(A52ThreadContext *tctx, A52Job *job)
+{
+    tctx->input = &job->input;
+    if (process_frame(tctx, job->frame_buffer)) {
+        job->state = ABORT;
+        job->framesize = -1;
+    } else {
+        job->framesize = tctx->framesize;
+        job->status = tctx->status;
+    }
+}
+
+/** Marks a job as finished, its frame can be collected once it is the oldest */
+static void
+finish_job(A52Context *ctx, A52Job *job)
+{
+    thread_store_release(&job->finished, 1);
+    thread_wake(&ctx->queue.producer);
+    if (ctx->notify_fd[1] >= 0)
+        thread_notify_post(ctx->notify_fd);
+}
+
+/**
+ * Claims the oldest job nobody works on yet, sleeping while there is none.
+ * Any idle worker takes the next frame, so a slow frame only holds up the
+ * worker encoding it.
+ */
+static A52Job *
+claim_job(A52Context *ctx)
+{
+    A52JobQueue *queue = &ctx->queue;
+    unsigned int next;
+
+    while (1) {
+        next = thread_load_acquire(&queue->next);
+        if (next == thread_load_acquire(&queue->head)) {
+            thread_wait_while_equal(&queue->consumer, &queue->head, next);
+            continue;
+        }
+        if (thread_compare_and_swap(&queue->next, next, next + 1))
+            return &ctx->jobs[next % queue->size];
+    }
+}
+
 static int
 threaded_worker(void* vtctx)
 {
@@ -1379,32 +1664,21 @@ threaded_worker(void* vtctx)
 #endif
 
     tctx = vtctx;
-    ++tctx->ctx->ts.threads_running;//no need to lock, as thread creater waits
-    posix_mutex_lock(&tctx->ts.enter_mutex);
-    posix_cond_signal(&tctx->ts.enter_cond);
+    if (tctx->cpu >= 0) {
+        thread_pin_cpu(tctx->cpu);
+        mdct_thread_init(tctx);
+    }
     while (1) {
-        posix_cond_wait(&tctx->ts.enter_cond, &tctx->ts.enter_mutex);
-        posix_mutex_lock(&tctx->ts.confirm_mutex);
-        posix_cond_signal(&tctx->ts.confirm_cond);
-        posix_mutex_unlock(&tctx->ts.confirm_mutex);
+        A52Job *job = claim_job(tctx->ctx);
 
-        windows_event_set(&tctx->ts.ready_event);
-        windows_event_wait(&tctx->ts.enter_event);
         /* end thread if nothing to encode */
-        if (tctx->state == END) {
-            tctx->framesize = 0;
+        if (job->state == END)
             break;
-        }
-        if (tctx->state == ABORT) {
-            tctx->framesize = -1;
-            break;
-        }
-        if (process_frame(tctx, tctx->frame_buffer))
-            tctx->state = ABORT;
-    }
-    posix_mutex_unlock(&tctx->ts.enter_mutex);
 
-    windows_event_set(&tctx->ts.ready_event);
+        encode_job(tctx, job);
+
+        finish_job(tctx->ctx, job);
+    }
 
 #ifdef MINGW_ALIGN_STACK_HACK
     asm volatile (
@@ -1419,81 +1693,395 @@ threaded_worker(void* vtctx)
     return 0;
 }
 
-static int
-process_frame_parallel(AftenContext *s, uint8_t *frame_buffer, const void *samples, int count, int *info)
+/**
+ * Claims and runs tasks of the given batch until none are left.
+ * next_task holds the batch number in the upper 16 bits, the number of tasks
+ * in bits 8-15 and the next unclaimed task in the lower 8 bits. As the task
+ * count is part of the word that is swapped, a thread that comes late for a
+ * batch only succeeds while the batch still has unclaimed tasks, which means
+ * the caller cannot have started to publish the following one.
+ */
+static void
+task_pool_work(A52TaskPool *pool, unsigned int batch, int worker)
 {
-    A52Context *ctx = s->private_context;
-    int framesize = 0;
-
-    if (!ctx->ts.threads_running)
-        return 0;
-
-    do {
-        A52ThreadContext *tctx = &ctx->tctx[ctx->ts.current_thread_num];
-
-        posix_mutex_lock(&tctx->ts.enter_mutex);
+    unsigned int next, task;
 
-        windows_event_wait(&tctx->ts.ready_event);
+    while (1) {
+        next = thread_load_acquire(&pool->next_task);
+        task = next & 0xFF;
+        if ((next >> 16) != (batch & 0xFFFF) || task >= ((next >> 8) & 0xFF))
+            break;
+        if (!thread_compare_and_swap(&pool->next_task, next, next + 1))
+            continue;
 
-        if (tctx->state == ABORT || ctx->ts.threads_to_abort) {
-            tctx->state = ABORT;
-            framesize = -1;
-            if (!ctx->ts.threads_to_abort)
-                ctx->ts.threads_to_abort = ctx->ts.threads_running;
-            --ctx->ts.threads_to_abort;
-            --ctx->ts.threads_running;
-        } else {
-            if (ctx->prepare_work(tctx, samples, count, info)) {
-                // need more data
-                posix_mutex_unlock(&tctx->ts.enter_mutex);
+        pool->func(pool->tctx, task, worker);
 
-                return -1;
-            }
-            if (tctx->state == START) {
-                tctx->state = WORK;
-            } else {
-                if (tctx->framesize > 0) {
-                    framesize = tctx->framesize;
-                    memcpy(frame_buffer, tctx->frame_buffer, framesize);
-                   // update encoding status
-                    s->status.quality   = tctx->status.quality;
-                    s->status.bit_rate  = tctx->status.bit_rate;
-                    s->status.bwcode    = tctx->status.bwcode;
-                } else {
-                    posix_mutex_unlock(&tctx->ts.enter_mutex);
-                    goto end;
-                }
-            }
+        // the last finished task completes the batch
+        if (thread_fetch_add(&pool->tasks_left, -1) == 1) {
+            thread_store_release(&pool->batch_done, batch);
+            thread_wake(&pool->finish);
         }
-        posix_mutex_lock(&tctx->ts.confirm_mutex);
-        posix_cond_signal(&tctx->ts.enter_cond);
-        posix_mutex_unlock(&tctx->ts.enter_mutex);
-        posix_cond_wait(&tctx->ts.confirm_cond, &tctx->ts.confirm_mutex);
-        posix_mutex_unlock(&tctx->ts.confirm_mutex);
-
-        windows_event_set(&tctx->ts.enter_event);
-end:
-        ++ctx->ts.current_thread_num;
-        ctx->ts.current_thread_num %= ctx->n_threads;
-    } while (ctx->ts.threads_to_abort);
-
-    return framesize;
+    }
 }
-#endif
 
-#if 0
-int
-aften_transcode_frame(AftenContext *s, uint8_t *input_frame_buffer, int input_frame_buffer_size, uint8_t *output_frame_buffer, int* want_bytes)
+static int
+task_worker(void* vtctx)
 {
-    A52Context *ctx;
     A52ThreadContext *tctx;
+    A52TaskPool *pool;
+    unsigned int batch;
 
-    ctx = s->private_context;
-#ifndef NO_THREADS
-    if (ctx->n_threads > 1)
-        return process_frame_parallel(s, output_frame_buffer, input_frame_buffer, input_frame_buffer_size, want_bytes);
+#ifdef MINGW_ALIGN_STACK_HACK
+    asm volatile (
+        "movl %%esp, %%ecx\n"
+        "andl $15, %%ecx\n"
+        "subl %%ecx, %%esp\n"
+        "pushl %%ecx\n"
+        "pushl %%ecx\n"
+        "pushl %%ecx\n"
+        "pushl %%ecx\n"
+        : : : "%esp","%ecx");
 #endif
-    if (!input_frame_buffer_size)
+
+    tctx = vtctx;
+    if (tctx->cpu >= 0) {
+        thread_pin_cpu(tctx->cpu);
+        mdct_thread_init(tctx);
+    }
+    pool = &tctx->ctx->pool;
+    batch = 0;
+    while (1) {
+        // sleep until the caller has published a new batch
+        thread_wait_while_equal(&tctx->task_waiter, &pool->batch, batch);
+        batch = thread_load_acquire(&pool->batch);
+
+        if (thread_load_acquire(&pool->quit))
+            break;
+
+        task_pool_work(pool, batch, tctx->thread_num);
+    }
+
+#ifdef MINGW_ALIGN_STACK_HACK
+    asm volatile (
+        "popl %%ecx\n"
+        "popl %%ecx\n"
+        "popl %%ecx\n"
+        "popl %%ecx\n"
+        "addl %%ecx, %%esp\n"
+        : : : "%esp", "%ecx");
+#endif
+
+    return 0;
+}
+
+/**
+ * Splits work on the current frame across the intra-frame pool.
+ * Returns when all tasks are done; the caller takes part as worker 0.
+ * n_tasks must be below 256.
+ */
+static void
+run_frame_tasks_pool(A52ThreadContext *tctx, A52FrameTask task, int n_tasks)
+{
+    A52Context *ctx = tctx->ctx;
+    A52TaskPool *pool = &ctx->pool;
+    unsigned int batch = pool->batch + 1;
+    int i;
+
+    if (n_tasks <= 0)
+        return;
+
+    pool->func = task;
+    pool->tctx = tctx;
+    pool->tasks_left = n_tasks;
+    thread_store_release(&pool->next_task,
+                         ((batch & 0xFFFF) << 16) | (n_tasks << 8));
+    thread_store_release(&pool->batch, batch);
+    for (i = 1; i < ctx->n_threads; i++)
+        thread_wake(&ctx->tctx[i].task_waiter);
+
+    task_pool_work(pool, batch, 0);
+
+    thread_wait_while_equal(&pool->finish, &pool->batch_done, batch - 1);
+}
+
+/**
+ * Waits until the oldest job in the queue is finished.
+ * Only called when the queue holds at least one job.
+ */
+static A52Job *
+wait_oldest_job(A52Context *ctx)
+{
+    A52JobQueue *queue = &ctx->queue;
+    A52Job *job = &ctx->jobs[queue->tail % queue->size];
+
+    thread_wait_while_equal(&queue->producer, &job->finished, 0);
+
+    return job;
+}
+
+/**
+ * Appends a context to the pool queue if a worker can take one of its jobs
+ * and it is not queued yet; the pool lock must be held.
+ */
+static void
+pool_queue_context(AftenPool *pool, A52Context *ctx)
+{
+    if (ctx->pool_queued || !ctx->pool_idle || ctx->queue.next == ctx->queue.head)
+        return;
+
+    ctx->pool_queued = 1;
+    ctx->pool_next = NULL;
+    if (pool->queue_tail)
+        pool->queue_tail->pool_next = ctx;
+    else
+        pool->queue_head = ctx;
+    pool->queue_tail = ctx;
+
+    posix_cond_signal(&pool->ps.cond);
+    windows_sem_post(&pool->ps.sem);
+}
+
+/**
+ * Claims the next job of the first context in the queue, along with an idle
+ * thread context to encode it with; the pool lock must be held. The context
+ * goes to the back of the queue if it has more work, so the jobs of all
+ * contexts are taken in turns.
+ */
+static A52Job *
+pool_claim_job(AftenPool *pool, A52ThreadContext **tctx)
+{
+    A52Context *ctx = pool->queue_head;
+    A52Job *job;
+
+    pool->queue_head = ctx->pool_next;
+    if (!pool->queue_head)
+        pool->queue_tail = NULL;
+    ctx->pool_queued = 0;
+
+    *tctx = ctx->pool_idle;
+    ctx->pool_idle = (*tctx)->pool_next;
+    job = &ctx->jobs[ctx->queue.next % ctx->queue.size];
+    ctx->queue.next++;
+
+    pool_queue_context(pool, ctx);
+
+    return job;
+}
+
+static void
+pool_lock(AftenPool *pool)
+{
+    posix_mutex_lock(&pool->ps.mutex);
+    windows_cs_enter(&pool->ps.cs);
+}
+
+static void
+pool_unlock(AftenPool *pool)
+{
+    posix_mutex_unlock(&pool->ps.mutex);
+    windows_cs_leave(&pool->ps.cs);
+}
+
+static int
+pool_worker(void* vpool)
+{
+    AftenPool *pool;
+
+#ifdef MINGW_ALIGN_STACK_HACK
+    asm volatile (
+        "movl %%esp, %%ecx\n"
+        "andl $15, %%ecx\n"
+        "subl %%ecx, %%esp\n"
+        "pushl %%ecx\n"
+        "pushl %%ecx\n"
+        "pushl %%ecx\n"
+        "pushl %%ecx\n"
+        : : : "%esp","%ecx");
+#endif
+
+    pool = vpool;
+    while (1) {
+        A52ThreadContext *tctx;
+        A52Context *ctx;
+        A52Job *job;
+
+        // every queued context posts the semaphore once
+        windows_sem_wait(&pool->ps.sem);
+        pool_lock(pool);
+        while (!pool->queue_head && !pool->quit)
+            posix_cond_wait(&pool->ps.cond, &pool->ps.mutex);
+        if (!pool->queue_head) {
+            pool_unlock(pool);
+            break;
+        }
+        job = pool_claim_job(pool, &tctx);
+        pool_unlock(pool);
+
+        encode_job(tctx, job);
+
+        // the encoding context is only left alone once the thread context
+        // is idle again, so close can wait for it by taking the lock
+        ctx = tctx->ctx;
+        pool_lock(pool);
+        finish_job(ctx, job);
+        tctx->pool_next = ctx->pool_idle;
+        ctx->pool_idle = tctx;
+        pool_queue_context(pool, ctx);
+        pool_unlock(pool);
+    }
+
+#ifdef MINGW_ALIGN_STACK_HACK
+    asm volatile (
+        "popl %%ecx\n"
+        "popl %%ecx\n"
+        "popl %%ecx\n"
+        "popl %%ecx\n"
+        "addl %%ecx, %%esp\n"
+        : : : "%esp", "%ecx");
+#endif
+
+    return 0;
+}
+
+/**
+ * Hands the finished frames of an asynchronous encoder to the frame callback,
+ * in order. Ends after the last frame once the stream has been flushed.
+ */
+static int
+deliver_worker(void* vctx)
+{
+    A52Context *ctx;
+    A52JobQueue *queue;
+
+#ifdef MINGW_ALIGN_STACK_HACK
+    asm volatile (
+        "movl %%esp, %%ecx\n"
+        "andl $15, %%ecx\n"
+        "subl %%ecx, %%esp\n"
+        "pushl %%ecx\n"
+        "pushl %%ecx\n"
+        "pushl %%ecx\n"
+        "pushl %%ecx\n"
+        : : : "%esp","%ecx");
+#endif
+
+    ctx = vctx;
+    queue = &ctx->queue;
+    while (1) {
+        unsigned int submitted = thread_load_acquire(&ctx->submitted);
+        A52Job *job;
+
+        if (thread_load_acquire(&queue->head) == queue->tail) {
+            if (ctx->ts.flushing)
+                break;
+            thread_wait_while_equal(&ctx->deliver_waiter, &ctx->submitted, submitted);
+            continue;
+        }
+
+        job = wait_oldest_job(ctx);
+        if (job->state == ABORT)
+            ctx->frame_callback(ctx->callback_opaque, NULL, -1, NULL);
+        else
+            ctx->frame_callback(ctx->callback_opaque, job->frame_buffer,
+                                job->framesize, &job->status);
+        thread_store_release(&queue->tail, queue->tail + 1);
+    }
+    ctx->frame_callback(ctx->callback_opaque, NULL, 0, NULL);
+
+#ifdef MINGW_ALIGN_STACK_HACK
+    asm volatile (
+        "popl %%ecx\n"
+        "popl %%ecx\n"
+        "popl %%ecx\n"
+        "popl %%ecx\n"
+        "addl %%ecx, %%esp\n"
+        : : : "%esp", "%ecx");
+#endif
+
+    return 0;
+}
+
+static void
+submit_job(A52Context *ctx, ThreadState state)
+{
+    AftenPool *pool = ctx->shared_pool;
+    A52JobQueue *queue = &ctx->queue;
+    A52Job *job = &ctx->jobs[queue->head % queue->size];
+
+    job->state = state;
+    job->finished = 0;
+    if (pool) {
+        // head has to move under the pool lock, which also covers the
+        // claiming of pooled jobs
+        pool_lock(pool);
+        thread_store_release(&queue->head, queue->head + 1);
+        pool_queue_context(pool, ctx);
+        pool_unlock(pool);
+    } else {
+        thread_store_release(&queue->head, queue->head + 1);
+        thread_wake(&queue->consumer);
+    }
+}
+
+static int
+process_frame_parallel(AftenContext *s, uint8_t *frame_buffer, const void *samples, int count, int *info)
+{
+    A52Context *ctx = s->private_context;
+    A52JobQueue *queue = &ctx->queue;
+    A52Job *job;
+    int framesize = 0;
+
+    // frames are collected in the order they were submitted, no matter
+    // which worker encoded them
+    if (!ctx->ts.flushing) {
+        // a full queue can only take new input once its oldest job is done
+        if (queue->head - queue->tail == queue->size)
+            wait_oldest_job(ctx);
+
+        job = &ctx->jobs[queue->head % queue->size];
+        if (ctx->prepare_work(ctx, job, samples, count, info)) {
+            // need more data
+            return -1;
+        }
+    }
+
+    if (queue->head - queue->tail == queue->size ||
+            (ctx->ts.flushing && queue->head != queue->tail)) {
+        job = wait_oldest_job(ctx);
+        if (job->state == ABORT) {
+            framesize = -1;
+        } else {
+            framesize = job->framesize;
+            memcpy(frame_buffer, job->frame_buffer, framesize);
+            // update encoding status
+            s->status.quality   = job->status.quality;
+            s->status.bit_rate  = job->status.bit_rate;
+            s->status.bwcode    = job->status.bwcode;
+            s->status.bit_alloc_calls = job->status.bit_alloc_calls;
+        }
+        ++queue->tail;
+    }
+
+    if (!ctx->ts.flushing)
+        submit_job(ctx, WORK);
+
+    return framesize;
+}
+#endif
+
+#if 0
+int
+aften_transcode_frame(AftenContext *s, uint8_t *input_frame_buffer, int input_frame_buffer_size, uint8_t *output_frame_buffer, int* want_bytes)
+{
+    A52Context *ctx;
+    A52ThreadContext *tctx;
+
+    ctx = s->private_context;
+#ifndef NO_THREADS
+    if (ctx->n_threads > 1)
+        return process_frame_parallel(s, output_frame_buffer, input_frame_buffer, input_frame_buffer_size, want_bytes);
+#endif
+    if (!input_frame_buffer_size)
         return 0;
 
     tctx = ctx->tctx;
@@ -1505,11 +2093,24 @@ aften_transcode_frame(AftenContext *s, uint8_t *input_frame_buffer, int input_fr
     s->status.quality   = tctx->status.quality;
     s->status.bit_rate  = tctx->status.bit_rate;
     s->status.bwcode    = tctx->status.bwcode;
+    s->status.bit_alloc_calls = tctx->status.bit_alloc_calls;
 
     return tctx->framesize;
 }
 #endif
 
+/** Tells whether frames are handed to worker threads through the job queue */
+static int
+uses_job_queue(A52Context *ctx)
+{
+#ifndef NO_THREADS
+    return ctx->shared_pool || ctx->async ||
+           (ctx->n_threads > 1 && ctx->threading_mode == AFTEN_THREADS_FRAME);
+#else
+    return 0;
+#endif
+}
+
 int
 aften_encode_frame(AftenContext *s, uint8_t *frame_buffer, const void *samples, int count)
 {
@@ -1530,7 +2131,11 @@ aften_encode_frame(AftenContext *s, uint8_t *frame_buffer, const void *samples,
         return -1;
     }
 #ifndef NO_THREADS
-    if (ctx->n_threads > 1) {
+    if (ctx->async) {
+        fprintf(stderr, "aften_encode_frame cannot be used in asynchronous mode\n");
+        return -1;
+    }
+    if (uses_job_queue(ctx)) {
         int info;
 
         return process_frame_parallel(s, frame_buffer, samples, count, &info);
@@ -1541,7 +2146,9 @@ aften_encode_frame(AftenContext *s, uint8_t *frame_buffer, const void *samples,
         return 0;
 
     tctx = ctx->tctx;
-    convert_samples_from_src(tctx, samples, count);
+    convert_samples_from_src(ctx, ctx->input.audio, samples, count);
+    filter_samples(ctx, &ctx->input);
+    plan_frame_size(ctx, &ctx->input);
 
     process_frame(tctx, frame_buffer);
     ctx->last_samples_count = count;
@@ -1549,10 +2156,189 @@ aften_encode_frame(AftenContext *s, uint8_t *frame_buffer, const void *samples,
     s->status.quality   = tctx->status.quality;
     s->status.bit_rate  = tctx->status.bit_rate;
     s->status.bwcode    = tctx->status.bwcode;
+    s->status.bit_alloc_calls = tctx->status.bit_alloc_calls;
 
     return tctx->framesize;
 }
 
+/** Tells whether a flushing call which returned no frame ends the stream */
+static int
+flush_started(A52Context *ctx)
+{
+#ifndef NO_THREADS
+    if (uses_job_queue(ctx))
+        return ctx->ts.flushing;
+#endif
+    return 1;
+}
+
+int
+aften_encode_frames(AftenContext *s, uint8_t *frame_buffer, int *frame_sizes,
+                    int max_frames, const void *samples, int count)
+{
+    A52Context *ctx;
+    const uint8_t *src = samples;
+    int n_frames, stride, fs;
+
+    if (s == NULL || frame_buffer == NULL || frame_sizes == NULL ||
+            (samples == NULL && count)) {
+        fprintf(stderr, "One or more NULL parameters passed to aften_encode_frames\n");
+        return -1;
+    }
+    // every input frame gives back at most one coded frame
+    if (count < 0 || max_frames < 1 ||
+            (count + A52_SAMPLES_PER_FRAME - 1) / A52_SAMPLES_PER_FRAME > max_frames) {
+        fprintf(stderr, "Invalid count passed to aften_encode_frames\n");
+        return -1;
+    }
+    ctx = s->private_context;
+    stride = A52_SAMPLES_PER_FRAME * ctx->n_all_channels * ctx->sample_size;
+
+    // with worker threads all frames are queued before the first one has
+    // to be waited for, until the job queue is full
+    n_frames = 0;
+    if (count) {
+        do {
+            int nr = MIN(count, A52_SAMPLES_PER_FRAME);
+            fs = aften_encode_frame(s, frame_buffer, src, nr);
+            if (fs < 0)
+                return -1;
+            if (fs > 0) {
+                frame_sizes[n_frames++] = fs;
+                frame_buffer += fs;
+            }
+            src += stride;
+            count -= nr;
+        } while (count > 0);
+
+        return n_frames;
+    }
+
+    // flush as many frames as fit. with worker threads the first flushing
+    // call may only queue the padding frame and return nothing.
+    do {
+        fs = aften_encode_frame(s, frame_buffer, NULL, 0);
+        if (fs < 0)
+            return -1;
+        if (fs > 0) {
+            frame_sizes[n_frames++] = fs;
+            frame_buffer += fs;
+        }
+    } while ((fs > 0 || !flush_started(ctx)) && n_frames < max_frames);
+
+    return n_frames;
+}
+
+int
+aften_submit_frame(AftenContext *s, const void *samples, int count)
+{
+#ifndef NO_THREADS
+    A52Context *ctx;
+    A52JobQueue *queue;
+    int info;
+
+    if (s == NULL || s->private_context == NULL || (samples == NULL && count)) {
+        fprintf(stderr, "One or more NULL parameters passed to aften_submit_frame\n");
+        return -1;
+    }
+    ctx = s->private_context;
+    if (!ctx->async) {
+        fprintf(stderr, "aften_submit_frame needs asynchronous mode\n");
+        return -1;
+    }
+    if (count > A52_SAMPLES_PER_FRAME || count < 0 || ctx->ts.flushing ||
+            (count && ctx->last_samples_count != -1 &&
+             ctx->last_samples_count < A52_SAMPLES_PER_FRAME)) {
+        fprintf(stderr, "Invalid count passed to aften_submit_frame\n");
+        return -1;
+    }
+
+    // the queue holds A52_JOB_RING_SIZE frames per thread, including
+    // finished ones that have not been handed back
+    queue = &ctx->queue;
+    if (queue->head - thread_load_acquire(&queue->tail) == queue->size)
+        return AFTEN_QUEUE_FULL;
+
+    // a count of 0 adds the padding frame if needed and ends the stream
+    ctx->prepare_work(ctx, &ctx->jobs[queue->head % queue->size],
+                      samples, count, &info);
+    if (!ctx->ts.flushing)
+        submit_job(ctx, WORK);
+    if (!count)
+        ctx->ts.flushing = 1;
+
+    if (ctx->frame_callback) {
+        thread_fetch_add(&ctx->submitted, 1);
+        thread_wake(&ctx->deliver_waiter);
+    }
+
+    return 0;
+#else
+    fprintf(stderr, "libaften was built without thread support\n");
+    return -1;
+#endif
+}
+
+int
+aften_receive_frame(AftenContext *s, uint8_t *frame_buffer)
+{
+#ifndef NO_THREADS
+    A52Context *ctx;
+    A52JobQueue *queue;
+    A52Job *job;
+    int framesize;
+
+    if (s == NULL || s->private_context == NULL || frame_buffer == NULL) {
+        fprintf(stderr, "One or more NULL parameters passed to aften_receive_frame\n");
+        return -1;
+    }
+    ctx = s->private_context;
+    if (!ctx->async || ctx->frame_callback) {
+        fprintf(stderr, "aften_receive_frame needs asynchronous mode without a frame callback\n");
+        return -1;
+    }
+
+    queue = &ctx->queue;
+    if (queue->head == queue->tail)
+        return ctx->ts.flushing ? AFTEN_END_OF_STREAM : 0;
+    job = &ctx->jobs[queue->tail % queue->size];
+    if (!thread_load_acquire(&job->finished)) {
+        // clear the descriptor before looking again, so that it is readable
+        // for every frame finished after that
+        thread_notify_clear(ctx->notify_fd);
+        if (!thread_load_acquire(&job->finished))
+            return 0;
+    }
+
+    if (job->state == ABORT) {
+        framesize = -1;
+    } else {
+        framesize = job->framesize;
+        memcpy(frame_buffer, job->frame_buffer, framesize);
+        s->status.quality   = job->status.quality;
+        s->status.bit_rate  = job->status.bit_rate;
+        s->status.bwcode    = job->status.bwcode;
+        s->status.bit_alloc_calls = job->status.bit_alloc_calls;
+    }
+    ++queue->tail;
+
+    return framesize;
+#else
+    fprintf(stderr, "libaften was built without thread support\n");
+    return -1;
+#endif
+}
+
+int
+aften_get_notify_fd(AftenContext *s)
+{
+#ifndef NO_THREADS
+    if (s != NULL && s->private_context != NULL)
+        return ((A52Context *)s->private_context)->notify_fd[0];
+#endif
+    return -1;
+}
+
 int
 aften_encode_close(AftenContext *s)
 {
@@ -1562,37 +2348,87 @@ aften_encode_close(AftenContext *s)
     if (s != NULL && s->private_context != NULL) {
         A52Context *ctx = s->private_context;
 
+        if (ctx->tctx) {
+            if (ctx->n_threads == 1 && !uses_job_queue(ctx))
+                mdct_thread_close(&ctx->tctx[0]);
+            else if (ctx->threading_mode == AFTEN_THREADS_INTRA) {
+                int i;
 #ifndef NO_THREADS
-        while (ctx->ts.threads_running) {
-            uint8_t frame_buffer[A52_MAX_CODED_FRAME_SIZE];
-            int info;
+                A52TaskPool *pool = &ctx->pool;
 
-            process_frame_parallel(s, frame_buffer, NULL, 0, &info);
-            ret_val = -1;
-        }
+                // an empty batch with the quit flag set ends the helpers
+                thread_store_release(&pool->quit, 1);
+                thread_store_release(&pool->batch, pool->batch + 1);
+                for (i = 1; i < ctx->n_threads; i++)
+                    thread_wake(&ctx->tctx[i].task_waiter);
 #endif
-        if (ctx->tctx) {
-            if (ctx->n_threads == 1)
                 mdct_thread_close(&ctx->tctx[0]);
-            else {
+                for (i = 1; i < ctx->n_threads; i++) {
+                    A52ThreadContext *cur_tctx = ctx->tctx + i;
+                    thread_join(cur_tctx->ts.thread);
+                    mdct_thread_close(cur_tctx);
+#ifndef NO_THREADS
+                    thread_waiter_destroy(&cur_tctx->task_waiter);
+#endif
+                }
+#ifndef NO_THREADS
+                thread_waiter_destroy(&pool->finish);
+#endif
+            } else {
                 int i;
+#ifndef NO_THREADS
+                A52JobQueue *queue = &ctx->queue;
+
+                // the encoder has not been flushed if frames are still pending
+                if (!ctx->ts.flushing)
+                    ret_val = -1;
+                if (ctx->frame_callback) {
+                    // the delivery thread ends once it has handed back
+                    // every submitted frame
+                    ctx->ts.flushing = 1;
+                    thread_fetch_add(&ctx->submitted, 1);
+                    thread_wake(&ctx->deliver_waiter);
+                    thread_join(ctx->deliver_thread);
+                    thread_waiter_destroy(&ctx->deliver_waiter);
+                }
+                if (queue->head != queue->tail)
+                    ret_val = -1;
+                if (ctx->shared_pool) {
+                    // pool workers may still be encoding pending jobs. the
+                    // last one hands back its thread context with the pool
+                    // lock held, so taking the lock once makes sure it is
+                    // done with this context.
+                    while (queue->head != queue->tail) {
+                        wait_oldest_job(ctx);
+                        ++queue->tail;
+                    }
+                    pool_lock(ctx->shared_pool);
+                    pool_unlock(ctx->shared_pool);
+                } else {
+                    // every worker ends when it claims one of the END jobs
+                    for (i = 0; i < ctx->n_threads; i++) {
+                        if (queue->head - queue->tail == queue->size) {
+                            wait_oldest_job(ctx);
+                            ++queue->tail;
+                        }
+                        submit_job(ctx, END);
+                    }
+                }
+#endif
                 for (i = 0; i < ctx->n_threads; i++) {
                     A52ThreadContext *cur_tctx = ctx->tctx + i;
-                    thread_join(cur_tctx->ts.thread);
+#ifndef NO_THREADS
+                    if (!ctx->shared_pool)
+#endif
+                        thread_join(cur_tctx->ts.thread);
                     mdct_thread_close(cur_tctx);
-                    posix_cond_destroy(&cur_tctx->ts.enter_cond);
-                    posix_cond_destroy(&cur_tctx->ts.confirm_cond);
-                    posix_cond_destroy(&cur_tctx->ts.samples_cond);
-
-                    posix_mutex_destroy(&cur_tctx->ts.enter_mutex);
-                    posix_mutex_destroy(&cur_tctx->ts.confirm_mutex);
-
-                    windows_event_destroy(&cur_tctx->ts.ready_event);
-                    windows_event_destroy(&cur_tctx->ts.enter_event);
-                    windows_event_destroy(&cur_tctx->ts.samples_event);
                 }
-                posix_mutex_destroy(&ctx->ts.samples_mutex);
-                windows_cs_destroy(&ctx->ts.samples_cs);
+#ifndef NO_THREADS
+                for (i = 0; i < (int)queue->size; i++)
+                    thread_waiter_destroy(&ctx->jobs[i].rc_waiter);
+                job_queue_destroy(queue);
+                free(ctx->jobs);
+#endif
             }
             if (s->mode == AFTEN_TRANSCODE) {
                 int i;
@@ -1604,6 +2440,15 @@ aften_encode_close(AftenContext *s)
             }
             free(ctx->tctx);
         }
+#ifndef NO_THREADS
+        if (ctx->shared_pool) {
+            pool_lock(ctx->shared_pool);
+            ctx->shared_pool->n_contexts--;
+            pool_unlock(ctx->shared_pool);
+        }
+        if (ctx->notify_fd[0] >= 0)
+            thread_notify_close(ctx->notify_fd);
+#endif
         // mdct_close deinits both mdcts
         mdct_close(ctx);
 
@@ -1615,9 +2460,74 @@ aften_encode_close(AftenContext *s)
             filter_close(&ctx->bw_filter[ch]);
         }
 
+        free(ctx->pass_frames);
         free(ctx);
         s->private_context = NULL;
     }
 
     return ret_val;
 }
+
+AftenPool *
+aften_pool_create(int n_threads)
+{
+#ifndef NO_THREADS
+    AftenPool *pool;
+    int i;
+
+    pool = calloc(sizeof(AftenPool), 1);
+    if (!pool) {
+        fprintf(stderr, "error allocating memory for AftenPool\n");
+        return NULL;
+    }
+    pool->n_threads = (n_threads > 0) ? n_threads : get_ncpus();
+    pool->n_threads = MIN(pool->n_threads, MAX_NUM_THREADS);
+
+    posix_mutex_init(&pool->ps.mutex);
+    posix_cond_init(&pool->ps.cond);
+    windows_cs_init(&pool->ps.cs);
+    windows_sem_init(&pool->ps.sem);
+
+    for (i = 0; i < pool->n_threads; i++)
+        thread_create(&pool->threads[i], pool_worker, pool);
+
+    return pool;
+#else
+    fprintf(stderr, "libaften was built without thread support\n");
+    return NULL;
+#endif
+}
+
+int
+aften_pool_destroy(AftenPool *pool)
+{
+#ifndef NO_THREADS
+    int i;
+
+    if (pool == NULL)
+        return 0;
+
+    pool_lock(pool);
+    if (pool->n_contexts) {
+        pool_unlock(pool);
+        fprintf(stderr, "cannot destroy a pool which is still in use\n");
+        return -1;
+    }
+    pool->quit = 1;
+    posix_cond_broadcast(&pool->ps.cond);
+    for (i = 0; i < pool->n_threads; i++)
+        windows_sem_post(&pool->ps.sem);
+    pool_unlock(pool);
+
+    for (i = 0; i < pool->n_threads; i++)
+        thread_join(pool->threads[i]);
+
+    posix_cond_destroy(&pool->ps.cond);
+    posix_mutex_destroy(&pool->ps.mutex);
+    windows_sem_destroy(&pool->ps.sem);
+    windows_cs_destroy(&pool->ps.cs);
+    free(pool);
+#endif
+
+    return 0;
+}
@@ -31,6 +31,7 @@
 #include "common.h"
 
 #include "a52.h"
+#include "bitalloc.h"
 #include "bitio.h"
 #include "aften.h"
 #include "exponent.h"
@@ -40,46 +41,210 @@
 #include "window.h"
 #include "a52dec.h"
 
+/** number of frames in flight per worker thread */
+#define A52_JOB_RING_SIZE 4
+
+/**
+ * Input audio of one frame with the input filters already applied.
+ * The last 256 samples of the previous frame are carried along, so the
+ * overlapping blocks can be built without access to the encoder state.
+ */
+typedef struct A52InputFrame {
+    FLOAT audio[A52_MAX_CHANNELS][A52_SAMPLES_PER_FRAME];
+    FLOAT transient_audio[A52_MAX_CHANNELS][A52_SAMPLES_PER_FRAME];
+    FLOAT last_audio[A52_MAX_CHANNELS][256];
+    FLOAT last_transient_audio[A52_MAX_CHANNELS][256];
+    int frame_size_add;     ///< 1 if a CBR frame gets the extra word
+    unsigned int frame_num; ///< position of the frame in the stream
+    int last_quality;       ///< snroffst of the last frame coded from here
+} A52InputFrame;
+
+typedef struct A52Job {
+    ThreadState state;
+    volatile unsigned int finished;
+#ifndef NO_THREADS
+    A52Waiter rc_waiter;    ///< wakes the frame when it may set its size
+#endif
+    int framesize;
+    AftenStatus status;
+    A52InputFrame input;
+    uint8_t frame_buffer[A52_MAX_CODED_FRAME_SIZE];
+} A52Job;
+
+/** lowest bap table offset kept in the mantissa bit count histograms */
+#define A52_BAP_HIST_MIN    (-128)
+/** number of bap table offsets kept, up to the last table entry */
+#define A52_BAP_HIST_SIZE   (64 - A52_BAP_HIST_MIN)
+
+/** a band whose bap does not follow snroffst by a plain shift */
+typedef struct A52BapHistBand {
+    int16_t *psd;
+    int c;          ///< mask - floor + 960
+    uint8_t blk;
+    uint8_t start;
+    uint8_t end;
+} A52BapHistBand;
+
+/**
+ * Counts of the bins of one frame by bap table offset, from which the
+ * mantissa bits for any snroffst can be found without running the bit
+ * allocation over the bins. See bap_hist_init() in bitalloc.c.
+ * count[blk][j][i] is the number of bins in block blk with one of the mask
+ * phases 0 to j-1 and an offset below A52_BAP_HIST_MIN + i. Only indices up
+ * to top[blk] are filled in, beyond that the counts do not change.
+ */
+typedef struct A52BapHist {
+    int16_t count[A52_NUM_BLOCKS][9][A52_BAP_HIST_SIZE+1];
+    int top[A52_NUM_BLOCKS];
+    int n_bands;
+    A52BapHistBand bands[A52_NUM_BLOCKS * A52_MAX_CHANNELS * 50];
+} A52BapHist;
+
+/** number of frames over which ABR mode keeps the average bitrate */
+#define A52_ABR_WINDOW 32
+/** number of snroffst values, 16 apart, at which ABR mode costs a frame */
+#define A52_ABR_QUALITIES 64
+
+/**
+ * State of the average bitrate rate control, over the last A52_ABR_WINDOW
+ * frames. Frames take turns in stream order to pick their size, and only
+ * the frame holding the turn touches the state. With frame threading this
+ * keeps the frame sizes independent of the thread which encodes a frame.
+ */
+typedef struct A52RateControl {
+    volatile unsigned int turn;     ///< number of the frame to be sized next
+    unsigned int n_frames;
+    int cost[A52_ABR_WINDOW][A52_ABR_QUALITIES]; ///< bits at each snroffst
+    int cost_sum[A52_ABR_QUALITIES];
+    int est_bits[A52_ABR_WINDOW];   ///< bits needed at the chosen snroffst
+    int est_sum;
+    int frame_bits[A52_ABR_WINDOW]; ///< bits in the frame as coded
+    int frame_sum;
+} A52RateControl;
+
+/** most snroffst values a speculative search evaluates per round */
+#define A52_SNR_CANDIDATES 8
+
+/** one snroffst value of a speculative search round and its cost */
+typedef struct A52SnrCandidate {
+    int snroffst;
+    int bits;       ///< mantissa bits
+    int min_bits;   ///< mantissa bits without group padding
+} A52SnrCandidate;
+
+/**
+ * A channel over a run of blocks which shares one fine snroffst when the SNR
+ * offsets are allocated per channel.
+ */
+typedef struct A52SnrUnit {
+    int ch;
+    int start, end;     ///< blocks start to end-1
+    int fsnroffst;
+    int gain;           ///< bins whose bap the next fine step raises
+} A52SnrUnit;
+
+/** mantissa bits of one channel in one block */
+typedef struct A52MantBits {
+    int bits;           ///< bits of the ungrouped mantissas
+    int cnt[3];         ///< number of bap=1, bap=2 and bap=4 mantissas
+} A52MantBits;
+
+/** frame size and starting snroffst planned for a frame of the second pass */
+typedef struct A52PassFrame {
+    int16_t quality;
+    uint8_t frmsizecod;
+} A52PassFrame;
+
+struct A52ThreadContext;
+
+/**
+ * One independent piece of the work on a frame, e.g. a single channel.
+ * worker is 0 for the calling thread and the thread number for a helper.
+ */
+typedef void (*A52FrameTask)(struct A52ThreadContext *tctx, int task, int worker);
+
+#ifndef NO_THREADS
+/**
+ * Fork/join pool for intra-frame threading.
+ * The calling thread publishes a batch of tasks, works on it along with the
+ * helper threads and returns once the last task of the batch is finished.
+ */
+typedef struct A52TaskPool {
+    A52FrameTask func;
+    struct A52ThreadContext *tctx;
+    volatile unsigned int next_task;    ///< batch, task count and next task
+    volatile unsigned int tasks_left;
+    volatile unsigned int batch;
+    volatile unsigned int batch_done;
+    volatile int quit;
+    A52Waiter finish;
+} A52TaskPool;
+#endif
 
 typedef struct A52ThreadContext {
     struct A52Context *ctx;
     A52DecodeContext *dctx;
 #ifndef NO_THREADS
     A52ThreadSync ts;
+    A52Waiter task_waiter;
+    struct A52ThreadContext *pool_next;
+    int cpu;    ///< CPU the worker pins itself to, or -1
 #endif
-    ThreadState state;
     int thread_num;
     int framesize;
 
     AftenStatus status;
     A52Frame frame;
     BitWriter bw;
-    uint8_t frame_buffer[A52_MAX_CODED_FRAME_SIZE];
-
-    uint32_t bit_cnt;
-    uint32_t sample_cnt;
-
-    int last_quality;
+    A52InputFrame *input;
 
     MDCTThreadContext mdct_tctx_512;
     MDCTThreadContext mdct_tctx_256;
+
+    A52BapHist bap_hist;
+    int rc_cost[A52_ABR_QUALITIES];
+    A52SnrCandidate snr_cand[A52_SNR_CANDIDATES];
+    A52SnrUnit snr_units[A52_NUM_BLOCKS * A52_MAX_CHANNELS];
+    int n_snr_units;
+    A52MantBits snr_mant[2][A52_NUM_BLOCKS][A52_MAX_CHANNELS]; ///< current, next step
+    uint8_t snr_bap[A52_NUM_BLOCKS][A52_MAX_CHANNELS][256];    ///< next step
+    A52BitAllocGroup bit_alloc_groups[A52_NUM_BLOCKS * A52_MAX_CHANNELS];
+    int n_bit_alloc_groups;
 } A52ThreadContext;
 
 typedef struct A52Context {
     A52ThreadContext *tctx;
 #ifndef NO_THREADS
     A52GlobalThreadSync ts;
-    int (*prepare_work)(A52ThreadContext *tctx, const void *input_buffer, int count, int *info);
+    A52JobQueue queue;
+    A52Job *jobs;
+    A52TaskPool pool;
+    AftenPool *shared_pool;
+    struct A52Context *pool_next;
+    A52ThreadContext *pool_idle;
+    int pool_queued;
+    int async;
+    AftenFrameCallback frame_callback;
+    void *callback_opaque;
+    THREAD deliver_thread;
+    A52Waiter deliver_waiter;
+    volatile unsigned int submitted;
+    int notify_fd[2];
+    int (*prepare_work)(struct A52Context *ctx, A52Job *job, const void *input_buffer, int count, int *info);
 #endif
     int (*begin_process_frame)(A52ThreadContext *tctx);
+    void (*run_frame_tasks)(A52ThreadContext *tctx, A52FrameTask task, int n_tasks);
     AftenEncParams params;
     AftenMetadata meta;
     void (*fmt_convert_from_src)(FLOAT dest[A52_MAX_CHANNELS][A52_SAMPLES_PER_FRAME],
           const void *vsrc, int nch, int n);
+    int sample_size;
     A52WindowFunctions winf;
     A52ExponentFunctions expf;
+    A52BitAllocFunctions baf;
 
     int n_threads;
+    AftenThreadingMode threading_mode;
     int last_samples_count;
     int n_channels;
     int n_all_channels;
@@ -95,16 +260,68 @@ typedef struct A52Context {
     int frmsizecod;
     int fixed_bwcode;
 
+    uint32_t bit_cnt;
+    uint32_t sample_cnt;
+    unsigned int frame_cnt;
+
+    /**
+     * snroffst of the most recently finished frame, used as the starting
+     * point of the CBR search. Shared by all threads and updated without
+     * locking, so it can only be a hint for searches whose result does not
+     * depend on where they start.
+     */
+    volatile int last_quality;
+
+    /**
+     * Mantissa bits per snroffst step near the boundary in recent frames,
+     * used to size the first step of the CBR search. A hint like
+     * last_quality.
+     */
+    volatile int snr_slope;
+
+    /**
+     * Exponent bits of the frame which set last_quality, or -1, and the
+     * learned change of snroffst per exponent bit in 16.16 fixed point.
+     * See predict_snroffst() in bitalloc.c.
+     */
+    volatile int last_exp_bits;
+    volatile int snr_weight;
+
+    A52RateControl rc;
+    A52PassFrame *pass_frames;
+    int n_pass_frames;
+
     FilterContext bs_filter[A52_MAX_CHANNELS];
     FilterContext dc_filter[A52_MAX_CHANNELS];
     FilterContext bw_filter[A52_MAX_CHANNELS];
     FilterContext lfe_filter;
 
-    FLOAT last_samples[A52_MAX_CHANNELS][A52_SAMPLES_PER_FRAME]; // 256 would be enough, but want to use converting functions
+    A52InputFrame input;
+    FLOAT last_samples[A52_MAX_CHANNELS][256];
     FLOAT last_transient_samples[A52_MAX_CHANNELS][256];
 
     MDCTContext mdct_ctx_512;
     MDCTContext mdct_ctx_256;
 } A52Context;
 
+/**
+ * Worker threads shared by several encoding contexts.
+ * A context waits in the pool queue while it has unclaimed jobs and an idle
+ * thread context to encode one of them with. A worker takes one job from the
+ * first context in the queue, which then goes to the back, so every context
+ * gets its turn. The queue, the idle lists and the claiming of pooled jobs
+ * are protected by the pool lock.
+ */
+struct AftenPool {
+    int n_threads;
+    int n_contexts;
+#ifndef NO_THREADS
+    int quit;
+    THREAD threads[MAX_NUM_THREADS];
+    A52PoolSync ps;
+    A52Context *queue_head;
+    A52Context *queue_tail;
+#endif
+};
+
 #endif /* A52ENC_H */
@@ -41,6 +41,14 @@ enum {
     A52_SAMPLES_PER_FRAME = 1536
 };
 
+/**
+ * Return values of the asynchronous encoding functions
+ */
+enum {
+    AFTEN_QUEUE_FULL = 1,
+    AFTEN_END_OF_STREAM = -2
+};
+
 /**
  * Aften's mode of operation
  */
@@ -54,9 +62,28 @@ typedef enum {
  */
 typedef enum {
     AFTEN_ENC_MODE_CBR = 0,
-    AFTEN_ENC_MODE_VBR
+    AFTEN_ENC_MODE_VBR,
+    AFTEN_ENC_MODE_ABR
 } AftenEncMode;
 
+/**
+ * Aften Threading Mode
+ */
+typedef enum {
+    AFTEN_THREADS_FRAME = 0,
+    AFTEN_THREADS_INTRA
+} AftenThreadingMode;
+
+/**
+ * Aften Thread Pinning Policy
+ */
+typedef enum {
+    AFTEN_PIN_NONE = 0,
+    AFTEN_PIN_COMPACT,
+    AFTEN_PIN_SCATTER,
+    AFTEN_PIN_LIST
+} AftenPinPolicy;
+
 /**
  * Floating-Point Data Types
  */
@@ -118,8 +145,16 @@ typedef struct {
     int amd_3dnowext;
     int amd_sse_mmx;
     int altivec;
+    int avx2;
+    int fma;
 } AftenSimdInstructions;
 
+/**
+ * Pool of worker threads which can be shared by several encoding contexts.
+ * Created with aften_pool_create().
+ */
+typedef struct AftenPool AftenPool;
+
 /**
  * Performance related parameters
  */
@@ -132,6 +167,54 @@ typedef struct {
      */
     int n_threads;
 
+    /**
+     * Threading mode.
+     * AFTEN_THREADS_FRAME : each thread encodes whole frames. This gives the
+     *                       best throughput, but output is delayed by up to
+     *                       4 frames per thread.
+     * AFTEN_THREADS_INTRA : all threads work together on a single frame, so
+     *                       each frame is returned by the same call which
+     *                       passed its samples. Use this for low latency.
+     * default is AFTEN_THREADS_FRAME
+     */
+    AftenThreadingMode threading_mode;
+
+    /**
+     * Shared worker threads.
+     * If set, frames are encoded by the threads of this pool instead of
+     * threads owned by the context. n_threads then is the number of frame
+     * slots the context may keep busy at once; 0 means one per pool thread.
+     * Only the frame threading mode can be used with a pool.
+     * default is NULL
+     */
+    AftenPool *pool;
+
+    /**
+     * Thread pinning policy.
+     * AFTEN_PIN_NONE    : threads are placed by the operating system
+     * AFTEN_PIN_COMPACT : fill the hardware threads of one core, then the
+     *                     next core, then the next package
+     * AFTEN_PIN_SCATTER : one thread per core, spread over the packages,
+     *                     before using SMT siblings
+     * AFTEN_PIN_LIST    : thread i runs on pin_cpus[i % n_pin_cpus]
+     * Each pinned worker allocates its scratch buffers after pinning, so they
+     * end up in the memory of its own node. Threads of a pool are not pinned.
+     * default is AFTEN_PIN_NONE
+     */
+    AftenPinPolicy pin_policy;
+
+    /**
+     * CPU numbers used with AFTEN_PIN_LIST
+     * default is NULL
+     */
+    const int *pin_cpus;
+
+    /**
+     * Number of entries in pin_cpus
+     * default is 0
+     */
+    int n_pin_cpus;
+
     /**
      * Available SIMD instruction sets; shouldn't be modified
      */
@@ -151,6 +234,7 @@ typedef struct {
      * Bitrate selection mode.
      * AFTEN_ENC_MODE_CBR : constant bitrate
      * AFTEN_ENC_MODE_VBR : variable bitrate
+     * AFTEN_ENC_MODE_ABR : average bitrate
      * default is CBR
      */
     AftenEncMode encoding_mode;
@@ -202,6 +286,9 @@ typedef struct {
      * default is 0
      * For CBR mode, this selects bitrate based on the number of channels.
      * For VBR mode, this sets the maximum bitrate to 640 kbps.
+     * In ABR mode this is the average bitrate to keep. Any value between
+     * the lowest and the highest valid bitrate can be used, and 0 selects
+     * the same bitrate as in CBR mode.
      */
     int bitrate;
 
@@ -273,6 +360,75 @@ typedef struct {
      */
     int max_bwcode;
 
+    /**
+     * Two-pass encoding.
+     * 0 : single pass
+     * 1 : first pass. Only the analysis is run, and instead of coded frames
+     *     the encoding functions hand back the statistics of each frame,
+     *     which are to be stored in order for the second pass.
+     * 2 : second pass, in ABR mode. The frame sizes are planned from the
+     *     statistics in pass_stats, to meet the average bitrate or the size
+     *     given in target_size. CBR mode is switched to ABR mode, with the
+     *     bitrate as the average.
+     * Both passes need the same input and encoding parameters, apart from
+     * the bitrate. The second pass uses the bandwidth of the first one.
+     * default is 0
+     */
+    int pass;
+
+    /**
+     * Statistics from the first pass, for the second pass.
+     * They are only read by aften_encode_init().
+     * default is NULL
+     */
+    const void *pass_stats;
+
+    /**
+     * Size of pass_stats in bytes.
+     * default is 0
+     */
+    int pass_stats_size;
+
+    /**
+     * Size of the coded stream in bytes for the second pass.
+     * The frame sizes are chosen to come as close to it as they can
+     * without going over. 0 means the average bitrate is used instead.
+     * default is 0
+     */
+    int target_size;
+
+    /**
+     * Speculative bit allocation
+     * Number of snroffst values which the bit allocation search counts at
+     * once. In intra-frame threading mode, each of them is counted on its own
+     * thread, which shortens the search of each frame if there are idle
+     * CPUs, at the cost of more work in total. The output does not change.
+     * 0 turns this off, otherwise 2 to 8 values can be used.
+     * default is 0
+     */
+    int bitalloc_spec;
+
+    /**
+     * SNR offset allocation
+     * 0 = one SNR offset for all channels
+     * 1 = fine SNR offset per channel
+     * 2 = fine SNR offset per channel and per run of blocks which starts
+     *     where the fast gain codes change
+     * Bits left over by the common SNR offset are handed to the channels
+     * whose next fine step codes the most mantissas more finely per bit.
+     * default is 0
+     */
+    int snr_alloc;
+
+    /**
+     * Optimal exponent strategy
+     * 0 = search the pre-defined exponent strategy sets (see expstr_search)
+     * 1 = choose the strategy of each block freely, for the lowest sum of
+     *     exponent error and exponent bits over the whole frame
+     * default is 0
+     */
+    int expstr_optimal;
+
 } AftenEncParams;
 
 /**
@@ -332,8 +488,22 @@ typedef struct {
     int quality;
     int bit_rate;
     int bwcode;
+
+    /** Number of bit allocation passes it took to find the frame's snroffst */
+    int bit_alloc_calls;
 } AftenStatus;
 
+/**
+ * Receives the coded frames in asynchronous mode.
+ * @param opaque  callback_opaque of the encoding context
+ * @param frame   The coded frame; NULL after the last frame of the stream
+ * @param size    Size of the frame in bytes; 0 after the last frame, and a
+ * negative value if the frame could not be encoded
+ * @param status  Encoding status of the frame; NULL if there is no frame
+ */
+typedef void (*AftenFrameCallback)(void *opaque, const unsigned char *frame,
+                                   int size, const AftenStatus *status);
+
 /**
  * libaften public encoding context
  */
@@ -391,6 +561,37 @@ typedef struct {
      */
     void* initial_samples;
 
+    /**
+     * Position in the stream of the first frame to encode, for encoding a
+     * stream in parts. In CBR mode, the frames which carry an extra word at
+     * 44.1 kHz then come out the same as in an encode of the whole stream.
+     * default: 0
+     */
+    int start_frame;
+
+    /**
+     * Asynchronous encoding.
+     * If set, samples are passed with aften_submit_frame(), which never waits
+     * for the worker threads, and the coded frames are handed back through
+     * frame_callback or aften_receive_frame(). aften_encode_frame() cannot be
+     * used then. Needs frame threading mode.
+     * default: 0
+     */
+    int async;
+
+    /**
+     * Called with every coded frame, in order, in asynchronous mode.
+     * It runs on a thread of the encoder and must not call the encoding
+     * functions. If NULL, frames are fetched with aften_receive_frame().
+     * default: NULL
+     */
+    AftenFrameCallback frame_callback;
+
+    /**
+     * Passed to frame_callback
+     */
+    void *callback_opaque;
+
     /**
      * Used internally by the encoder. The user should leave this alone.
      * It is allocated in aften_encode_init and free'd in aften_encode_close.
@@ -94,8 +94,93 @@ AFTEN_API int aften_encode_frame(AftenContext *s, unsigned char *frame_buffer,
  */
 AFTEN_API int aften_encode_close(AftenContext *s);
 
+/**
+ * Encodes several AC-3 frames in one call.
+ * All frames of the input are queued to the worker threads at once, as far
+ * as their job queues allow.
+ * @param s    The encoding context
+ * @param[out] frame_buffer Pointer to output frame data, the coded frames are
+ * packed one after another. Must hold @p max_frames * A52_MAX_CODED_FRAME_SIZE
+ * bytes
+ * @param[out] frame_sizes  Size of each frame written to @p frame_buffer
+ * @param[in]  max_frames   Number of entries in @p frame_sizes; must not be
+ * less than the number of input frames in @p samples
+ * @param[in]  samples      Pointer to interleaved input audio samples
+ * @param[in]  count        Number of input audio samples (per channel);
+ * must be a multiple of A52_SAMPLES_PER_FRAME, except for the last call with
+ * input, and equal to 0 while flushing. Each flushing call returns up to
+ * @p max_frames frames, the encoder is flushed once it returns 0.
+ * @return Returns the number of frames written to @p frame_buffer, or returns
+ * a negative value on error.
+ */
+AFTEN_API int aften_encode_frames(AftenContext *s, unsigned char *frame_buffer,
+                                  int *frame_sizes, int max_frames,
+                                  const void *samples, int count);
+
+/**
+ * Queues one frame for encoding in asynchronous mode without waiting for
+ * the worker threads. The samples are copied before the call returns.
+ * @param s    The encoding context
+ * @param[in]  samples      Pointer to input audio samples
+ * @param[in]  count        Number of input audio samples (per channel);
+ * must be equal to A52_SAMPLES_PER_FRAME, less than A52_SAMPLES_PER_FRAME
+ * for the last frame, and 0 once to end the stream
+ * @return Returns 0 if the frame has been queued, AFTEN_QUEUE_FULL if too
+ * many frames are waiting to be handed back (the same samples have to be
+ * passed again later), or a negative value on error.
+ */
+AFTEN_API int aften_submit_frame(AftenContext *s, const void *samples,
+                                 int count);
+
+/**
+ * Gets the next coded frame in asynchronous mode without a frame callback.
+ * Never waits for the worker threads.
+ * @param s    The encoding context
+ * @param[out] frame_buffer Pointer to output frame data
+ * @return Returns the number of bytes written to @p frame_buffer, 0 if the
+ * next frame is not finished yet, AFTEN_END_OF_STREAM once all frames of the
+ * ended stream have been returned, or another negative value on error.
+ */
+AFTEN_API int aften_receive_frame(AftenContext *s,
+                                  unsigned char *frame_buffer);
+
+/**
+ * Gets a file descriptor which becomes readable when a frame has been
+ * encoded, for event loops to wait on in asynchronous mode without a frame
+ * callback. It must not be read or closed by the caller. Once it is
+ * readable, call aften_receive_frame until it returns 0.
+ * @param s    The encoding context
+ * @return Returns the descriptor, or -1 if there is none.
+ */
+AFTEN_API int aften_get_notify_fd(AftenContext *s);
+
 /** @} end encoding functions */
 
+/**
+ * @defgroup pool Shared worker threads
+ * @{
+ */
+
+/**
+ * Creates a pool of worker threads to be shared by several encoding contexts.
+ * Set @c system.pool of each context to the pool before calling
+ * @c aften_encode_init. Frames of all attached contexts are encoded in turns,
+ * and each context still gets back its own frames in order.
+ * @param n_threads Number of worker threads; 0 means one per CPU
+ * @return Returns the new pool, or NULL on error.
+ */
+AFTEN_API AftenPool *aften_pool_create(int n_threads);
+
+/**
+ * Stops the worker threads of a pool and frees it.
+ * All contexts attached to the pool must have been closed before.
+ * @param pool The pool
+ * @return Returns 0 on success, or a negative value on error.
+ */
+AFTEN_API int aften_pool_destroy(AftenPool *pool);
+
+/** @} end pool functions */
+
 /**
  * @defgroup utility Utility functions
  * @{
@@ -28,6 +28,10 @@
 
 #include "a52enc.h"
 #include "bitalloc.h"
+#include "cpu_caps.h"
+
+/** most snroffst values the CBR search looks at past the boundary */
+#define A52_SNR_WALK_MAX 16
 
 /**
  * A52 bit allocation preparation to speed up matching left bits.
@@ -90,28 +94,80 @@ compute_mantissa_size_final(int mant_cnt[5])
     return bits;
 }
 
+/* prepares bit allocation for each of n channel/block pairs */
+static void
+bit_alloc_prepare_pairs(A52BitAllocParams *s, int n, uint8_t **exp, int16_t **psd,
+                        int16_t **mask, const int *fgain, int end)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        a52_bit_allocation_prepare(s, exp[i], psd[i], mask[i], fgain[i], 0, end);
+}
+
+/* prepares bit allocation for one group of channel/block pairs */
+static void
+bit_alloc_prepare_group(A52ThreadContext *tctx, int group, UNUSED(int worker))
+{
+    A52Context *ctx = tctx->ctx;
+    A52Frame *frame = &tctx->frame;
+    A52BitAllocGroup *g = &tctx->bit_alloc_groups[group];
+    uint8_t *exp[A52_BIT_ALLOC_LANES];
+    int16_t *psd[A52_BIT_ALLOC_LANES];
+    int16_t *mask[A52_BIT_ALLOC_LANES];
+    int fgain[A52_BIT_ALLOC_LANES];
+    int i;
+
+    for (i = 0; i < g->n; i++) {
+        A52Block *block = &frame->blocks[g->blk[i]];
+        exp[i] = block->exp[g->ch[i]];
+        psd[i] = block->psd[g->ch[i]];
+        mask[i] = block->mask[g->ch[i]];
+        fgain[i] = frame->bit_alloc.fgain[g->blk[i]][g->ch[i]];
+    }
+    ctx->baf.prepare(&frame->bit_alloc, g->n, exp, psd, mask, fgain, g->end);
+}
+
 /* call to prepare bit allocation */
 static void
 bit_alloc_prepare(A52ThreadContext *tctx)
 {
     A52Context *ctx = tctx->ctx;
     A52Frame *frame = &tctx->frame;
-    A52Block *block;
-    int blk, ch;
+    int blk, ch, i;
 
-    for (blk = 0; blk < A52_NUM_BLOCKS; blk++) {
-        block = &frame->blocks[blk];
-        for (ch = 0; ch < ctx->n_all_channels; ch++) {
-            // We don't have to run the bit allocation when reusing exponents
-            if (block->exp_strategy[ch] != EXP_REUSE) {
-                a52_bit_allocation_prepare(&frame->bit_alloc,
-                               block->exp[ch], block->psd[ch], block->mask[ch],
-                               frame->bit_alloc.fgain[blk][ch],
-                               0, frame->ncoefs[ch]);
-//                             2, 0, NULL, NULL, NULL);
+    // We don't have to run the bit allocation when reusing exponents, or for
+    // channels whose exponents did not change since the last preparation.
+    // Pairs with the same number of coefficients share a group.
+    tctx->n_bit_alloc_groups = 0;
+    for (ch = 0; ch < ctx->n_all_channels; ch++) {
+        if (frame->bit_alloc_ready[ch])
+            continue;
+        frame->bit_alloc_ready[ch] = 1;
+        for (blk = 0; blk < A52_NUM_BLOCKS; blk++) {
+            A52BitAllocGroup *g = NULL;
+
+            if (frame->blocks[blk].exp_strategy[ch] == EXP_REUSE)
+                continue;
+            for (i = 0; i < tctx->n_bit_alloc_groups; i++) {
+                A52BitAllocGroup *gi = &tctx->bit_alloc_groups[i];
+                if (gi->end == frame->ncoefs[ch] && gi->n < A52_BIT_ALLOC_LANES) {
+                    g = gi;
+                    break;
+                }
             }
+            if (!g) {
+                g = &tctx->bit_alloc_groups[tctx->n_bit_alloc_groups++];
+                g->n = 0;
+                g->end = frame->ncoefs[ch];
+            }
+            g->blk[g->n] = blk;
+            g->ch[g->n] = ch;
+            g->n++;
         }
     }
+
+    ctx->run_frame_tasks(tctx, bit_alloc_prepare_group, tctx->n_bit_alloc_groups);
 }
 
 /**
@@ -147,10 +203,10 @@ bit_alloc(A52ThreadContext *tctx, int snroffst)
             if (block->exp_strategy[ch] == EXP_REUSE) {
                 memcpy(block->bap[ch], frame->blocks[blk-1].bap[ch], 256);
             } else {
-                a52_bit_alloc_calc_bap(block->mask[ch], block->psd[ch], 0, frame->ncoefs[ch],
-                                       snroffst, frame->bit_alloc.floor, block->bap[ch]);
+                ctx->baf.calc_bap(block->mask[ch], block->psd[ch], 0, frame->ncoefs[ch],
+                                  snroffst, frame->bit_alloc.floor, block->bap[ch]);
             }
-            bits += compute_mantissa_size(mant_cnt, block->bap[ch], frame->ncoefs[ch]);
+            bits += ctx->baf.compute_mantissa_size(mant_cnt, block->bap[ch], frame->ncoefs[ch]);
 
         }
         bits += compute_mantissa_size_final(mant_cnt);
@@ -159,6 +215,191 @@ bit_alloc(A52ThreadContext *tctx, int snroffst)
     return bits;
 }
 
+/** first bap table address of each bap value */
+static const int bap_start_tab[16] = {
+    0, 1, 6, 8, 11, 13, 15, 19, 23, 27, 31, 35, 39, 43, 47, 55
+};
+
+/**
+ * Sorts the bins of the frame into the histograms used by
+ * count_mantissa_bits().
+ * For snroffst s > 0, bin i of band b gets the bap
+ *     a52_bap_tab[CLIP(p - ((c - 4*s) >> 5), 0, 63)]
+ * with p = (psd[i] - floor) >> 5 and c = mask[b] - floor + 960, as long as
+ * 0 <= c - 4*s < 8192. Writing c = 32*k + r, the table address becomes
+ *     d + (s >> 3) + ((s & 7) > (r >> 2))    with d = p - k,
+ * so changing s only shifts bins with the same mask phase r >> 2 together.
+ * The bins of each block are counted by phase and d. Bands which leave that
+ * range for some s are kept in a list and computed bin by bin.
+ */
+static void
+bap_hist_init(A52ThreadContext *tctx)
+{
+    A52Context *ctx = tctx->ctx;
+    A52Frame *frame = &tctx->frame;
+    A52BapHist *hist = &tctx->bap_hist;
+    int floor = frame->bit_alloc.floor;
+    int blk, ch, i, j;
+
+    memset(hist->count, 0, sizeof(hist->count));
+    hist->n_bands = 0;
+
+    for (blk = 0; blk < A52_NUM_BLOCKS; blk++) {
+        int bottom = A52_BAP_HIST_SIZE;
+        int top = 0;
+
+        for (ch = 0; ch < ctx->n_all_channels; ch++) {
+            // reused exponents share the bap of the block they came from
+            A52Block *src = &frame->blocks[blk];
+            int16_t *psd, *mask;
+            int bin, band, end;
+
+            while (src->exp_strategy[ch] == EXP_REUSE)
+                src--;
+            psd = src->psd[ch];
+            mask = src->mask[ch];
+            end = frame->ncoefs[ch];
+
+            for (bin = 0, band = 0; bin < end; band++) {
+                int band_end = MIN(bin + a52_critical_band_size_tab[band], end);
+                int c = mask[band] - floor + 960;
+                int k = c >> 5;
+                int16_t *cnt;
+
+                if (c < 4 * 1023 || c - 4 >= 8192) {
+                    A52BapHistBand *hb = &hist->bands[hist->n_bands++];
+                    hb->psd = psd;
+                    hb->c = c;
+                    hb->blk = blk;
+                    hb->start = bin;
+                    hb->end = band_end;
+                    bin = band_end;
+                    continue;
+                }
+                // phase j is counted in row j+1, leaving row 0 empty
+                cnt = hist->count[blk][((c & 31) >> 2) + 1];
+                for (; bin < band_end; bin++) {
+                    int d = ((psd[bin] - floor) >> 5) - k;
+                    // below the minimum the bap is 0 for any snroffst
+                    if (d < A52_BAP_HIST_MIN)
+                        continue;
+                    d = MIN(d, 63) - A52_BAP_HIST_MIN + 1;
+                    bottom = MIN(bottom, d);
+                    top = MAX(top, d);
+                    cnt[d]++;
+                }
+            }
+        }
+
+        // turn counts into sums over all lower offsets and lower phases.
+        // below the lowest offset in use all sums are still zero.
+        for (j = 1; j <= 8; j++) {
+            int16_t *cnt = hist->count[blk][j];
+            int16_t *lower = hist->count[blk][j-1];
+            int sum = 0;
+            for (i = bottom; i <= top; i++) {
+                sum += cnt[i];
+                cnt[i] = sum + lower[i];
+            }
+        }
+        hist->top[blk] = top;
+    }
+}
+
+/**
+ * Counts the mantissa bits which bit_alloc() would use for the given
+ * snroffst, using the histograms of bap_hist_init().
+ * If min_bits is not NULL, it receives the count without the padding of the
+ * grouped mantissas, rounded down. Unlike the return value, this never
+ * decreases with a larger snroffst, so it is a lower bound for the bits of
+ * every snroffst from this one up.
+ * Only reads the thread context, so helper threads can count in parallel.
+ */
+static int
+mantissa_bits(A52ThreadContext *tctx, int snroffst, int *min_bits)
+{
+    A52BapHist *hist = &tctx->bap_hist;
+    int ge[16];
+    int shift, phase;
+    int blk, b, i;
+    int bits, group_bits, group_sixths;
+
+    // an snroffst of 0 sets all baps to zero
+    if (!snroffst) {
+        if (min_bits)
+            *min_bits = 0;
+        return 0;
+    }
+
+    // phases below this one are shifted by one more address
+    shift = snroffst >> 3;
+    phase = snroffst & 7;
+
+    bits = group_bits = group_sixths = 0;
+    for (blk = 0; blk < A52_NUM_BLOCKS; blk++) {
+        const int16_t *low = hist->count[blk][phase];
+        const int16_t *all = hist->count[blk][8];
+        int top = hist->top[blk];
+        int n_low = low[top];
+        int n_all = all[top];
+        int n1, n2, n4;
+
+        // number of bins with at least bap b
+        for (b = 1; b < 16; b++) {
+            int i1 = CLIP(bap_start_tab[b] - shift - 1 - A52_BAP_HIST_MIN, 0, top);
+            int i0 = CLIP(bap_start_tab[b] - shift - A52_BAP_HIST_MIN, 0, top);
+            ge[b] = (n_low - low[i1]) + (n_all - n_low) - (all[i0] - low[i0]);
+        }
+        n1 = ge[1] - ge[2];
+        n2 = ge[2] - ge[3];
+        n4 = ge[4] - ge[5];
+        // bap=3 uses 3 bits, bap=5 to bap=13 use (bap-1) bits,
+        // bap=14 uses 14 bits and bap=15 uses 16 bits
+        bits += 3 * (ge[3] - ge[4]) + 4 * ge[5] + 2 * (ge[14] + ge[15]);
+        for (b = 6; b < 14; b++)
+            bits += ge[b];
+
+        for (i = 0; i < hist->n_bands; i++) {
+            A52BapHistBand *hb = &hist->bands[i];
+            int m, bin;
+
+            if (hb->blk != blk)
+                continue;
+            m = MAX(hb->c - (snroffst << 2), 0) & 0x1FE0;
+            for (bin = hb->start; bin < hb->end; bin++) {
+                int bap = a52_bap_tab[CLIP((hb->psd[bin] - tctx->frame.bit_alloc.floor - m) >> 5, 0, 63)];
+                if (bap == 1)
+                    n1++;
+                else if (bap == 2)
+                    n2++;
+                else if (bap == 4)
+                    n4++;
+                else if (bap == 3)
+                    bits += 3;
+                else if (bap >= 5)
+                    bits += (bap <= 13) ? bap - 1 : 14 + ((bap - 14) << 1);
+            }
+        }
+
+        // grouped mantissas, padded to whole groups. bap=1, 2 and 4 take
+        // 10, 14 and 21 sixths of a bit without the padding.
+        group_bits += ((n1 + 2) / 3) * 5 + ((n2 + 2) / 3 + ((n4 + 1) >> 1)) * 7;
+        group_sixths += 10 * n1 + 14 * n2 + 21 * n4;
+    }
+
+    if (min_bits)
+        *min_bits = bits + group_sixths / 6;
+    return bits + group_bits;
+}
+
+/** Counts the mantissa bits for one snroffst and the pass in the status */
+static int
+count_mantissa_bits(A52ThreadContext *tctx, int snroffst, int *min_bits)
+{
+    tctx->frame.bit_alloc_calls++;
+    return mantissa_bits(tctx, snroffst, min_bits);
+}
+
 /** Counts all frame bits except for mantissas and exponents */
 static void
 count_frame_bits(A52ThreadContext *tctx)
@@ -233,6 +474,465 @@ count_frame_bits(A52ThreadContext *tctx)
     frame->frame_bits = frame_bits;
 }
 
+/**
+ * Updates the bits per snroffst step used by the CBR search from the widest
+ * pair of passes of a finished search.
+ */
+static void
+learn_snr_slope(A52Context *ctx, int slope, int start, int start_left,
+                int lo, int lo_left, int hi, int hi_left)
+{
+    if (lo != start)
+        slope = (slope * 3 + (start_left - lo_left) / (lo - start)) >> 2;
+    else if (hi <= 1023)
+        slope = (slope * 3 + lo_left - hi_left) >> 2;
+    thread_store_release(&ctx->snr_slope, MAX(slope, 1));
+}
+
+/**
+ * Finds the largest snroffst for which the mantissas fit in avail_bits.
+ * Mantissa bits grow with snroffst, so the answer is bracketed between the
+ * largest snroffst known to fit (lo) and the smallest known not to (hi).
+ * Starting from the given guess, steps of at least doubling size find the
+ * other side of the bracket. The first step divides the leftover bits by the
+ * slope seen in earlier frames, so it usually lands next to the boundary.
+ * Secant steps on the leftover bits then close in on the boundary, and a
+ * secant step which fails to halve the bracket is followed by bisection, so
+ * finding the boundary takes O(log2(1024)) passes. The walk past the
+ * boundary adds at most A52_SNR_WALK_MAX passes.
+ */
+static int
+cbr_search_snroffst(A52ThreadContext *tctx, int avail_bits, int snroffst,
+                    int *leftover)
+{
+    A52Context *ctx = tctx->ctx;
+    // -1 and 1024 stand for the ends of the range and are never evaluated
+    int lo = -1, hi = 1024;
+    int lo_left = 0, hi_left = 0;
+    int full = 1024;    // smallest snroffst from which nothing can fit
+    int width = hi - lo;
+    int step = 0;
+    int guessed = 0;
+    int slope, min_bits;
+    int start, start_left;
+
+    slope = thread_load_acquire(&ctx->snr_slope);
+    start = snroffst = CLIP(snroffst, 0, 1023);
+    start_left = *leftover = avail_bits - count_mantissa_bits(tctx, snroffst, &min_bits);
+
+    while (1) {
+        if (*leftover >= 0) {
+            lo = snroffst;
+            lo_left = *leftover;
+        } else {
+            hi = snroffst;
+            hi_left = *leftover;
+            if (min_bits > avail_bits)
+                full = MIN(full, snroffst);
+        }
+        if (hi - lo <= 1)
+            break;
+
+        if (lo < 0 || hi > 1023) {
+            // one side is open. step out from the known side, at least
+            // doubling the distance each time.
+            if (lo >= 0)
+                step = MAX(lo_left / slope + 1, 2 * step);
+            else
+                step = MAX((slope - 1 - hi_left) / slope, 2 * step);
+            snroffst = (lo >= 0) ? lo + step : hi - step;
+        } else if (guessed && 2 * (hi - lo) > width) {
+            // the last guess did not halve the bracket
+            snroffst = (lo + hi) >> 1;
+            guessed = 0;
+        } else {
+            // interpolate where the leftover bits cross zero
+            snroffst = lo + (int)((int64_t)(hi - lo) * lo_left / (lo_left - hi_left));
+            guessed = 1;
+        }
+        snroffst = CLIP(snroffst, lo + 1, hi - 1);
+        width = hi - lo;
+        *leftover = avail_bits - count_mantissa_bits(tctx, snroffst, &min_bits);
+    }
+
+    // nothing fits if lo is still -1. the last pass then was at 0.
+    if (lo < 0)
+        return 0;
+
+    learn_snr_slope(ctx, slope, start, start_left, lo, lo_left, hi, hi_left);
+
+    // grouped mantissas can make a larger snroffst need a few bits less, so
+    // look past the boundary until the bits without the padding of the
+    // groups rule out every larger snroffst. the padding is at most a few
+    // bits per group, so this ends within a step or two on real input.
+    full = MIN(full, hi + 1 + A52_SNR_WALK_MAX);
+    while (hi + 1 < full) {
+        snroffst = ++hi;
+        hi_left = avail_bits - count_mantissa_bits(tctx, snroffst, &min_bits);
+        if (hi_left >= 0) {
+            lo = snroffst;
+            lo_left = hi_left;
+        } else if (min_bits > avail_bits) {
+            full = snroffst;
+        }
+    }
+    *leftover = lo_left;
+
+    return lo;
+}
+
+/** Task which counts the mantissa bits of one speculative search candidate */
+static void
+count_snr_candidate(A52ThreadContext *tctx, int i, UNUSED(int worker))
+{
+    A52SnrCandidate *cand = &tctx->snr_cand[i];
+
+    cand->bits = mantissa_bits(tctx, cand->snroffst, &cand->min_bits);
+}
+
+/**
+ * Counts the mantissa bits of the first n candidates at once, one for each
+ * thread of the intra-frame pool.
+ */
+static void
+count_snr_candidates(A52ThreadContext *tctx, int n)
+{
+    tctx->ctx->run_frame_tasks(tctx, count_snr_candidate, n);
+    tctx->frame.bit_alloc_calls += n;
+}
+
+/**
+ * Speculative version of cbr_search_snroffst() for intra-frame threading.
+ * Each round counts n snroffst values at once on the threads of the
+ * intra-frame pool and narrows the bracket with them.
+ * The values are spaced around the estimated boundary, and the spacing
+ * doubles with each round, so a bad estimate costs O(log2(1024)) rounds at
+ * most. While one side is open, the spacing also grows with the distance of
+ * the estimate from the known side. It starts over at 1 once the bracket is
+ * closed and the estimate comes from the secant.
+ * The walk past the boundary also takes n values per round, and is limited
+ * to A52_SNR_WALK_MAX values as well. The result is the same as that of
+ * cbr_search_snroffst(), only the passes differ.
+ */
+static int
+spec_search_snroffst(A52ThreadContext *tctx, int n, int avail_bits,
+                     int snroffst, int *leftover)
+{
+    A52Context *ctx = tctx->ctx;
+    A52SnrCandidate *cand = tctx->snr_cand;
+    int lo = -1, hi = 1024;
+    int lo_left = 0, hi_left = 0;
+    int full = 1024;
+    int spacing = 1;
+    int closed = 0;
+    int slope, start, start_left = 0, start_seen = 0;
+    int est, first, m, i;
+
+    slope = thread_load_acquire(&ctx->snr_slope);
+    start = est = CLIP(snroffst, 0, 1023);
+
+    while (hi - lo > 1) {
+        // place the candidates around est inside the bracket
+        m = MIN(n, hi - lo - 1);
+        if (!closed && lo >= 0 && hi <= 1023) {
+            // the secant estimate is better than the open side one
+            closed = 1;
+            spacing = 1;
+        }
+        spacing = CLIP(spacing, 1, (hi - lo - 2) / MAX(m - 1, 1));
+        first = CLIP(est - ((m - 1) / 2) * spacing, lo + 1,
+                     hi - 1 - (m - 1) * spacing);
+        for (i = 0; i < m; i++)
+            cand[i].snroffst = first + i * spacing;
+        count_snr_candidates(tctx, m);
+
+        // a candidate above one which does not fit cannot narrow the bracket
+        for (i = 0; i < m && cand[i].snroffst < hi; i++) {
+            int left = avail_bits - cand[i].bits;
+            if (cand[i].snroffst == start) {
+                start_left = left;
+                start_seen = 1;
+            }
+            if (left >= 0) {
+                lo = cand[i].snroffst;
+                lo_left = left;
+            } else {
+                hi = cand[i].snroffst;
+                hi_left = left;
+                if (cand[i].min_bits > avail_bits)
+                    full = MIN(full, hi);
+            }
+        }
+
+        // estimate the boundary for the next round
+        if (lo >= 0 && hi <= 1023)
+            est = lo + (int)((int64_t)(hi - lo) * lo_left / (lo_left - hi_left));
+        else if (lo >= 0)
+            est = lo + lo_left / slope + 1;
+        else
+            est = hi - (slope - 1 - hi_left) / slope;
+        spacing *= 2;
+        if (!closed)
+            spacing = MAX(spacing, ABS(est - (lo >= 0 ? lo : hi)) / (2 * n));
+    }
+
+    // nothing fits if lo is still -1, not even snroffst 0.
+    if (lo < 0) {
+        *leftover = avail_bits;
+        return 0;
+    }
+
+    if (!start_seen)
+        start = lo;
+    learn_snr_slope(ctx, slope, start, start_left, lo, lo_left, hi, hi_left);
+
+    // look past the boundary as in cbr_search_snroffst()
+    full = MIN(full, hi + 1 + A52_SNR_WALK_MAX);
+    while (hi + 1 < full) {
+        m = MIN(n, full - hi - 1);
+        for (i = 0; i < m; i++)
+            cand[i].snroffst = hi + 1 + i;
+        count_snr_candidates(tctx, m);
+        hi += m;
+        for (i = 0; i < m; i++) {
+            if (avail_bits - cand[i].bits >= 0) {
+                lo = cand[i].snroffst;
+                lo_left = avail_bits - cand[i].bits;
+            } else if (cand[i].min_bits > avail_bits) {
+                full = MIN(full, cand[i].snroffst);
+                break;
+            }
+        }
+    }
+    *leftover = lo_left;
+
+    return lo;
+}
+
+/**
+ * Predicts the snroffst of a CBR frame from the last finished frame.
+ * A change in the exponent bits mostly means a change of the material, and
+ * the snroffst follows it in a direction and by an amount which depend on
+ * the material, so the weight of the change is learned from earlier frames.
+ */
+static int
+predict_snroffst(A52Context *ctx, int last_snroffst, int exp_bits)
+{
+    int last_exp_bits = thread_load_acquire(&ctx->last_exp_bits);
+    int weight = thread_load_acquire(&ctx->snr_weight);
+
+    if (last_exp_bits < 0)
+        return last_snroffst;
+    return last_snroffst + (int)(((int64_t)weight * (exp_bits - last_exp_bits)) >> 16);
+}
+
+/**
+ * Moves the weight of predict_snroffst() towards the one which would have
+ * predicted this frame exactly (normalized LMS with a step size of 1/4).
+ */
+static void
+train_snroffst_predictor(A52Context *ctx, int snroffst, int exp_bits)
+{
+    int last_snroffst = thread_load_acquire(&ctx->last_quality);
+    int last_exp_bits = thread_load_acquire(&ctx->last_exp_bits);
+    int weight = thread_load_acquire(&ctx->snr_weight);
+    int64_t dx, err;
+
+    thread_store_release(&ctx->last_exp_bits, exp_bits);
+    if (last_exp_bits < 0)
+        return;
+    dx = exp_bits - last_exp_bits;
+    err = ((int64_t)(snroffst - last_snroffst) << 16) - weight * dx;
+    weight += (int)(err * dx / (4 * (dx * dx + 100)));
+    thread_store_release(&ctx->snr_weight, weight);
+}
+
+/** Bits of the grouped mantissas of a block, padded to whole groups */
+static int
+group_bits(const int cnt[3])
+{
+    return ((cnt[0] + 2) / 3) * 5 + ((cnt[1] + 2) / 3 + ((cnt[2] + 1) >> 1)) * 7;
+}
+
+/**
+ * Computes the baps of one SNR unit at the given snroffst, into the bap
+ * arrays of the frame or, for next, into those of the next step.
+ * Returns how many bins the next step codes with a higher bap.
+ */
+static int
+snr_unit_bap(A52ThreadContext *tctx, A52SnrUnit *u, int snroffst, int next)
+{
+    A52Context *ctx = tctx->ctx;
+    A52Frame *frame = &tctx->frame;
+    int ch = u->ch;
+    int end = frame->ncoefs[ch];
+    int blk, i, gain;
+
+    gain = 0;
+    snroffst = (snroffst << 2) - 960;
+    for (blk = u->start; blk < u->end; blk++) {
+        A52Block *src = &frame->blocks[blk];
+        A52MantBits *mb = &tctx->snr_mant[next][blk][ch];
+        uint8_t *bap = next ? tctx->snr_bap[blk][ch] : src->bap[ch];
+        int mant_cnt[5] = { 0, 0, 0, 0, 0 };
+
+        // reused exponents share the bap of the block they came from, unless
+        // that block is in an earlier unit with its own snroffst
+        if (blk > u->start && src->exp_strategy[ch] == EXP_REUSE) {
+            memcpy(bap, next ? tctx->snr_bap[blk-1][ch] : src[-1].bap[ch], 256);
+        } else {
+            while (src->exp_strategy[ch] == EXP_REUSE)
+                src--;
+            ctx->baf.calc_bap(src->mask[ch], src->psd[ch], 0, end, snroffst,
+                              frame->bit_alloc.floor, bap);
+        }
+        mb->bits = ctx->baf.compute_mantissa_size(mant_cnt, bap, end) +
+                   3 * mant_cnt[3];
+        mb->cnt[0] = mant_cnt[1];
+        mb->cnt[1] = mant_cnt[2];
+        mb->cnt[2] = mant_cnt[4];
+
+        if (next) {
+            uint8_t *cur = frame->blocks[blk].bap[ch];
+            for (i = 0; i < end; i++)
+                gain += bap[i] > cur[i];
+        }
+    }
+    return gain;
+}
+
+/**
+ * Extra mantissa bits which the next step of an SNR unit needs, given the
+ * grouped mantissa counts of each block.
+ */
+static int
+snr_unit_cost(A52ThreadContext *tctx, A52SnrUnit *u, int blk_cnt[][3])
+{
+    int blk, i, cost;
+
+    cost = 0;
+    for (blk = u->start; blk < u->end; blk++) {
+        A52MantBits *cur = &tctx->snr_mant[0][blk][u->ch];
+        A52MantBits *next = &tctx->snr_mant[1][blk][u->ch];
+        int cnt[3];
+
+        for (i = 0; i < 3; i++)
+            cnt[i] = blk_cnt[blk][i] - cur->cnt[i] + next->cnt[i];
+        cost += next->bits - cur->bits + group_bits(cnt) - group_bits(blk_cnt[blk]);
+    }
+    return cost;
+}
+
+/**
+ * Allocates the fine snroffst of each channel, or of each channel and run
+ * of blocks which starts with new SNR offsets in the bitstream.
+ * All units start at the coarse snroffst found for the whole frame. Then the
+ * unit whose next fine step raises the bap of the most bins per extra bit
+ * takes it, while any step fits in the frame. Steps which cost no bits come
+ * first. Also fills in the bap arrays and the SNR offsets of the frame.
+ * Returns the leftover bits, or -1 if the common snroffst, which leaves the
+ * given number of bits, has to be kept.
+ */
+static int
+alloc_snroffst(A52ThreadContext *tctx, int avail_bits, int snroffst,
+               int common_leftover)
+{
+    A52Context *ctx = tctx->ctx;
+    A52Frame *frame = &tctx->frame;
+    int blk_cnt[A52_NUM_BLOCKS][3];
+    int coarse, leftover, blk, ch, i;
+
+    // csnroffst=0 with fsnroffst=0 has a special meaning for the decoder
+    coarse = snroffst & ~15;
+    if (!coarse)
+        return -1;
+
+    tctx->n_snr_units = 0;
+    for (ch = 0; ch < ctx->n_all_channels; ch++) {
+        for (blk = 0; blk < A52_NUM_BLOCKS; blk++) {
+            A52SnrUnit *u = &tctx->snr_units[tctx->n_snr_units];
+            if (!blk || (ctx->params.snr_alloc == 2 && frame->blocks[blk].write_snr)) {
+                u->ch = ch;
+                u->start = blk;
+                u->fsnroffst = 0;
+                tctx->n_snr_units++;
+            }
+            tctx->snr_units[tctx->n_snr_units-1].end = blk + 1;
+        }
+    }
+
+    for (i = 0; i < tctx->n_snr_units; i++)
+        snr_unit_bap(tctx, &tctx->snr_units[i], coarse, 0);
+    leftover = avail_bits;
+    for (blk = 0; blk < A52_NUM_BLOCKS; blk++) {
+        blk_cnt[blk][0] = blk_cnt[blk][1] = blk_cnt[blk][2] = 0;
+        for (ch = 0; ch < ctx->n_all_channels; ch++) {
+            A52MantBits *mb = &tctx->snr_mant[0][blk][ch];
+            leftover -= mb->bits;
+            for (i = 0; i < 3; i++)
+                blk_cnt[blk][i] += mb->cnt[i];
+        }
+        leftover -= group_bits(blk_cnt[blk]);
+    }
+    if (leftover < 0)
+        return -1;
+
+    for (i = 0; i < tctx->n_snr_units; i++) {
+        A52SnrUnit *u = &tctx->snr_units[i];
+        u->gain = snr_unit_bap(tctx, u, coarse + 1, 1);
+    }
+
+    for (;;) {
+        A52SnrUnit *best = NULL;
+        int best_cost = 0;
+
+        for (i = 0; i < tctx->n_snr_units; i++) {
+            A52SnrUnit *u = &tctx->snr_units[i];
+            int cost;
+
+            if (u->fsnroffst == 15)
+                continue;
+            cost = snr_unit_cost(tctx, u, blk_cnt);
+            if (cost > leftover)
+                continue;
+            if (!best || (cost <= 0 && best_cost > 0) ||
+                    (cost > 0 && best_cost > 0 &&
+                     u->gain * best_cost > best->gain * cost)) {
+                best = u;
+                best_cost = cost;
+            }
+        }
+        if (!best)
+            break;
+
+        leftover -= best_cost;
+        for (blk = best->start; blk < best->end; blk++) {
+            A52MantBits *cur = &tctx->snr_mant[0][blk][best->ch];
+            A52MantBits *next = &tctx->snr_mant[1][blk][best->ch];
+            for (i = 0; i < 3; i++)
+                blk_cnt[blk][i] += next->cnt[i] - cur->cnt[i];
+            *cur = *next;
+            memcpy(frame->blocks[blk].bap[best->ch], tctx->snr_bap[blk][best->ch], 256);
+        }
+        best->fsnroffst++;
+        if (best->fsnroffst < 15)
+            best->gain = snr_unit_bap(tctx, best, coarse + best->fsnroffst + 1, 1);
+    }
+
+    // the common snroffst can come out ahead where the padding of the
+    // grouped mantissas makes a step cost more than the next one
+    if (leftover > common_leftover)
+        return -1;
+
+    frame->csnroffst = coarse >> 4;
+    for (i = 0; i < tctx->n_snr_units; i++) {
+        A52SnrUnit *u = &tctx->snr_units[i];
+        for (blk = u->start; blk < u->end; blk++)
+            frame->blocks[blk].fsnroffst[u->ch] = u->fsnroffst;
+    }
+    return leftover;
+}
+
 /**
  * Calculates the snroffset values which, when used, keep the size of the
  * encoded data within a fixed frame size.
@@ -244,23 +944,30 @@ cbr_bit_allocation(A52ThreadContext *tctx, int prepare)
     A52Frame *frame = &tctx->frame;
     int current_bits, avail_bits, leftover;
     int snroffst=0;
+    int blk, ch;
 
     current_bits = frame->frame_bits + frame->exp_bits;
     avail_bits = (16 * frame->frame_size) - current_bits;
 
-    if (prepare)
+    if (prepare) {
         bit_alloc_prepare(tctx);
+        bap_hist_init(tctx);
+    }
 
     // starting point
     if (ctx->params.encoding_mode == AFTEN_ENC_MODE_VBR)
         snroffst = ctx->params.quality;
-    else if (ctx->params.encoding_mode == AFTEN_ENC_MODE_CBR)
-        snroffst = tctx->last_quality;
-    leftover = avail_bits - bit_alloc(tctx, snroffst);
+    else if (ctx->params.encoding_mode != AFTEN_ENC_MODE_CBR)
+        snroffst = frame->quality;
+    else if (ctx->params.bitalloc_fast)
+        snroffst = tctx->input->last_quality;
+    else
+        snroffst = thread_load_acquire(&ctx->last_quality);
 
     if (ctx->params.bitalloc_fast) {
         // fast bit allocation
         int leftover0, leftover1, snr0, snr1;
+        leftover = avail_bits - count_mantissa_bits(tctx, snroffst, NULL);
         snr0 = snr1 = snroffst;
         leftover0 = leftover1 = leftover;
         if (leftover != 0) {
@@ -269,50 +976,31 @@ cbr_bit_allocation(A52ThreadContext *tctx, int prepare)
                     snr0 = snr1;
                     leftover0 = leftover1;
                     snr1 += 16;
-                    leftover1 = avail_bits - bit_alloc(tctx, snr1);
+                    leftover1 = avail_bits - count_mantissa_bits(tctx, snr1, NULL);
                 }
             } else {
                 while (leftover0 < 0 && snr0-16 >= 0) {
                     snr1 = snr0;
                     leftover1 = leftover0;
                     snr0 -= 16;
-                    leftover0 = avail_bits - bit_alloc(tctx, snr0);
+                    leftover0 = avail_bits - count_mantissa_bits(tctx, snr0, NULL);
                 }
             }
         }
         if (snr0 != snr1) {
             snroffst = snr0;
-            leftover = avail_bits - bit_alloc(tctx, snroffst);
+            leftover = avail_bits - count_mantissa_bits(tctx, snroffst, NULL);
         }
     } else {
-        // take up to 3 jumps based on estimated distance from optimal
-        if (leftover < -400) {
-            snroffst += (leftover / (16 * ctx->n_channels));
-            leftover = avail_bits - bit_alloc(tctx, snroffst);
-        }
-        if (leftover > 400) {
-            snroffst += (leftover / (24 * ctx->n_channels));
-            leftover = avail_bits - bit_alloc(tctx, snroffst);
-        }
-        if (leftover < -200) {
-            snroffst += (leftover / (40 * ctx->n_channels));
-            leftover = avail_bits - bit_alloc(tctx, snroffst);
-        }
-        // adjust snroffst until leftover <= -100
-        while (leftover > -100) {
-            snroffst += (10 / ctx->n_channels);
-            if (snroffst > 1023) {
-                snroffst = 1023;
-                leftover = avail_bits - bit_alloc(tctx, snroffst);
-                break;
-            }
-            leftover = avail_bits - bit_alloc(tctx, snroffst);
-        }
-        // adjust snroffst until leftover is positive
-        while (leftover < 0 && snroffst > 0) {
-            snroffst--;
-            leftover = avail_bits - bit_alloc(tctx, snroffst);
-        }
+        if (ctx->params.encoding_mode == AFTEN_ENC_MODE_CBR)
+            snroffst = predict_snroffst(ctx, snroffst, frame->exp_bits);
+        if (ctx->params.bitalloc_spec)
+            snroffst = spec_search_snroffst(tctx, ctx->params.bitalloc_spec,
+                                            avail_bits, snroffst, &leftover);
+        else
+            snroffst = cbr_search_snroffst(tctx, avail_bits, snroffst, &leftover);
+        if (ctx->params.encoding_mode == AFTEN_ENC_MODE_CBR)
+            train_snroffst_predictor(ctx, snroffst, frame->exp_bits);
     }
 
     frame->mant_bits = avail_bits - leftover;
@@ -320,16 +1008,63 @@ cbr_bit_allocation(A52ThreadContext *tctx, int prepare)
         fprintf(stderr, "bitrate: %d kbps too small\n", frame->bit_rate);
         return -1;
     }
+    if (ctx->params.snr_alloc)
+        leftover = alloc_snroffst(tctx, avail_bits, snroffst, leftover);
+    else
+        leftover = -1;
+
+    if (leftover >= 0) {
+        frame->mant_bits = avail_bits - leftover;
+    } else {
+        // fill in the bap arrays for the chosen snroffst
+        bit_alloc(tctx, snroffst);
 
-    // set encoding parameters
-    frame->csnroffst = snroffst >> 4;
-    frame->fsnroffst = snroffst & 0xF;
+        // set encoding parameters
+        frame->csnroffst = snroffst >> 4;
+        for (blk = 0; blk < A52_NUM_BLOCKS; blk++) {
+            for (ch = 0; ch < ctx->n_all_channels; ch++)
+                frame->blocks[blk].fsnroffst[ch] = snroffst & 0xF;
+        }
+    }
     frame->quality = snroffst;
-    tctx->last_quality = snroffst;
+    thread_store_release(&ctx->last_quality, snroffst);
+    // the fast search depends on where it starts. the input is reused in
+    // stream order, so taking the start from it keeps the output the same
+    // no matter which frames other threads finish first.
+    tctx->input->last_quality = snroffst;
 
     return 0;
 }
 
+/**
+ * Finds the smallest frame size code, up to the largest one allowed, whose
+ * frame can hold the given number of bits.
+ */
+static int
+find_frame_size(A52Context *ctx, int frame_bits)
+{
+    int i;
+
+    for (i = 0; i < ctx->frmsizecod; i++) {
+        if (a52_frame_size_tab[i][ctx->fscod] >= frame_bits)
+            break;
+    }
+    return i;
+}
+
+/** Sets up the frame for the given frame size code */
+static void
+set_frame_size(A52ThreadContext *tctx, int frmsizecod)
+{
+    A52Context *ctx = tctx->ctx;
+    A52Frame *frame = &tctx->frame;
+
+    frame->bit_rate = a52_bitrate_tab[frmsizecod/2] >> ctx->halfratecod;
+    frame->frmsizecod = frmsizecod;
+    frame->frame_size = a52_frame_size_tab[frmsizecod][ctx->fscod] / 16;
+    frame->frame_size_min = frame->frame_size;
+}
+
 /**
  * Finds the frame size which will hold all of the data when using an
  * snroffset value as determined by the user-selected quality setting.
@@ -339,29 +1074,17 @@ vbr_bit_allocation(A52ThreadContext *tctx)
 {
     A52Context *ctx = tctx->ctx;
     A52Frame *frame = &tctx->frame;
-    int i;
-    int frame_size;
     int quality;
-    int frame_bits, current_bits;
+    int current_bits;
 
     current_bits = frame->frame_bits + frame->exp_bits;
     quality = ctx->params.quality;
 
     bit_alloc_prepare(tctx);
+    bap_hist_init(tctx);
     // find an A52 frame size that can hold the data.
-    frame_size = 0;
-    frame_bits = current_bits + bit_alloc(tctx, quality);
-    for (i = 0; i <= ctx->frmsizecod; i++) {
-        frame_size = a52_frame_size_tab[i][ctx->fscod];
-        if (frame_size >= frame_bits)
-            break;
-    }
-    i = MIN(i, ctx->frmsizecod);
-    frame->bit_rate = a52_bitrate_tab[i/2] >> ctx->halfratecod;
-
-    frame->frmsizecod = i;
-    frame->frame_size = frame_size / 16;
-    frame->frame_size_min = frame->frame_size;
+    set_frame_size(tctx, find_frame_size(ctx,
+                   current_bits + count_mantissa_bits(tctx, quality, NULL)));
 
     // run CBR bit allocation.
     // this will increase snroffst to make optimal use of the frame bits.
@@ -369,6 +1092,133 @@ vbr_bit_allocation(A52ThreadContext *tctx)
     return cbr_bit_allocation(tctx, 0);
 }
 
+/**
+ * Counts the bits of the whole frame at the snroffst values 0, 16, ..., 1008.
+ */
+static void
+cost_frame(A52ThreadContext *tctx)
+{
+    A52Frame *frame = &tctx->frame;
+    int current_bits, i;
+
+    current_bits = frame->frame_bits + frame->exp_bits;
+
+    bit_alloc_prepare(tctx);
+    bap_hist_init(tctx);
+    for (i = 0; i < A52_ABR_QUALITIES; i++)
+        tctx->rc_cost[i] = current_bits + count_mantissa_bits(tctx, i*16, NULL);
+}
+
+#ifndef NO_THREADS
+/**
+ * Waits until all earlier frames have picked their size.
+ * Only frames from the job queue can be encoded out of order.
+ */
+static void
+abr_wait_turn(A52ThreadContext *tctx)
+{
+    A52Context *ctx = tctx->ctx;
+    unsigned int frame_num = tctx->input->frame_num;
+    unsigned int turn;
+
+    if (!ctx->jobs)
+        return;
+    while ((turn = thread_load_acquire(&ctx->rc.turn)) != frame_num) {
+        thread_wait_while_equal(&ctx->jobs[frame_num % ctx->queue.size].rc_waiter,
+                                &ctx->rc.turn, turn);
+    }
+}
+
+/** Hands the turn on to the next frame */
+static void
+abr_pass_turn(A52ThreadContext *tctx)
+{
+    A52Context *ctx = tctx->ctx;
+    unsigned int next = tctx->input->frame_num + 1;
+
+    if (!ctx->jobs)
+        return;
+    thread_store_release(&ctx->rc.turn, next);
+    thread_wake(&ctx->jobs[next % ctx->queue.size].rc_waiter);
+}
+#else
+#define abr_wait_turn(tctx)
+#define abr_pass_turn(tctx)
+#endif
+
+/**
+ * Finds the frame size in average bitrate mode.
+ * Every frame is costed at the snroffst values 0, 16, ..., 1008. The frame
+ * is sized like a VBR frame for the single snroffst at which the frames in
+ * the window, including this one, would come out at the average bitrate.
+ * Rounding up to the next frame size adds bits, so the target is scaled by
+ * how many bits the earlier frames needed compared to what they got. The
+ * frame is then filled up by the CBR bit allocation.
+ */
+static int
+abr_bit_allocation(A52ThreadContext *tctx)
+{
+    A52Context *ctx = tctx->ctx;
+    A52Frame *frame = &tctx->frame;
+    A52RateControl *rc = &ctx->rc;
+    int current_bits, n, slot, i, q;
+    int64_t target;
+
+    current_bits = frame->frame_bits + frame->exp_bits;
+
+    cost_frame(tctx);
+
+    abr_wait_turn(tctx);
+
+    // the oldest frame leaves the window
+    slot = rc->n_frames % A52_ABR_WINDOW;
+    if (rc->n_frames >= A52_ABR_WINDOW) {
+        for (i = 0; i < A52_ABR_QUALITIES; i++)
+            rc->cost_sum[i] -= rc->cost[slot][i];
+        rc->est_sum -= rc->est_bits[slot];
+        rc->frame_sum -= rc->frame_bits[slot];
+    }
+    for (i = 0; i < A52_ABR_QUALITIES; i++) {
+        rc->cost[slot][i] = tctx->rc_cost[i];
+        rc->cost_sum[i] += tctx->rc_cost[i];
+    }
+
+    n = MIN(rc->n_frames, A52_ABR_WINDOW-1) + 1;
+    target = (int64_t)n * ctx->target_bitrate * 1000 * A52_SAMPLES_PER_FRAME /
+             ctx->sample_rate;
+    if (rc->frame_sum > 0)
+        target = target * rc->est_sum / rc->frame_sum;
+
+    // highest snroffst within the target, interpolated between the costs
+    for (i = 0; i < A52_ABR_QUALITIES-1; i++) {
+        if (rc->cost_sum[i+1] > target)
+            break;
+    }
+    q = i * 16;
+    if (rc->cost_sum[i] > target) {
+        q = 0;
+    } else if (i == A52_ABR_QUALITIES-1) {
+        q = 1023;
+    } else if (rc->cost_sum[i+1] > rc->cost_sum[i]) {
+        q += (int)(16 * (target - rc->cost_sum[i]) /
+                   (rc->cost_sum[i+1] - rc->cost_sum[i]));
+        q = MIN(q, i*16+15);
+    }
+    frame->quality = q;
+
+    rc->est_bits[slot] = current_bits + count_mantissa_bits(tctx, q, NULL);
+    set_frame_size(tctx, find_frame_size(ctx, rc->est_bits[slot]));
+    rc->frame_bits[slot] = frame->frame_size * 16;
+    rc->est_sum += rc->est_bits[slot];
+    rc->frame_sum += rc->frame_bits[slot];
+    rc->n_frames++;
+
+    abr_pass_turn(tctx);
+
+    // use up the rest of the frame
+    return cbr_bit_allocation(tctx, 0);
+}
+
 /**
  * Loads the bit allocation parameters and counts fixed frame bits.
  */
@@ -407,6 +1257,203 @@ start_bit_allocation(A52ThreadContext *tctx)
     count_frame_bits(tctx);
 }
 
+/**
+ * Sizes a frame of the second pass as planned by plan_second_pass().
+ */
+static int
+second_pass_bit_allocation(A52ThreadContext *tctx)
+{
+    A52Context *ctx = tctx->ctx;
+    A52Frame *frame = &tctx->frame;
+    unsigned int frame_num = tctx->input->frame_num;
+
+    if (frame_num >= (unsigned int)ctx->n_pass_frames) {
+        fprintf(stderr, "frame %u is not in the first pass statistics\n",
+                frame_num);
+        return -1;
+    }
+    set_frame_size(tctx, ctx->pass_frames[frame_num].frmsizecod);
+    frame->quality = ctx->pass_frames[frame_num].quality;
+
+    return cbr_bit_allocation(tctx, 1);
+}
+
+static void
+write_le16(uint8_t *p, int v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void
+write_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static int
+read_le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t
+read_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+ * Writes the first pass statistics of a frame, which are
+ * A52_PASS_STATS_SIZE bytes, little-endian:
+ *   u8     bandwidth code
+ *   u8     number of channels, including LFE
+ *   u32    bits of the frame at snroffst 0
+ *   u16    63 times the bits added by going up 16 in snroffst
+ * Returns the number of bytes written.
+ */
+int
+write_pass_stats(A52ThreadContext *tctx, uint8_t *buf)
+{
+    A52Frame *frame = &tctx->frame;
+    int i;
+
+    start_bit_allocation(tctx);
+    cost_frame(tctx);
+
+    buf[0] = frame->bwcode;
+    buf[1] = tctx->ctx->n_all_channels;
+    write_le32(&buf[2], tctx->rc_cost[0]);
+    for (i = 1; i < A52_ABR_QUALITIES; i++) {
+        int step = tctx->rc_cost[i] - tctx->rc_cost[i-1];
+        write_le16(&buf[2*i+4], CLIP(step, 0, 0xFFFF));
+    }
+    frame->quality = 0;
+    frame->bit_rate = 0;
+
+    return A52_PASS_STATS_SIZE;
+}
+
+/** Bits of a frame at a snroffst, interpolated from its statistics */
+static int
+pass_stats_bits(const uint8_t *stats, int snroffst)
+{
+    int i, n, bits;
+
+    n = MIN(snroffst >> 4, A52_ABR_QUALITIES-1);
+    bits = read_le32(&stats[2]);
+    for (i = 1; i <= n; i++)
+        bits += read_le16(&stats[2*i+4]);
+    if (n < A52_ABR_QUALITIES-1)
+        bits += read_le16(&stats[2*n+6]) * (snroffst & 15) / 16;
+
+    return bits;
+}
+
+/**
+ * Plans the frame sizes of all frames for one snroffst and returns the
+ * total number of bits.
+ */
+static int64_t
+plan_pass_frames(A52Context *ctx, int snroffst)
+{
+    const uint8_t *stats = ctx->params.pass_stats;
+    int64_t total = 0;
+    int i, code;
+
+    for (i = 0; i < ctx->n_pass_frames; i++) {
+        code = find_frame_size(ctx, pass_stats_bits(stats, snroffst));
+        ctx->pass_frames[i].frmsizecod = code;
+        ctx->pass_frames[i].quality = snroffst;
+        total += a52_frame_size_tab[code][ctx->fscod];
+        stats += A52_PASS_STATS_SIZE;
+    }
+    return total;
+}
+
+/**
+ * Plans the frame sizes of the second pass from the first pass statistics.
+ * All frames get the highest snroffst at which the stream fits the target.
+ * The bits which are left go to the frames that are the first to need a
+ * larger frame as the snroffst goes on up.
+ */
+int
+plan_second_pass(A52Context *ctx)
+{
+    const uint8_t *stats = ctx->params.pass_stats;
+    int64_t target, total;
+    int i, lo, hi, q, bwcode;
+
+    ctx->n_pass_frames = ctx->params.pass_stats_size / A52_PASS_STATS_SIZE;
+    if (!stats || !ctx->n_pass_frames ||
+            ctx->params.pass_stats_size % A52_PASS_STATS_SIZE) {
+        fprintf(stderr, "invalid first pass statistics\n");
+        return -1;
+    }
+    bwcode = stats[0];
+    for (i = 0; i < ctx->n_pass_frames; i++) {
+        const uint8_t *s = &stats[i * A52_PASS_STATS_SIZE];
+        if (s[0] != bwcode || s[1] != ctx->n_all_channels) {
+            fprintf(stderr, "first pass statistics do not match the input\n");
+            return -1;
+        }
+    }
+    if (ctx->params.bwcode >= 0 && ctx->params.bwcode != bwcode) {
+        fprintf(stderr, "bandwidth differs from the first pass\n");
+        return -1;
+    }
+    ctx->fixed_bwcode = bwcode;
+
+    ctx->pass_frames = calloc(ctx->n_pass_frames, sizeof(A52PassFrame));
+    if (!ctx->pass_frames)
+        return -1;
+
+    if (ctx->params.target_size > 0) {
+        target = (int64_t)ctx->params.target_size * 8;
+    } else {
+        target = (int64_t)ctx->n_pass_frames * ctx->target_bitrate * 1000 *
+                 A52_SAMPLES_PER_FRAME / ctx->sample_rate;
+    }
+
+    lo = 0;
+    hi = 1023;
+    if (plan_pass_frames(ctx, hi) <= target) {
+        lo = hi;
+    } else {
+        while (hi - lo > 1) {
+            int mid = (lo + hi) / 2;
+            if (plan_pass_frames(ctx, mid) <= target)
+                lo = mid;
+            else
+                hi = mid;
+        }
+    }
+    total = plan_pass_frames(ctx, lo);
+    if (total > target)
+        fprintf(stderr, "warning: the target is too small for the input\n");
+
+    for (q = lo + 1; q <= MIN(lo + 16, 1023) && total < target; q++) {
+        stats = ctx->params.pass_stats;
+        for (i = 0; i < ctx->n_pass_frames; i++) {
+            A52PassFrame *f = &ctx->pass_frames[i];
+            int code = find_frame_size(ctx, pass_stats_bits(stats, q));
+            int64_t extra = a52_frame_size_tab[code][ctx->fscod] -
+                            a52_frame_size_tab[f->frmsizecod][ctx->fscod];
+            if (extra > 0 && total + extra <= target) {
+                f->frmsizecod = code;
+                f->quality = q;
+                total += extra;
+            }
+            stats += A52_PASS_STATS_SIZE;
+        }
+    }
+
+    return 0;
+}
+
 /** estimated number of bits used for a mantissa, indexed by bap value. */
 static FLOAT mant_est_tab[16] = {
     FCONST( 0.000), FCONST( 1.667),
@@ -473,7 +1520,16 @@ vbw_bit_allocation(A52ThreadContext *tctx)
         bw = (nc - 73) / 3;
         bits = 0;
         for (ch = 0; ch < ctx->n_channels; ch++) {
-            bits += expstr_set_bits[frame->expstr_set[ch]][nc];
+            if (frame->expstr_set[ch] >= 0) {
+                bits += expstr_set_bits[frame->expstr_set[ch]][nc];
+            } else {
+                // strategies chosen block by block
+                for (blk = 0; blk < A52_NUM_BLOCKS; blk++) {
+                    int expstr = frame->blocks[blk].exp_strategy[ch];
+                    if (expstr != EXP_REUSE)
+                        bits += 4 + nexpgrptab[expstr-1][nc] * 7;
+                }
+            }
             for (blk = 0; blk < A52_NUM_BLOCKS; blk++)
                 mant_bits += mant_est_tab[frame->blocks[blk].bap[ch][nc]];
         }
@@ -491,7 +1547,7 @@ vbw_bit_allocation(A52ThreadContext *tctx)
 
 /**
  * Run the bit allocation encoding routine.
- * Runs the bit allocation in either CBR or VBR mode, depending on the mode
+ * Runs the bit allocation in CBR, VBR or ABR mode, depending on the mode
  * selected by the user.
  */
 int
@@ -506,8 +1562,33 @@ compute_bit_allocation(A52ThreadContext *tctx)
     } else if(ctx->params.encoding_mode == AFTEN_ENC_MODE_CBR) {
         if (cbr_bit_allocation(tctx, 1))
             return -1;
+    } else if(ctx->params.encoding_mode == AFTEN_ENC_MODE_ABR) {
+        if (ctx->params.pass == 2) {
+            if (second_pass_bit_allocation(tctx))
+                return -1;
+        } else if (abr_bit_allocation(tctx)) {
+            return -1;
+        }
     } else {
         return -1;
     }
     return 0;
 }
+
+/**
+ * Sets up the bit allocation functions for the available SIMD instructions
+ */
+void
+bit_alloc_init(A52BitAllocFunctions *baf)
+{
+    baf->prepare = bit_alloc_prepare_pairs;
+    baf->calc_bap = a52_bit_alloc_calc_bap;
+    baf->compute_mantissa_size = compute_mantissa_size;
+#ifdef HAVE_SSE2
+    if (cpu_caps_have_sse2()) {
+        baf->prepare = a52_bit_alloc_prepare_sse2;
+        baf->calc_bap = a52_bit_alloc_calc_bap_sse2;
+        baf->compute_mantissa_size = compute_mantissa_size_sse2;
+    }
+#endif /* HAVE_SSE2 */
+}
@@ -28,10 +28,65 @@
 #ifndef BITALLOC_H
 #define BITALLOC_H
 
+#include "common.h"
+#include "a52.h"
+
+#if defined(HAVE_MMX) || defined(HAVE_SSE)
+#include "x86/bitalloc.h"
+#endif
+
 struct A52ThreadContext;
+struct A52Context;
+
+/** size of the first pass statistics of one frame */
+#define A52_PASS_STATS_SIZE 132
+
+/** number of channel/block pairs prepared together */
+#define A52_BIT_ALLOC_LANES 8
+
+/**
+ * Channel/block pairs with the same number of coefficients, whose psd and
+ * masking curve are computed in one pass.
+ */
+typedef struct A52BitAllocGroup {
+    int n;
+    int end;
+    uint8_t blk[A52_BIT_ALLOC_LANES];
+    uint8_t ch[A52_BIT_ALLOC_LANES];
+} A52BitAllocGroup;
+
+typedef struct A52BitAllocFunctions {
+
+    /**
+     * Calculate the psd and the masking curve of bins 0 to end-1 for n
+     * channel/block pairs, 1 <= n <= A52_BIT_ALLOC_LANES.
+     */
+    void (*prepare)(A52BitAllocParams *s, int n, uint8_t **exp, int16_t **psd,
+                    int16_t **mask, const int *fgain, int end);
+
+    /**
+     * Calculate the bap values of bins start to end-1 from the masking curve
+     * and the psd, as a52_bit_alloc_calc_bap() does.
+     */
+    void (*calc_bap)(int16_t *mask, int16_t *psd, int start, int end,
+                     int snr_offset, int floor, uint8_t *bap);
+
+    /**
+     * Count the bits of all ungrouped mantissas and add the number of bap=1
+     * to bap=4 mantissas to mant_cnt.
+     */
+    int (*compute_mantissa_size)(int mant_cnt[5], uint8_t *bap, int ncoefs);
+
+} A52BitAllocFunctions;
+
+extern void bit_alloc_init(A52BitAllocFunctions *baf);
 
 extern void vbw_bit_allocation(struct A52ThreadContext *tctx);
 
 extern int compute_bit_allocation(struct A52ThreadContext *tctx);
 
+extern int write_pass_stats(struct A52ThreadContext *tctx, uint8_t *buf);
+
+extern int plan_second_pass(struct A52Context *ctx);
+
 #endif /* BITALLOC_H */
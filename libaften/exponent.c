@@ -42,57 +42,101 @@ static const uint8_t expstr_set_search_order_tab[A52_EXPSTR_SETS] = {
 };
 
 
+/**
+ * Encoded exponent errors of the runs of blocks of one channel.
+ * A run is a first block, a length and a strategy, and its error does not
+ * depend on the strategies of the other blocks, so each one is computed once
+ * and shared by all strategy combinations containing it.
+ */
+typedef struct A52ExpRuns {
+    uint8_t **exp;
+    int ncoefs;
+    // minimum of blocks i to j in min[i][j], only the first ncoefs exponents
+    // are merged, the rest come from block i
+    uint8_t min[A52_NUM_BLOCKS][A52_NUM_BLOCKS][256];
+    uint8_t min_ready[A52_NUM_BLOCKS][A52_NUM_BLOCKS];
+    int error[A52_NUM_BLOCKS][A52_NUM_BLOCKS][3];
+} A52ExpRuns;
+
+static void
+exp_runs_init(A52ExpRuns *runs, uint8_t *exp[A52_NUM_BLOCKS], int ncoefs)
+{
+    int i, j;
+
+    runs->exp = exp;
+    runs->ncoefs = ncoefs;
+    memset(runs->min_ready, 0, sizeof(runs->min_ready));
+    for (i = 0; i < A52_NUM_BLOCKS; i++)
+        for (j = 0; j < A52_NUM_BLOCKS; j++)
+            runs->error[i][j][0] = runs->error[i][j][1] = runs->error[i][j][2] = -1;
+}
+
+/**
+ * Returns the sum of squared errors of blocks i to j-1 when they share the
+ * exponents of block i, encoded with strategy expstr.
+ */
+static int
+exp_run_error(A52ExponentFunctions *expf, A52ExpRuns *runs, int i, int j,
+              int expstr)
+{
+    uint8_t encoded[256];
+    uint8_t **exp = runs->exp;
+    int blk, k, err;
+
+    if (runs->error[i][j-1][expstr-1] >= 0)
+        return runs->error[i][j-1][expstr-1];
+
+    // extend the shorter runs from the same block one at a time
+    if (!runs->min_ready[i][i]) {
+        memcpy(runs->min[i][i], exp[i], 256);
+        runs->min_ready[i][i] = 1;
+    }
+    for (k = i + 1; k < j; k++) {
+        if (runs->min_ready[i][k])
+            continue;
+        memcpy(runs->min[i][k], runs->min[i][k-1], 256);
+        expf->exponent_min(runs->min[i][k], runs->min[i][k], exp[k], runs->ncoefs);
+        runs->min_ready[i][k] = 1;
+    }
+
+    memcpy(encoded, runs->min[i][j-1], 256);
+    expf->encode_exp_blk_ch(encoded, runs->ncoefs, expstr);
+    err = 0;
+    for (blk = i; blk < j; blk++)
+        err += expf->exponent_sum_square_error(exp[blk], encoded, runs->ncoefs);
+    runs->error[i][j-1][expstr-1] = err;
+
+    return err;
+}
+
 /**
  * Determine a good exponent strategy for all blocks of a single channel.
  * A pre-defined set of strategies is chosen based on the SSE between each set
  * and the most accurate strategy set (all blocks EXP_D15).
+ * Many sets have runs in common, their errors are only computed once.
  */
 static int
-compute_expstr_ch(A52ExponentFunctions *expf, uint8_t *exp[A52_NUM_BLOCKS],
-                  int ncoefs, int search_size)
+compute_expstr_ch(A52ExponentFunctions *expf, A52ExpRuns *runs, int search_size)
 {
-    uint8_t exponents[A52_NUM_BLOCKS][256];
-	uint8_t* expSource[A52_NUM_BLOCKS];
-    int blk, s, i, j, k;
+    int s, i, j, str;
     int min_error, exp_error[A52_EXPSTR_SETS];
 
     min_error = expstr_set_search_order_tab[0];
     for (s = 0; s < search_size; s++) {
-        int str = expstr_set_search_order_tab[s];
-		const uint8_t* expstr_set_tab = a52_expstr_set_tab[str];
+        const uint8_t *expstr_set;
 
-        // collect exponents
-        for (blk = 0; blk < A52_NUM_BLOCKS; blk++)
-			expSource[blk] = exp[blk];
+        str = expstr_set_search_order_tab[s];
+        expstr_set = a52_expstr_set_tab[str];
 
-        // encode exponents
+        // select strategy based on minimum error from unencoded exponents
+        exp_error[str] = 0;
         i = 0;
         while (i < A52_NUM_BLOCKS) {
-			uint8_t* currentExp = exponents[i];
             j = i + 1;
-
-			// Special handling for first time, as exponents[i] != expSource[i]
-			if (j < A52_NUM_BLOCKS && expstr_set_tab[j]==EXP_REUSE) {
-				expf->exponent_min(currentExp, expSource[i], expSource[j], ncoefs);
-				j++;
-			}
-            while (j < A52_NUM_BLOCKS && expstr_set_tab[j]==EXP_REUSE) {
-				expf->exponent_min(currentExp, currentExp, expSource[j], ncoefs);
+            while (j < A52_NUM_BLOCKS && expstr_set[j] == EXP_REUSE)
                 j++;
-            }
-            expf->encode_exp_blk_ch(currentExp, ncoefs, expstr_set_tab[i]);
-            for (k = i; k < j; k++)
-				expSource[k] = currentExp;
-
-			i = j;
-        }
-
-        // select strategy based on minimum error from unencoded exponents
-        exp_error[str] = 0;
-        for (blk = 0; blk < A52_NUM_BLOCKS; blk++) {
-            exp_error[str] += expf->exponent_sum_square_error(exp[blk],
-                                                        expSource[blk],
-                                                        ncoefs);
+            exp_error[str] += exp_run_error(expf, runs, i, j, expstr_set[i]);
+            i = j;
         }
         if (exp_error[str] < exp_error[min_error])
             min_error = str;
@@ -101,35 +145,107 @@ compute_expstr_ch(A52ExponentFunctions *expf, uint8_t *exp[A52_NUM_BLOCKS],
 }
 
 /**
- * Runs the per-channel exponent strategy decision function for all channels
+ * Finds the exponent strategies of one channel with the lowest cost over all
+ * legal combinations, by dynamic programming over the runs of blocks. The
+ * cost of a run is its squared error plus EXPSTR_BITS_WEIGHT times the
+ * exponent bits it sends.
+ * Encoded exponents never exceed the merged minimum they are made from, and
+ * D15 gives the largest ones a decoder accepts, then D25, then D45. So the D15
+ * error of a run is a lower bound for its other strategies, and for the
+ * longer runs from the same block. Runs which cannot beat the best cost found
+ * so far with this bound are not encoded. At most 63 runs are encoded.
  */
+#define EXPSTR_BITS_WEIGHT 5
+
 static void
-compute_exponent_strategy(A52ThreadContext *tctx)
+compute_expstr_optimal_ch(A52ExponentFunctions *expf, A52ExpRuns *runs,
+                          uint8_t *exp_strategy)
+{
+    int cost[A52_NUM_BLOCKS+1];
+    int run_start[A52_NUM_BLOCKS+1];
+    int run_expstr[A52_NUM_BLOCKS+1];
+    int min_error[A52_NUM_BLOCKS];
+    int i, j, blk, expstr, err, c;
+
+    // the error bound of the runs from block i, updated as they grow
+    for (i = 0; i < A52_NUM_BLOCKS; i++)
+        min_error[i] = 0;
+
+    cost[0] = 0;
+    for (j = 1; j <= A52_NUM_BLOCKS; j++) {
+        cost[j] = INT32_MAX;
+        for (i = j - 1; i >= 0; i--) {
+            for (expstr = EXP_D15; expstr <= EXP_D45; expstr++) {
+                c = cost[i] + EXPSTR_BITS_WEIGHT *
+                    (4 + nexpgrptab[expstr-1][runs->ncoefs] * 7);
+                if (c + min_error[i] >= cost[j])
+                    continue;
+                err = exp_run_error(expf, runs, i, j, expstr);
+                if (expstr == EXP_D15)
+                    min_error[i] = err;
+                if (c + err < cost[j]) {
+                    cost[j] = c + err;
+                    run_start[j] = i;
+                    run_expstr[j] = expstr;
+                }
+            }
+        }
+    }
+
+    // walk back through the chosen runs
+    j = A52_NUM_BLOCKS;
+    while (j > 0) {
+        i = run_start[j];
+        exp_strategy[i] = run_expstr[j];
+        for (blk = i + 1; blk < j; blk++)
+            exp_strategy[blk] = EXP_REUSE;
+        j = i;
+    }
+}
+
+/**
+ * Runs the exponent strategy decision function for a single channel
+ */
+static void
+compute_exponent_strategy(A52ThreadContext *tctx, int ch)
 {
     A52Context *ctx = tctx->ctx;
     A52Frame *frame = &tctx->frame;
     A52Block *blocks = frame->blocks;
     int *ncoefs = frame->ncoefs;
-    uint8_t *exp[A52_MAX_CHANNELS][A52_NUM_BLOCKS];
-    int ch, blk, str;
-
-    for (ch = 0; ch < ctx->n_channels; ch++) {
-        str = expstr_set_search_order_tab[0];
-        if (ctx->params.expstr_search > 1) {
-            for (blk = 0; blk < A52_NUM_BLOCKS; blk++)
-                exp[ch][blk] = blocks[blk].exp[ch];
-            str = compute_expstr_ch(&ctx->expf, exp[ch], ncoefs[ch], ctx->params.expstr_search);
-        }
+    uint8_t *exp[A52_NUM_BLOCKS];
+    uint8_t exp_strategy[A52_NUM_BLOCKS];
+    A52ExpRuns runs;
+    int blk, str;
+
+    // lfe channel
+    if (ch == ctx->lfe_channel) {
         for (blk = 0; blk < A52_NUM_BLOCKS; blk++)
-            blocks[blk].exp_strategy[ch] = a52_expstr_set_tab[str][blk];
-        frame->expstr_set[ch] = str;
+            blocks[blk].exp_strategy[ch] = !blk ? EXP_D15 : EXP_REUSE;
+        return;
     }
 
-    // lfe channel
-    if (ctx->lfe) {
+    for (blk = 0; blk < A52_NUM_BLOCKS; blk++)
+        exp[blk] = blocks[blk].exp[ch];
+
+    if (ctx->params.expstr_optimal) {
+        exp_runs_init(&runs, exp, ncoefs[ch]);
+        compute_expstr_optimal_ch(&ctx->expf, &runs, exp_strategy);
         for (blk = 0; blk < A52_NUM_BLOCKS; blk++)
-            blocks[blk].exp_strategy[ctx->lfe_channel] = !blk ? EXP_D15 : EXP_REUSE;
+            blocks[blk].exp_strategy[ch] = exp_strategy[blk];
+        // not one of the pre-defined sets
+        frame->expstr_set[ch] = -1;
+        return;
     }
+
+    str = expstr_set_search_order_tab[0];
+    if (ctx->params.expstr_search > 1) {
+        exp_runs_init(&runs, exp, ncoefs[ch]);
+        str = compute_expstr_ch(&ctx->expf, &runs, ctx->params.expstr_search);
+    }
+    for (blk = 0; blk < A52_NUM_BLOCKS; blk++)
+        blocks[blk].exp_strategy[ch] = a52_expstr_set_tab[str][blk];
+    frame->expstr_set[ch] = str;
 }
 
 /**
@@ -189,62 +305,64 @@ group_exponents(A52ThreadContext *tctx)
 }
 
 /**
- * Creates final exponents for the entire frame based on exponent strategies.
- * If the strategy for a block & channel is EXP_REUSE, exponents are copied,
+ * Creates final exponents for one channel based on exponent strategies.
+ * If the strategy for a block is EXP_REUSE, exponents are copied,
  * otherwise they are encoded according to the specific exponent strategy.
  */
 static void
-encode_exponents(A52ThreadContext *tctx)
+encode_exponents(A52ThreadContext *tctx, int ch)
 {
     A52Context *ctx = tctx->ctx;
     A52Frame *frame = &tctx->frame;
     A52Block *blocks = frame->blocks;
     int *ncoefs = frame->ncoefs;
-    int ch, i, j, k;
-
-    for (ch = 0; ch < ctx->n_all_channels; ch++) {
-        // compute the exponents as the decoder will see them. The
-        // EXP_REUSE case must be handled carefully : we select the
-        // min of the exponents
-        i = 0;
-        while (i < A52_NUM_BLOCKS) {
-            j = i + 1;
-            while (j < A52_NUM_BLOCKS && blocks[j].exp_strategy[ch]==EXP_REUSE) {
-                ctx->expf.exponent_min(blocks[i].exp[ch], blocks[i].exp[ch], blocks[j].exp[ch], ncoefs[ch]);
-                j++;
-            }
-            ctx->expf.encode_exp_blk_ch(blocks[i].exp[ch], ncoefs[ch],
-                              blocks[i].exp_strategy[ch]);
-            // copy encoded exponents for reuse case
-            for (k = i+1; k < j; k++)
-                memcpy(blocks[k].exp[ch], blocks[i].exp[ch], ncoefs[ch]);
-            i = j;
+    int i, j, k;
+
+    // compute the exponents as the decoder will see them. The
+    // EXP_REUSE case must be handled carefully : we select the
+    // min of the exponents
+    i = 0;
+    while (i < A52_NUM_BLOCKS) {
+        j = i + 1;
+        while (j < A52_NUM_BLOCKS && blocks[j].exp_strategy[ch]==EXP_REUSE) {
+            ctx->expf.exponent_min(blocks[i].exp[ch], blocks[i].exp[ch], blocks[j].exp[ch], ncoefs[ch]);
+            j++;
         }
+        ctx->expf.encode_exp_blk_ch(blocks[i].exp[ch], ncoefs[ch],
+                          blocks[i].exp_strategy[ch]);
+        // copy encoded exponents for reuse case
+        for (k = i+1; k < j; k++)
+            memcpy(blocks[k].exp[ch], blocks[i].exp[ch], ncoefs[ch]);
+        i = j;
     }
 }
 
 /**
- * Extracts the optimal exponent portion of each MDCT coefficient.
+ * Extracts the optimal exponent portion of each MDCT coefficient of a channel.
  */
 static void
-extract_exponents(A52ThreadContext *tctx)
+extract_exponents(A52ThreadContext *tctx, int ch)
 {
+    A52Context *ctx = tctx->ctx;
     A52Frame *frame = &tctx->frame;
-    int all_channels = tctx->ctx->n_all_channels;
-    int blk, ch, j;
-
-    for (ch = 0; ch < all_channels; ch++) {
-        for (blk = 0; blk < A52_NUM_BLOCKS; blk++) {
-            A52Block* block = &frame->blocks[blk];
-			uint8_t* currentExp = block->exp[ch];
-			FLOAT* currentCoef = block->mdct_coef[ch];
-            for (j = 0; j < 256; j += 2) {
-                uint32_t v1 = (uint32_t)AFT_FABS(currentCoef[j  ] * FCONST(16777216.0));
-                uint32_t v2 = (uint32_t)AFT_FABS(currentCoef[j+1] * FCONST(16777216.0));
-                currentExp[j  ] = (v1 == 0)? 24 : 23 - log2i(v1);
-                currentExp[j+1] = (v2 == 0)? 24 : 23 - log2i(v2);
-            }
-        }
+    int blk;
+
+    for (blk = 0; blk < A52_NUM_BLOCKS; blk++) {
+        A52Block *block = &frame->blocks[blk];
+        ctx->expf.extract_exponents(block->exp[ch], block->mdct_coef[ch]);
+    }
+}
+
+static void
+extract_exponents_blk_ch(uint8_t *exp, FLOAT *coef)
+{
+    int j;
+
+    for (j = 0; j < 256; j += 2) {
+        uint32_t v1 = (uint32_t)AFT_FABS(coef[j  ] * FCONST(16777216.0));
+        uint32_t v2 = (uint32_t)AFT_FABS(coef[j+1] * FCONST(16777216.0));
+        exp[j  ] = (v1 == 0)? 24 : 23 - log2i(v1);
+        exp[j+1] = (v2 == 0)? 24 : 23 - log2i(v2);
     }
 }
 
@@ -329,19 +447,71 @@ exponent_sum_square_error(uint8_t *exp0, uint8_t *exp1, int ncoefs)
 }
 
 
+/**
+ * Extracts, analyzes and encodes the exponents of one channel.
+ * Channels are independent of each other up to this point.
+ */
+static void
+process_exponents_ch(A52ThreadContext *tctx, int ch, UNUSED(int worker))
+{
+    A52Context *ctx = tctx->ctx;
+    A52Frame *frame = &tctx->frame;
+    int blk;
+
+    extract_exponents(tctx, ch);
+
+    // with variable bandwidth, the exponents may be encoded again once the
+    // bandwidth is known
+    if (ctx->params.bwcode == -2) {
+        for (blk = 0; blk < A52_NUM_BLOCKS; blk++)
+            memcpy(frame->blocks[blk].raw_exp[ch], frame->blocks[blk].exp[ch], 256);
+    }
+
+    compute_exponent_strategy(tctx, ch);
+
+    encode_exponents(tctx, ch);
+
+    frame->exp_ncoefs[ch] = frame->ncoefs[ch];
+    frame->bit_alloc_ready[ch] = 0;
+}
+
+/**
+ * Encodes the exponents of one channel again if its bandwidth has changed,
+ * starting from the extracted exponents.
+ */
+static void
+reprocess_exponents_ch(A52ThreadContext *tctx, int ch, UNUSED(int worker))
+{
+    A52Frame *frame = &tctx->frame;
+    int blk;
+
+    if (frame->exp_ncoefs[ch] == frame->ncoefs[ch])
+        return;
+
+    for (blk = 0; blk < A52_NUM_BLOCKS; blk++)
+        memcpy(frame->blocks[blk].exp[ch], frame->blocks[blk].raw_exp[ch], 256);
+
+    compute_exponent_strategy(tctx, ch);
+
+    encode_exponents(tctx, ch);
+
+    frame->exp_ncoefs[ch] = frame->ncoefs[ch];
+    frame->bit_alloc_ready[ch] = 0;
+}
+
 /**
  * Runs all the processes in extracting, analyzing, and encoding exponents
  */
 void
 a52_process_exponents(A52ThreadContext *tctx)
 {
-    extract_exponents(tctx);
-
-    compute_exponent_strategy(tctx);
+    A52Context *ctx = tctx->ctx;
 
-    encode_exponents(tctx);
+    ctx->run_frame_tasks(tctx, process_exponents_ch, ctx->n_all_channels);
 
-    group_exponents(tctx);
+    // with variable bandwidth, a52_reprocess_exponents() groups them
+    if (ctx->params.bwcode != -2)
+        group_exponents(tctx);
 }
 
 
@@ -381,6 +551,7 @@ exponent_init(A52ExponentFunctions *expf)
     expf->exponent_min = exponent_min;
     expf->encode_exp_blk_ch = encode_exp_blk_ch;
     expf->exponent_sum_square_error = exponent_sum_square_error;
+    expf->extract_exponents = extract_exponents_blk_ch;
 #ifdef HAVE_MMX
     if (cpu_caps_have_mmx()) {
         expf->exponent_min = exponent_min_mmx;
@@ -393,6 +564,30 @@ exponent_init(A52ExponentFunctions *expf)
         expf->exponent_min = exponent_min_sse2;
         expf->encode_exp_blk_ch = encode_exp_blk_ch_sse2;
         expf->exponent_sum_square_error = exponent_sum_square_error_sse2;
+        expf->extract_exponents = extract_exponents_sse2;
     }
 #endif /* HAVE_SSE2 */
+#ifdef HAVE_AVX2
+    if (cpu_caps_have_avx2()) {
+        expf->exponent_min = exponent_min_avx2;
+        expf->encode_exp_blk_ch = encode_exp_blk_ch_avx2;
+        expf->exponent_sum_square_error = exponent_sum_square_error_avx2;
+        expf->extract_exponents = extract_exponents_avx2;
+    }
+#endif /* HAVE_AVX2 */
+}
+
+/**
+ * Updates the exponents after the bandwidth of the frame has been changed.
+ * Channels which kept their bandwidth keep their exponents, and with them
+ * their psd and masking curve.
+ */
+void
+a52_reprocess_exponents(A52ThreadContext *tctx)
+{
+    A52Context *ctx = tctx->ctx;
+
+    ctx->run_frame_tasks(tctx, reprocess_exponents_ch, ctx->n_all_channels);
+
+    group_exponents(tctx);
 }
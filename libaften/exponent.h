@@ -58,10 +58,17 @@ typedef struct A52ExponentFunctions {
      */
     int (*exponent_sum_square_error)(uint8_t *exp0, uint8_t *exp1, int ncoefs);
 
+    /**
+     * Extract the exponents of the 256 MDCT coefficients of one block.
+     */
+    void (*extract_exponents)(uint8_t *exp, FLOAT *coef);
+
 } A52ExponentFunctions;
 
 extern void exponent_init(A52ExponentFunctions *expf);
 
 extern void a52_process_exponents(struct A52ThreadContext *tctx);
 
+extern void a52_reprocess_exponents(struct A52ThreadContext *tctx);
+
 #endif /* EXPONENT_H */
@@ -600,6 +600,12 @@ void
 mdct_init(A52Context *ctx)
 {
 #ifndef CONFIG_DOUBLE
+#if defined(HAVE_AVX2) && defined(HAVE_FMA)
+    if (cpu_caps_have_avx2() && cpu_caps_have_fma()) {
+        mdct_init_avx2(ctx);
+        return;
+    }
+#endif
 #ifdef HAVE_SSE3
     if (cpu_caps_have_sse3()) {
         mdct_init_sse3(ctx);
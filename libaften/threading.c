@@ -0,0 +1,320 @@
+/**
+ * Aften: A/52 audio encoder
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file threading.c
+ * Number of usable CPUs and placement of worker threads
+ */
+
+// sched_getaffinity() and pthread_setaffinity_np() are GNU extensions
+#define _GNU_SOURCE
+
+#include "common.h"
+
+#include "aften-types.h"
+#include "threading.h"
+
+#ifdef HAVE_SCHED_GETAFFINITY
+#include <sched.h>
+#endif
+
+#if defined(HAVE_POSIX_THREADS) && defined(HAVE_GET_NPROCS)
+/**
+ * Reads the CPU quota of one cgroup directory, in CPUs rounded up.
+ * Returns 0 if the directory sets no quota.
+ */
+static int
+read_cgroup_quota(const char *dir, int v2)
+{
+    char path[1024 + 32];
+    FILE *f;
+    long long quota = -1, period = 0;
+    int ret;
+
+    if (v2) {
+        // "max 100000" or "<quota> <period>"
+        snprintf(path, sizeof(path), "%s/cpu.max", dir);
+        f = fopen(path, "r");
+        if (!f)
+            return 0;
+        ret = fscanf(f, "%lld %lld", &quota, &period);
+        fclose(f);
+        if (ret != 2)
+            return 0;
+    } else {
+        snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", dir);
+        f = fopen(path, "r");
+        if (!f)
+            return 0;
+        ret = fscanf(f, "%lld", &quota);
+        fclose(f);
+        if (ret != 1)
+            return 0;
+        snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", dir);
+        f = fopen(path, "r");
+        if (!f)
+            return 0;
+        ret = fscanf(f, "%lld", &period);
+        fclose(f);
+        if (ret != 1)
+            return 0;
+    }
+    if (quota <= 0 || period <= 0)
+        return 0;
+
+    return (int)MAX((quota + period - 1) / period, 1);
+}
+
+/**
+ * Returns the smallest CPU quota of the cgroup of this process and its
+ * parents, or 0 if there is none. The cgroup is looked up in
+ * /proc/self/cgroup; with a cgroup namespace, the root of the mount is the
+ * cgroup of the container, which is tried as well.
+ */
+static int
+get_cgroup_quota(void)
+{
+    static const char *v1_mounts[2] = {
+        "/sys/fs/cgroup/cpu,cpuacct", "/sys/fs/cgroup/cpu"
+    };
+    char line[512], dir[1024];
+    FILE *f;
+    int quota = 0;
+
+    f = fopen("/proc/self/cgroup", "r");
+    if (!f)
+        return 0;
+    while (fgets(line, sizeof(line), f)) {
+        // "<id>:<controllers>:<path>", controllers are empty for cgroup v2
+        char *controllers = strchr(line, ':');
+        char *cgpath, *end;
+        int v2, m;
+
+        if (!controllers)
+            continue;
+        controllers++;
+        cgpath = strchr(controllers, ':');
+        if (!cgpath)
+            continue;
+        *cgpath++ = '\0';
+        end = cgpath + strlen(cgpath);
+        while (end > cgpath && (end[-1] == '\n' || end[-1] == '/'))
+            *--end = '\0';
+
+        v2 = !*controllers;
+        if (!v2 && !strstr(controllers, "cpu"))
+            continue;
+
+        for (m = 0; m < (v2 ? 1 : 2); m++) {
+            const char *mount = v2 ? "/sys/fs/cgroup" : v1_mounts[m];
+            int len = strlen(cgpath);
+
+            // the cgroup and every parent up to the root of the mount
+            while (1) {
+                int q;
+                snprintf(dir, sizeof(dir), "%s%.*s", mount, len, cgpath);
+                q = read_cgroup_quota(dir, v2);
+                if (q > 0 && (!quota || q < quota))
+                    quota = q;
+                if (!len)
+                    break;
+                while (len > 0 && cgpath[len-1] != '/')
+                    len--;
+                if (len > 0)
+                    len--;
+            }
+        }
+    }
+    fclose(f);
+
+    return quota;
+}
+
+int
+get_ncpus(void)
+{
+    int n = get_nprocs();
+    int quota;
+#ifdef HAVE_SCHED_GETAFFINITY
+    cpu_set_t set;
+
+    if (!sched_getaffinity(0, sizeof(set), &set))
+        n = CPU_COUNT(&set);
+#endif
+    quota = get_cgroup_quota();
+    if (quota > 0)
+        n = MIN(n, quota);
+
+    return MAX(n, 1);
+}
+#endif /* HAVE_POSIX_THREADS && HAVE_GET_NPROCS */
+
+#ifndef NO_THREADS
+typedef struct CpuPlace {
+    int cpu;
+    int package;
+    int core_rank;      ///< index of the core within its package
+    int sibling_rank;   ///< index of the CPU within its core
+} CpuPlace;
+
+static int
+cmp_compact(const void *a, const void *b)
+{
+    const CpuPlace *pa = a;
+    const CpuPlace *pb = b;
+
+    if (pa->package != pb->package)
+        return pa->package - pb->package;
+    if (pa->core_rank != pb->core_rank)
+        return pa->core_rank - pb->core_rank;
+    return pa->sibling_rank - pb->sibling_rank;
+}
+
+static int
+cmp_scatter(const void *a, const void *b)
+{
+    const CpuPlace *pa = a;
+    const CpuPlace *pb = b;
+
+    if (pa->sibling_rank != pb->sibling_rank)
+        return pa->sibling_rank - pb->sibling_rank;
+    if (pa->core_rank != pb->core_rank)
+        return pa->core_rank - pb->core_rank;
+    return pa->package - pb->package;
+}
+
+#ifdef HAVE_SCHED_GETAFFINITY
+static int
+read_topology_id(int cpu, const char *name, int def)
+{
+    char path[128];
+    FILE *f;
+    int id;
+
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+    f = fopen(path, "r");
+    if (!f)
+        return def;
+    if (fscanf(f, "%d", &id) != 1)
+        id = def;
+    fclose(f);
+
+    return id;
+}
+#endif
+
+/**
+ * Lists the CPUs this process may run on along with their place in the
+ * machine. Without topology information every CPU is a core of its own.
+ */
+static int
+get_cpu_places(CpuPlace *places, int max_places)
+{
+    int core_id[CPU_PLACES_MAX];
+    int i, j, n = 0;
+#ifdef HAVE_SCHED_GETAFFINITY
+    cpu_set_t set;
+
+    if (!sched_getaffinity(0, sizeof(set), &set)) {
+        for (i = 0; i < CPU_SETSIZE && n < max_places; i++) {
+            if (!CPU_ISSET(i, &set))
+                continue;
+            places[n].cpu = i;
+            places[n].package = read_topology_id(i, "physical_package_id", 0);
+            core_id[n] = read_topology_id(i, "core_id", i);
+            n++;
+        }
+    }
+#endif
+    if (!n) {
+        n = MIN(get_ncpus(), max_places);
+        for (i = 0; i < n; i++) {
+            places[i].cpu = i;
+            places[i].package = 0;
+            core_id[i] = i;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        int new_core = 1;
+        places[i].core_rank = 0;
+        places[i].sibling_rank = 0;
+        for (j = 0; j < i; j++) {
+            if (places[j].package != places[i].package)
+                continue;
+            if (core_id[j] == core_id[i]) {
+                places[i].core_rank = places[j].core_rank;
+                places[i].sibling_rank++;
+                new_core = 0;
+            } else if (new_core) {
+                places[i].core_rank = MAX(places[i].core_rank, places[j].core_rank + 1);
+            }
+        }
+    }
+
+    return n;
+}
+
+void
+thread_plan_cpus(int policy, const int *list, int n_list, int *cpus, int n)
+{
+    CpuPlace places[CPU_PLACES_MAX];
+    int i, n_places;
+
+    for (i = 0; i < n; i++)
+        cpus[i] = -1;
+
+    switch (policy) {
+    case AFTEN_PIN_LIST:
+        for (i = 0; i < n && n_list > 0; i++)
+            cpus[i] = list[i % n_list];
+        break;
+    case AFTEN_PIN_COMPACT:
+    case AFTEN_PIN_SCATTER:
+        n_places = get_cpu_places(places, CPU_PLACES_MAX);
+        if (n_places <= 0)
+            break;
+        qsort(places, n_places, sizeof(CpuPlace),
+              policy == AFTEN_PIN_COMPACT ? cmp_compact : cmp_scatter);
+        for (i = 0; i < n; i++)
+            cpus[i] = places[i % n_places].cpu;
+        break;
+    }
+}
+
+void
+thread_pin_cpu(int cpu)
+{
+#if defined(HAVE_POSIX_THREADS) && defined(HAVE_SCHED_GETAFFINITY)
+    cpu_set_t set;
+
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+        fprintf(stderr, "could not pin thread to CPU %d\n", cpu);
+#elif defined(HAVE_WINDOWS_THREADS)
+    if (cpu < 0 || cpu >= (int)(sizeof(DWORD_PTR) * 8))
+        return;
+    if (!SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu))
+        fprintf(stderr, "could not pin thread to CPU %d\n", cpu);
+#endif
+}
+#endif /* NO_THREADS */
@@ -23,7 +23,6 @@
 
 typedef enum
 {
-    START,
     WORK,
     END,
     ABORT
@@ -31,6 +30,12 @@ typedef enum
 
 #ifdef HAVE_POSIX_THREADS
 #include <pthread.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#else
+#include <fcntl.h>
+#endif
 
 typedef pthread_t       THREAD;
 typedef pthread_mutex_t MUTEX;
@@ -38,25 +43,27 @@ typedef pthread_cond_t  COND;
 
 typedef struct A52GlobalThreadSync
 {
-    int current_thread_num;
-    int threads_to_abort;
-    int threads_running;
-    volatile int samples_thread_num;
-    MUTEX samples_mutex;
+    int flushing;
 } A52GlobalThreadSync;
 
 typedef struct A52ThreadSync
 {
     THREAD thread;
-    MUTEX enter_mutex;
-    MUTEX confirm_mutex;
-    COND  enter_cond;
-    COND  confirm_cond;
-
-    COND samples_cond;
-    COND* next_samples_cond;
 } A52ThreadSync;
 
+typedef struct A52Waiter
+{
+    MUTEX mutex;
+    COND  cond;
+    volatile int waiting;
+} A52Waiter;
+
+typedef struct A52PoolSync
+{
+    MUTEX mutex;
+    COND  cond;
+} A52PoolSync;
+
 #define thread_create(threadid, threadfunc, threadparam) \
     pthread_create(threadid, NULL, (void *(*) (void *))threadfunc, threadparam)
 #define thread_join(x)         pthread_join(x, NULL)
@@ -76,11 +83,11 @@ typedef struct A52ThreadSync
 #ifdef HAVE_GET_NPROCS
 #include <sys/sysinfo.h>
 
-static inline int
-get_ncpus()
-{
-    return get_nprocs();
-}
+/**
+ * Number of CPUs this process may use: the affinity mask of the process,
+ * limited by the CPU quota of its cgroup (v1 or v2)
+ */
+extern int get_ncpus(void);
 #elif defined(SYS_DARWIN)
 #undef _POSIX_C_SOURCE
 #include <sys/sysctl.h>
@@ -109,26 +116,31 @@ get_ncpus()
 
 typedef HANDLE THREAD;
 typedef HANDLE EVENT;
+typedef HANDLE SEMAPHORE;
 typedef CRITICAL_SECTION CS;
 
 typedef struct A52GlobalThreadSync
 {
-    int current_thread_num;
-    int threads_to_abort;
-    int threads_running;
-    volatile int samples_thread_num;
-    CS samples_cs;
+    int flushing;
 } A52GlobalThreadSync;
 
 typedef struct A52ThreadSync
 {
     THREAD thread;
-    EVENT ready_event;
-    EVENT enter_event;
-    EVENT samples_event;
-    EVENT* next_samples_event;
 } A52ThreadSync;
 
+typedef struct A52Waiter
+{
+    SEMAPHORE sem;
+    volatile int waiting;
+} A52Waiter;
+
+typedef struct A52PoolSync
+{
+    CS cs;
+    SEMAPHORE sem;
+} A52PoolSync;
+
 static inline void
 thread_create(HANDLE *thread, int (*threadfunc)(void*), LPVOID threadparam)
 {
@@ -174,6 +186,36 @@ windows_event_wait(EVENT *event)
     WaitForSingleObject(*event, INFINITE);
 }
 
+static inline void
+windows_sem_init(SEMAPHORE *sem)
+{
+    *sem = CreateSemaphore(NULL, 0, 0x7FFFFFFF, NULL);
+}
+
+static inline void
+windows_sem_destroy(SEMAPHORE *sem)
+{
+    CloseHandle(*sem);
+}
+
+static inline void
+windows_sem_post(SEMAPHORE *sem)
+{
+    ReleaseSemaphore(*sem, 1, NULL);
+}
+
+static inline void
+windows_sem_post_count(SEMAPHORE *sem, int count)
+{
+    ReleaseSemaphore(*sem, count, NULL);
+}
+
+static inline void
+windows_sem_wait(SEMAPHORE *sem)
+{
+    WaitForSingleObject(*sem, INFINITE);
+}
+
 static inline void
 windows_cs_init(CS *cs)
 {
@@ -243,10 +285,214 @@ get_ncpus()
 #define windows_event_reset(x)
 #define windows_event_wait(x)
 
+#define windows_sem_init(x)
+#define windows_sem_destroy(x)
+#define windows_sem_post(x)
+#define windows_sem_post_count(x, n)
+#define windows_sem_wait(x)
+
 #define windows_cs_init(x)
 #define windows_cs_destroy(x)
 #define windows_cs_enter(x)
 #define windows_cs_leave(x)
 #endif /* HAVE_WINDOWS_THREADS */
 
+#ifndef NO_THREADS
+#if defined(__GNUC__)
+#define thread_load_acquire(x)      __atomic_load_n(x, __ATOMIC_ACQUIRE)
+#define thread_store_release(x, v)  __atomic_store_n(x, v, __ATOMIC_RELEASE)
+#define thread_memory_barrier()     __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define thread_fetch_add(x, v)      __atomic_fetch_add(x, v, __ATOMIC_ACQ_REL)
+#define thread_compare_and_swap(x, old_val, new_val) \
+    __sync_bool_compare_and_swap(x, old_val, new_val)
+#elif defined(_MSC_VER)
+/* volatile accesses have acquire/release semantics with MSVC */
+#define thread_load_acquire(x)      (*(x))
+#define thread_store_release(x, v)  (*(x) = (v))
+#define thread_memory_barrier()     MemoryBarrier()
+#define thread_fetch_add(x, v) \
+    ((unsigned int)InterlockedExchangeAdd((volatile LONG *)(x), (LONG)(v)))
+#define thread_compare_and_swap(x, old_val, new_val) \
+    (InterlockedCompareExchange((volatile LONG *)(x), (LONG)(new_val), \
+                                (LONG)(old_val)) == (LONG)(old_val))
+#else
+#error "no memory barrier implementation for this compiler"
+#endif
+
+/**
+ * Bounded queue of frame jobs shared by all workers of an encoder.
+ * The producer (the thread calling aften_encode_frame) advances head when it
+ * submits a job and tail when it collects a finished one. Any idle worker
+ * claims the oldest unclaimed job by advancing next. Jobs finish in any
+ * order, so the jobs between tail and head are also the reorder buffer: the
+ * producer only ever waits for the one at tail. Nobody takes a lock unless
+ * it has to sleep on an empty or full queue. With a frame callback, tail is
+ * advanced by the thread which delivers the frames.
+ */
+typedef struct A52JobQueue
+{
+    volatile unsigned int head;
+    volatile unsigned int next;
+    volatile unsigned int tail;
+    unsigned int size;
+    A52Waiter producer;
+    A52Waiter consumer;
+} A52JobQueue;
+
+static inline void
+thread_waiter_init(A52Waiter *w)
+{
+    w->waiting = 0;
+    posix_mutex_init(&w->mutex);
+    posix_cond_init(&w->cond);
+    windows_sem_init(&w->sem);
+}
+
+static inline void
+thread_waiter_destroy(A52Waiter *w)
+{
+    posix_cond_destroy(&w->cond);
+    posix_mutex_destroy(&w->mutex);
+    windows_sem_destroy(&w->sem);
+}
+
+/**
+ * Sleeps as long as *counter equals value.
+ * The waiter is only armed after the fast path failed; the barrier pairs
+ * with the one in thread_wake() so that a wake-up cannot get lost. Several
+ * threads may sleep on the same waiter, each wake-up wakes one of them.
+ * Windows has no mutex here to tell which of the sleeping threads a wake-up
+ * reached, so there it wakes all of them, and the others go back to sleep.
+ */
+static inline void
+thread_wait_while_equal(A52Waiter *w, volatile unsigned int *counter,
+                        unsigned int value)
+{
+    if (thread_load_acquire(counter) != value)
+        return;
+
+    posix_mutex_lock(&w->mutex);
+    thread_fetch_add(&w->waiting, 1);
+    thread_memory_barrier();
+    while (thread_load_acquire(counter) == value) {
+        posix_cond_wait(&w->cond, &w->mutex);
+        windows_sem_wait(&w->sem);
+    }
+    thread_fetch_add(&w->waiting, -1);
+    posix_mutex_unlock(&w->mutex);
+}
+
+static inline void
+thread_wake(A52Waiter *w)
+{
+    int waiting;
+
+    thread_memory_barrier();
+    waiting = thread_load_acquire(&w->waiting);
+    if (waiting) {
+        posix_mutex_lock(&w->mutex);
+        posix_cond_signal(&w->cond);
+        posix_mutex_unlock(&w->mutex);
+        // one count per sleeping thread. counts left over by a thread which
+        // saw the change before it slept only cause a spurious wake-up.
+        windows_sem_post_count(&w->sem, waiting);
+    }
+}
+
+static inline void
+job_queue_init(A52JobQueue *queue, unsigned int size)
+{
+    queue->head = queue->next = queue->tail = 0;
+    queue->size = size;
+    thread_waiter_init(&queue->producer);
+    thread_waiter_init(&queue->consumer);
+}
+
+static inline void
+job_queue_destroy(A52JobQueue *queue)
+{
+    thread_waiter_destroy(&queue->producer);
+    thread_waiter_destroy(&queue->consumer);
+}
+
+/**
+ * Descriptor which becomes readable once a frame has been encoded, to be
+ * used with poll() or select(). It is an eventfd where available and a pipe
+ * otherwise; fd[0] is the end to read from, fd[1] the end to write to.
+ * There is none with Windows threads, fd[0] then is -1.
+ */
+static inline int
+thread_notify_init(int fd[2])
+{
+#if defined(HAVE_SYS_EVENTFD_H)
+    fd[0] = fd[1] = eventfd(0, EFD_NONBLOCK);
+    return (fd[0] < 0) ? -1 : 0;
+#elif defined(HAVE_POSIX_THREADS)
+    if (pipe(fd)) {
+        fd[0] = fd[1] = -1;
+        return -1;
+    }
+    fcntl(fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(fd[1], F_SETFL, O_NONBLOCK);
+    return 0;
+#else
+    fd[0] = fd[1] = -1;
+    return 0;
+#endif
+}
+
+static inline void
+thread_notify_close(int fd[2])
+{
+#ifdef HAVE_POSIX_THREADS
+    if (fd[1] != fd[0])
+        close(fd[1]);
+    close(fd[0]);
+#endif
+    fd[0] = fd[1] = -1;
+}
+
+static inline void
+thread_notify_post(int fd[2])
+{
+#ifdef HAVE_POSIX_THREADS
+    // a full pipe or a saturated counter is readable anyway
+#ifdef HAVE_SYS_EVENTFD_H
+    uint64_t one = 1;
+    ssize_t ret = write(fd[1], &one, sizeof(one));
+#else
+    char one = 1;
+    ssize_t ret = write(fd[1], &one, 1);
+#endif
+    (void)ret;
+#endif
+}
+
+static inline void
+thread_notify_clear(int fd[2])
+{
+#ifdef HAVE_POSIX_THREADS
+    uint64_t buf[8];
+    while (read(fd[0], buf, sizeof(buf)) > 0)
+        ;
+#endif
+}
+
+/** upper bound on the CPUs considered when planning thread placement */
+#define CPU_PLACES_MAX 1024
+
+/**
+ * Fills cpus[0..n-1] with the CPU each of n worker threads should run on
+ * under the given AftenPinPolicy, or -1 where a thread stays unpinned.
+ */
+extern void thread_plan_cpus(int policy, const int *list, int n_list,
+                             int *cpus, int n);
+
+/** Pins the calling thread to one CPU. Negative values are ignored. */
+extern void thread_pin_cpu(int cpu);
+#else /* NO_THREADS */
+#define thread_load_acquire(x)      (*(x))
+#define thread_store_release(x, v)  (*(x) = (v))
+#endif /* NO_THREADS */
+
 #endif /* THREADING_H */
@@ -30,5 +30,6 @@
 #define _pop(x)     _st(pop x)
 #define _jz(x)      _st(jz x)
 #define _cpuid      _st(cpuid)
+#define _xgetbv     _st(xgetbv)
 
 #endif /* ASM_COMMON_H */
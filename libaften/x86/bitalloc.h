@@ -0,0 +1,42 @@
+/**
+ * Aften: A/52 audio encoder
+ *
+ * x86 bit allocation functions header
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation;
+ * version 2 of the License
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file bitalloc.h
+ * A/52 x86 bit allocation header
+ */
+
+#ifndef X86_BITALLOC_H
+#define X86_BITALLOC_H
+
+#include "common.h"
+#include "a52.h"
+
+#ifdef HAVE_SSE2
+extern void a52_bit_alloc_prepare_sse2(A52BitAllocParams *s, int n, uint8_t **exp,
+                                       int16_t **psd, int16_t **mask,
+                                       const int *fgain, int end);
+extern void a52_bit_alloc_calc_bap_sse2(int16_t *mask, int16_t *psd, int start, int end,
+                                        int snr_offset, int floor, uint8_t *bap);
+extern int compute_mantissa_size_sse2(int mant_cnt[5], uint8_t *bap, int ncoefs);
+#endif
+
+#endif /* X86_BITALLOC_H */
@@ -0,0 +1,332 @@
+/**
+ * Aften: A/52 audio encoder
+ *
+ * SSE2 bit allocation functions
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation;
+ * version 2 of the License
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file bitalloc_sse2.c
+ * A/52 sse2 optimized bit allocation functions
+ */
+
+#include "a52enc.h"
+#include "x86/simd_support.h"
+
+/** Transposes 8 rows of 8 16-bit values */
+static inline void
+transpose8x8_epi16(__m128i r[8])
+{
+    __m128i t[8], u[8];
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        t[2*i  ] = _mm_unpacklo_epi16(r[2*i], r[2*i+1]);
+        t[2*i+1] = _mm_unpackhi_epi16(r[2*i], r[2*i+1]);
+    }
+    for (i = 0; i < 2; i++) {
+        u[4*i  ] = _mm_unpacklo_epi32(t[4*i  ], t[4*i+2]);
+        u[4*i+1] = _mm_unpackhi_epi32(t[4*i  ], t[4*i+2]);
+        u[4*i+2] = _mm_unpacklo_epi32(t[4*i+1], t[4*i+3]);
+        u[4*i+3] = _mm_unpackhi_epi32(t[4*i+1], t[4*i+3]);
+    }
+    for (i = 0; i < 4; i++) {
+        r[2*i  ] = _mm_unpacklo_epi64(u[i], u[i+4]);
+        r[2*i+1] = _mm_unpackhi_epi64(u[i], u[i+4]);
+    }
+}
+
+/** Selects a where mask is set and b elsewhere */
+static inline __m128i
+select_si128(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+/** calc_lowcomp1() of a52.c for 8 lanes */
+static inline __m128i
+calc_lowcomp1_sse2(__m128i a, __m128i b0, __m128i b1, __m128i c)
+{
+    __m128i dec = _mm_max_epi16(_mm_sub_epi16(a, _mm_set1_epi16(64)),
+                                _mm_setzero_si128());
+    a = select_si128(_mm_cmpgt_epi16(b0, b1), dec, a);
+    return select_si128(_mm_cmpeq_epi16(_mm_add_epi16(b0, _mm_set1_epi16(256)), b1), c, a);
+}
+
+/**
+ * Runs a52_bit_alloc_calc_psd() and a52_bit_alloc_calc_mask() for up to 8
+ * channel/block pairs, one pair in each 16-bit lane. Along frequency both
+ * steps are recursive, but all pairs share the band layout, so the psd is
+ * transposed to hold one bin of every pair in a vector. SSE2 has no gather,
+ * so the log-add table is read one lane at a time.
+ */
+void
+a52_bit_alloc_prepare_sse2(A52BitAllocParams *s, int n, uint8_t **exp,
+                           int16_t **psd, int16_t **mask, const int *fgain,
+                           int end)
+{
+    ALIGN16(int16_t) psd_t[256][8];
+    ALIGN16(int16_t) band_psd[56][8];
+    ALIGN16(int16_t) excite[56][8];
+    ALIGN16(int16_t) tmp[8];
+    int16_t *rows[8];
+    __m128i r[8];
+    __m128i vzero = _mm_setzero_si128();
+    __m128i v3072 = _mm_set1_epi16(3072);
+    __m128i v255 = _mm_set1_epi16(255);
+    __m128i vfgain, vsgain, vfdecay, vsdecay, vdbknee;
+    __m128i lowcomp, fastleak, slowleak, active;
+    int bin, band, n_bands, end1, i;
+
+    // exponent mapping to PSD
+    for (i = 0; i < n; i++) {
+        for (bin = 0; bin < end; bin += 8) {
+            __m128i e = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)&exp[i][bin]), vzero);
+            _mm_storeu_si128((__m128i*)&psd[i][bin], _mm_sub_epi16(v3072, _mm_slli_epi16(e, 7)));
+        }
+        rows[i] = psd[i];
+    }
+    // unused lanes repeat the first pair
+    for (; i < 8; i++)
+        rows[i] = psd[0];
+    for (bin = 0; bin < end; bin += 8) {
+        for (i = 0; i < 8; i++)
+            r[i] = _mm_loadu_si128((__m128i*)&rows[i][bin]);
+        transpose8x8_epi16(r);
+        for (i = 0; i < 8; i++)
+            _mm_store_si128((__m128i*)psd_t[bin+i], r[i]);
+    }
+
+    // PSD integration
+    for (bin = 0, band = 0; bin < end; band++) {
+        int band_end = MIN(bin + a52_critical_band_size_tab[band], end);
+        __m128i v = _mm_load_si128((__m128i*)psd_t[bin++]);
+        for (; bin < band_end; bin++) {
+            // logadd
+            __m128i p = _mm_load_si128((__m128i*)psd_t[bin]);
+            __m128i hi = _mm_max_epi16(v, p);
+            __m128i d = _mm_sub_epi16(hi, _mm_min_epi16(v, p));
+            __m128i a = _mm_min_epi16(_mm_srli_epi16(d, 1), v255);
+            __m128i add = vzero;
+            add = _mm_insert_epi16(add, a52_log_add_tab[_mm_extract_epi16(a, 0)], 0);
+            add = _mm_insert_epi16(add, a52_log_add_tab[_mm_extract_epi16(a, 1)], 1);
+            add = _mm_insert_epi16(add, a52_log_add_tab[_mm_extract_epi16(a, 2)], 2);
+            add = _mm_insert_epi16(add, a52_log_add_tab[_mm_extract_epi16(a, 3)], 3);
+            add = _mm_insert_epi16(add, a52_log_add_tab[_mm_extract_epi16(a, 4)], 4);
+            add = _mm_insert_epi16(add, a52_log_add_tab[_mm_extract_epi16(a, 5)], 5);
+            add = _mm_insert_epi16(add, a52_log_add_tab[_mm_extract_epi16(a, 6)], 6);
+            add = _mm_insert_epi16(add, a52_log_add_tab[_mm_extract_epi16(a, 7)], 7);
+            v = _mm_add_epi16(hi, add);
+        }
+        _mm_store_si128((__m128i*)band_psd[band], v);
+    }
+    n_bands = band;
+
+    // excitation function
+    for (i = 0; i < 8; i++)
+        tmp[i] = fgain[i < n ? i : 0];
+    vfgain = _mm_load_si128((__m128i*)tmp);
+    vsgain = _mm_set1_epi16(s->sgain);
+    vfdecay = _mm_set1_epi16(s->fdecay);
+    vsdecay = _mm_set1_epi16(s->sdecay);
+    vdbknee = _mm_set1_epi16(s->dbknee);
+
+#define BAND_PSD(b) _mm_load_si128((__m128i*)band_psd[b])
+    lowcomp = calc_lowcomp1_sse2(vzero, BAND_PSD(0), BAND_PSD(1), _mm_set1_epi16(384));
+    _mm_store_si128((__m128i*)excite[0],
+                    _mm_sub_epi16(_mm_sub_epi16(BAND_PSD(0), vfgain), lowcomp));
+    lowcomp = calc_lowcomp1_sse2(lowcomp, BAND_PSD(1), BAND_PSD(2), _mm_set1_epi16(384));
+    _mm_store_si128((__m128i*)excite[1],
+                    _mm_sub_epi16(_mm_sub_epi16(BAND_PSD(1), vfgain), lowcomp));
+
+    // Lanes stay active until the psd stops rising. Active lanes start the
+    // leaks over at every band, the others already let them decay.
+    active = _mm_cmpeq_epi16(vzero, vzero);
+    fastleak = slowleak = vzero;
+    for (band = 2; band < 7; band++) {
+        __m128i bp = BAND_PSD(band);
+        __m128i f1 = _mm_sub_epi16(bp, vfgain);
+        __m128i s1 = _mm_sub_epi16(bp, vsgain);
+        __m128i f2 = _mm_max_epi16(_mm_sub_epi16(fastleak, vfdecay), f1);
+        __m128i s2 = _mm_max_epi16(_mm_sub_epi16(slowleak, vsdecay), s1);
+        int last = (n_bands == 7 && band == 6);
+
+        if (!last)
+            lowcomp = calc_lowcomp1_sse2(lowcomp, bp, BAND_PSD(band+1), _mm_set1_epi16(384));
+        _mm_store_si128((__m128i*)excite[band],
+                        select_si128(active, _mm_sub_epi16(f1, lowcomp),
+                                     _mm_max_epi16(_mm_sub_epi16(f2, lowcomp), s2)));
+        fastleak = select_si128(active, f1, f2);
+        slowleak = select_si128(active, s1, s2);
+        if (!last)
+            active = _mm_and_si128(active, _mm_cmpgt_epi16(bp, BAND_PSD(band+1)));
+    }
+
+    end1 = MIN(n_bands, 22);
+    for (band = 7; band < end1; band++) {
+        __m128i bp = BAND_PSD(band);
+        if (band < 20)
+            lowcomp = calc_lowcomp1_sse2(lowcomp, bp, BAND_PSD(band+1), _mm_set1_epi16(320));
+        else
+            lowcomp = _mm_max_epi16(_mm_sub_epi16(lowcomp, _mm_set1_epi16(128)), vzero);
+        fastleak = _mm_max_epi16(_mm_sub_epi16(fastleak, vfdecay), _mm_sub_epi16(bp, vfgain));
+        slowleak = _mm_max_epi16(_mm_sub_epi16(slowleak, vsdecay), _mm_sub_epi16(bp, vsgain));
+        _mm_store_si128((__m128i*)excite[band],
+                        _mm_max_epi16(_mm_sub_epi16(fastleak, lowcomp), slowleak));
+    }
+    for (band = 22; band < n_bands; band++) {
+        __m128i bp = BAND_PSD(band);
+        fastleak = _mm_max_epi16(_mm_sub_epi16(fastleak, vfdecay), _mm_sub_epi16(bp, vfgain));
+        slowleak = _mm_max_epi16(_mm_sub_epi16(slowleak, vsdecay), _mm_sub_epi16(bp, vsgain));
+        _mm_store_si128((__m128i*)excite[band], _mm_max_epi16(fastleak, slowleak));
+    }
+
+    // compute masking curve
+    for (band = 0; band < n_bands; band++) {
+        __m128i knee = _mm_max_epi16(_mm_sub_epi16(vdbknee, BAND_PSD(band)), vzero);
+        __m128i e = _mm_add_epi16(_mm_load_si128((__m128i*)excite[band]),
+                                  _mm_srai_epi16(knee, 2));
+        __m128i hth = _mm_set1_epi16(a52_hearing_threshold_tab[band >> s->halfratecod][s->fscod]);
+        _mm_store_si128((__m128i*)excite[band], _mm_max_epi16(hth, e));
+    }
+#undef BAND_PSD
+
+    for (band = 0; band < n_bands; band += 8) {
+        int count = MIN(n_bands - band, 8);
+        for (i = 0; i < 8; i++)
+            r[i] = _mm_load_si128((__m128i*)excite[band+i]);
+        transpose8x8_epi16(r);
+        for (i = 0; i < n; i++) {
+            _mm_store_si128((__m128i*)tmp, r[i]);
+            memcpy(&mask[i][band], tmp, count * sizeof(int16_t));
+        }
+    }
+}
+
+/**
+ * Above address 14, a52_bap_tab steps up every 4 addresses until bap=14,
+ * which is computed as (CLIP(address, 14, 50) - 11) >> 2. Below that and at
+ * the last step, the bap goes up by one past each of these addresses.
+ */
+static const int8_t bap_steps[6] = { 0, 5, 7, 10, 12, 54 };
+
+void
+a52_bit_alloc_calc_bap_sse2(int16_t *mask, int16_t *psd, int start, int end,
+                            int snr_offset, int floor, uint8_t *bap)
+{
+    // masking level of each bin. stores of 8 may run past the end.
+    ALIGN16(int16_t) m[256+8];
+    __m128i vzero = _mm_setzero_si128();
+    __m128i vmax = _mm_set1_epi16(63);
+    __m128i vlo = _mm_set1_epi8(14);
+    __m128i vhi = _mm_set1_epi8(50);
+    __m128i vmask = _mm_set1_epi8(0x3F);
+    int bin, band, i;
+
+    // special case, if snr offset is -960, set all bap's to zero
+    if (snr_offset == -960) {
+        memset(bap, 0, 256);
+        return;
+    }
+
+    // spread the masking level of each band over its bins
+    for (bin = 0, band = 0; bin < end; band++) {
+        int band_end = bin + a52_critical_band_size_tab[band];
+        if (band_end > start) {
+            __m128i vm = _mm_set1_epi16((MAX(mask[band] - snr_offset - floor, 0) & 0x1FE0) + floor);
+            for (i = bin; i < band_end; i += 8)
+                _mm_storeu_si128((__m128i*)&m[i], vm);
+        }
+        bin = band_end;
+    }
+
+    for (bin = start; bin + 16 <= end; bin += 16) {
+        __m128i vaddr0 = _mm_sub_epi16(_mm_loadu_si128((__m128i*)&psd[bin]),
+                                       _mm_loadu_si128((__m128i*)&m[bin]));
+        __m128i vaddr1 = _mm_sub_epi16(_mm_loadu_si128((__m128i*)&psd[bin+8]),
+                                       _mm_loadu_si128((__m128i*)&m[bin+8]));
+        __m128i vaddr, vbap;
+
+        vaddr0 = _mm_min_epi16(_mm_max_epi16(_mm_srai_epi16(vaddr0, 5), vzero), vmax);
+        vaddr1 = _mm_min_epi16(_mm_max_epi16(_mm_srai_epi16(vaddr1, 5), vzero), vmax);
+        vaddr = _mm_packs_epi16(vaddr0, vaddr1);
+
+        // the addresses are below 64, so a 16-bit shift and a mask
+        // divide them by 4 bytewise
+        vbap = _mm_min_epu8(_mm_max_epu8(vaddr, vlo), vhi);
+        vbap = _mm_sub_epi8(vbap, _mm_set1_epi8(11));
+        vbap = _mm_and_si128(_mm_srli_epi16(vbap, 2), vmask);
+        // each compare adds -1 where the address is past the step
+        for (i = 0; i < 6; i++)
+            vbap = _mm_sub_epi8(vbap, _mm_cmpgt_epi8(vaddr, _mm_set1_epi8(bap_steps[i])));
+        _mm_storeu_si128((__m128i*)&bap[bin], vbap);
+    }
+    for (; bin < end; bin++) {
+        int address = CLIP((psd[bin] - m[bin]) >> 5, 0, 63);
+        bap[bin] = a52_bap_tab[address];
+    }
+}
+
+int
+compute_mantissa_size_sse2(int mant_cnt[5], uint8_t *bap, int ncoefs)
+{
+    ALIGN16(uint16_t) sum[8];
+    __m128i vzero = _mm_setzero_si128();
+    __m128i vfour = _mm_set1_epi8(4);
+    __m128i vbits = vzero;
+    __m128i vcnt[4];
+    int bits, b, i;
+
+    for (b = 0; b < 4; b++)
+        vcnt[b] = vzero;
+
+    // at most 16 passes, so the per-byte counts cannot overflow
+    for (i = 0; i + 16 <= ncoefs; i += 16) {
+        __m128i vbap = _mm_loadu_si128((__m128i*)&bap[i]);
+        __m128i vlarge = _mm_cmpgt_epi8(vbap, vfour);
+        __m128i vb;
+
+        // bap=1 to bap=4 will be counted in compute_mantissa_size_final
+        for (b = 0; b < 4; b++)
+            vcnt[b] = _mm_sub_epi8(vcnt[b], _mm_cmpeq_epi8(vbap, _mm_set1_epi8(b+1)));
+
+        // bap=5 to bap=13 use (bap-1) bits,
+        // bap=14 uses 14 bits and bap=15 uses 16 bits
+        vb = _mm_and_si128(vlarge, _mm_sub_epi8(vbap, _mm_set1_epi8(1)));
+        vb = _mm_sub_epi8(vb, _mm_cmpgt_epi8(vbap, _mm_set1_epi8(13)));
+        vb = _mm_sub_epi8(vb, _mm_cmpgt_epi8(vbap, _mm_set1_epi8(14)));
+        vbits = _mm_add_epi64(vbits, _mm_sad_epu8(vb, vzero));
+    }
+
+    _mm_store_si128((__m128i*)sum, vbits);
+    bits = sum[0] + sum[4];
+    for (b = 0; b < 4; b++) {
+        _mm_store_si128((__m128i*)sum, _mm_sad_epu8(vcnt[b], vzero));
+        mant_cnt[b+1] += sum[0] + sum[4];
+    }
+
+    for (; i < ncoefs; i++) {
+        b = bap[i];
+        if (b <= 4)
+            ++mant_cnt[b];
+        else if (b <= 13)
+            bits += b-1;
+        else
+            bits += 14 + ((b-14)<<1);
+    }
+    return bits;
+}
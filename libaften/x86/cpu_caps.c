@@ -31,6 +31,9 @@
 /* caps2 */
 #define SSE3_BIT             0
 #define SSSE3_BIT            9
+#define FMA_BIT             12
+#define OSXSAVE_BIT         27
+#define AVX_BIT             28
 
 /* caps3 */
 #define AMD_3DNOW_BIT       31
@@ -38,6 +41,12 @@
 #define AMD_SSE_MMX_BIT     22
 #define CYRIX_MMXEXT_BIT    24
 
+/* caps4 */
+#define AVX2_BIT             5
+
+/* XCR0 bits of the SSE and AVX register state */
+#define XCR0_SSE_AVX        0x6
+
 
 #ifdef HAVE_CPU_CAPS_DETECTION
 #if defined(_WIN64) && defined(_MSC_VER)
@@ -52,6 +61,21 @@ static void cpu_caps_detect_x86(uint32_t *caps1, uint32_t *caps2, uint32_t *caps
 	__cpuid(registers, 0x80000001);
 	*caps3 = registers[3];
 }
+
+static void cpu_caps_cpuid_x86(uint32_t leaf, uint32_t *regs)
+{
+	int registers[4];
+	__cpuidex(registers, leaf, 0);
+	regs[0] = registers[0];
+	regs[1] = registers[1];
+	regs[2] = registers[2];
+	regs[3] = registers[3];
+}
+
+static uint32_t cpu_caps_xgetbv_x86(void)
+{
+	return (uint32_t)_xgetbv(0);
+}
 #else
 #include "asm_support.h"
 
@@ -101,12 +125,79 @@ static void cpu_caps_detect_x86(uint32_t *caps1, uint32_t *caps2, uint32_t *caps
     *caps2 = c2;
     *caps3 = c3;
 }
+
+// runs CPUID for the given leaf with sub-leaf 0, returns eax, ebx, ecx, edx
+static void cpu_caps_cpuid_x86(uint32_t leaf, uint32_t *regs)
+{
+    uint32_t c1, c2, c3, c4;
+
+#if __GNUC__
+#define param4      %3
+#define param5      %4
+
+    asm volatile (
+#else
+#define param4 c4
+#define param5 leaf
+
+  __asm {
 #endif
+        _mov(_b, _s)
+
+        _mov(param5, _eax)
+        _xor(_ecx, _ecx)
+        _cpuid
+        _mov(_eax, param1)
+        _mov(_ebx, param2)
+        _mov(_ecx, param3)
+        _mov(_edx, param4)
+
+        _mov(_s, _b)
+#if __GNUC__
+        :"=m"(c1), "=m"(c2), "=m"(c3), "=m"(c4) /* output */
+        :"m"(leaf)                              /* input */
+        :"%eax", "%ecx", "%edx", "%esi"         /* clobbered registers */
+    );
+#else
+ }
 #endif
 
-static struct x86cpu_caps_s x86cpu_caps_compile = { 0, 0, 0, 0, 0, 0, 0, 0, 0};
-static struct x86cpu_caps_s x86cpu_caps_detect = { 1, 1, 1, 1, 1, 1, 1, 1, 1};
-struct x86cpu_caps_s x86cpu_caps_use = { 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    regs[0] = c1;
+    regs[1] = c2;
+    regs[2] = c3;
+    regs[3] = c4;
+}
+
+// reads XCR0, which tells the register state saved by the OS
+static uint32_t cpu_caps_xgetbv_x86(void)
+{
+    uint32_t c1;
+
+#if __GNUC__
+    asm volatile (
+#else
+  __asm {
+#endif
+        _xor(_ecx, _ecx)
+        _xgetbv
+        _mov(_eax, param1)
+#if __GNUC__
+        :"=m"(c1)                       /* output */
+        :                               /* input */
+        :"%eax", "%ecx", "%edx"         /* clobbered registers */
+    );
+#else
+ }
+#endif
+
+    return c1;
+}
+#endif
+#endif
+
+static struct x86cpu_caps_s x86cpu_caps_compile = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+static struct x86cpu_caps_s x86cpu_caps_detect = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1};
+struct x86cpu_caps_s x86cpu_caps_use = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 
 void cpu_caps_detect(void)
 {
@@ -126,6 +217,12 @@ void cpu_caps_detect(void)
 #ifdef HAVE_SSSE3
     x86cpu_caps_compile.ssse3 = 1;
 #endif
+#ifdef HAVE_AVX2
+    x86cpu_caps_compile.avx2 = 1;
+#endif
+#ifdef HAVE_FMA
+    x86cpu_caps_compile.fma = 1;
+#endif
 #ifdef HAVE_3DNOW
     x86cpu_caps_compile.amd_3dnow = 1;
 #endif
@@ -140,10 +237,18 @@ void cpu_caps_detect(void)
     /* runtime detection */
 #ifdef HAVE_CPU_CAPS_DETECTION
     {
-        uint32_t caps1, caps2, caps3;
+        uint32_t caps1, caps2, caps3, caps4;
+        uint32_t regs[4];
 
         cpu_caps_detect_x86(&caps1, &caps2, &caps3);
 
+        caps4 = 0;
+        cpu_caps_cpuid_x86(0, regs);
+        if (regs[0] >= 7) {
+            cpu_caps_cpuid_x86(7, regs);
+            caps4 = regs[1];
+        }
+
         x86cpu_caps_detect.mmx          = (caps1 >> MMX_BIT) & 1;
         x86cpu_caps_detect.sse          = (caps1 >> SSE_BIT) & 1;
         x86cpu_caps_detect.sse2         = (caps1 >> SSE2_BIT) & 1;
@@ -151,6 +256,15 @@ void cpu_caps_detect(void)
         x86cpu_caps_detect.sse3         = (caps2 >> SSE3_BIT) & 1;
         x86cpu_caps_detect.ssse3        = (caps2 >> SSSE3_BIT) & 1;
 
+        // AVX registers can only be used if the OS saves them
+        x86cpu_caps_detect.avx2 = 0;
+        x86cpu_caps_detect.fma  = 0;
+        if (((caps2 >> OSXSAVE_BIT) & 1) && ((caps2 >> AVX_BIT) & 1) &&
+                (cpu_caps_xgetbv_x86() & XCR0_SSE_AVX) == XCR0_SSE_AVX) {
+            x86cpu_caps_detect.avx2     = (caps4 >> AVX2_BIT) & 1;
+            x86cpu_caps_detect.fma      = (caps2 >> FMA_BIT) & 1;
+        }
+
         x86cpu_caps_detect.amd_3dnow    = (caps3 >> AMD_3DNOW_BIT) & 1;
         x86cpu_caps_detect.amd_3dnowext = (caps3 >> AMD_3DNOWEXT_BIT) & 1;
         x86cpu_caps_detect.amd_sse_mmx  = (caps3 >> AMD_SSE_MMX_BIT) & 1;
@@ -167,6 +281,8 @@ void cpu_caps_detect(void)
     x86cpu_caps_use.sse2         = x86cpu_caps_detect.sse2         & x86cpu_caps_compile.sse2;
     x86cpu_caps_use.sse3         = x86cpu_caps_detect.sse3         & x86cpu_caps_compile.sse3;
     x86cpu_caps_use.ssse3        = x86cpu_caps_detect.ssse3        & x86cpu_caps_compile.ssse3;
+    x86cpu_caps_use.avx2         = x86cpu_caps_detect.avx2         & x86cpu_caps_compile.avx2;
+    x86cpu_caps_use.fma          = x86cpu_caps_detect.fma          & x86cpu_caps_compile.fma;
     x86cpu_caps_use.amd_3dnow    = x86cpu_caps_detect.amd_3dnow    & x86cpu_caps_compile.amd_3dnow;
     x86cpu_caps_use.amd_3dnowext = x86cpu_caps_detect.amd_3dnowext & x86cpu_caps_compile.amd_3dnowext;
     x86cpu_caps_use.amd_sse_mmx  = x86cpu_caps_detect.amd_sse_mmx  & x86cpu_caps_compile.amd_sse_mmx;
@@ -179,6 +295,8 @@ void apply_simd_restrictions(AftenSimdInstructions *simd_instructions)
     x86cpu_caps_use.sse2         &= simd_instructions->sse2;
     x86cpu_caps_use.sse3         &= simd_instructions->sse3;
     x86cpu_caps_use.ssse3        &= simd_instructions->ssse3;
+    x86cpu_caps_use.avx2         &= simd_instructions->avx2;
+    x86cpu_caps_use.fma          &= simd_instructions->fma;
     x86cpu_caps_use.amd_3dnow    &= simd_instructions->amd_3dnow;
     x86cpu_caps_use.amd_3dnowext &= simd_instructions->amd_3dnowext;
     x86cpu_caps_use.amd_sse_mmx  &= simd_instructions->amd_sse_mmx;
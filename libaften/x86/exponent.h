@@ -34,10 +34,17 @@
 
 #include "common.h"
 
+#ifdef HAVE_AVX2
+extern void exponent_min_avx2(uint8_t *expTarget, uint8_t *exp, uint8_t *exp1, int n);
+extern void encode_exp_blk_ch_avx2(uint8_t *exp, int ncoefs, int exp_strategy);
+extern int exponent_sum_square_error_avx2(uint8_t *exp0, uint8_t *exp1, int ncoefs);
+extern void extract_exponents_avx2(uint8_t *exp, FLOAT *coef);
+#endif
 #ifdef HAVE_SSE2
 extern void exponent_min_sse2(uint8_t *expTarget, uint8_t *exp, uint8_t *exp1, int n);
 extern void encode_exp_blk_ch_sse2(uint8_t *exp, int ncoefs, int exp_strategy);
 extern int exponent_sum_square_error_sse2(uint8_t *exp0, uint8_t *exp1, int ncoefs);
+extern void extract_exponents_sse2(uint8_t *exp, FLOAT *coef);
 #endif
 #ifdef HAVE_MMX
 extern void exponent_min_mmx(uint8_t *expTarget, uint8_t *exp, uint8_t *exp1, int n);
@@ -0,0 +1,294 @@
+/**
+ * Aften: A/52 audio encoder
+ *
+ * AVX2 exponent functions
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation;
+ * version 2 of the License
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file exponent_avx2.c
+ * A/52 avx2 optimized exponent functions
+ */
+
+#include "a52enc.h"
+#include "x86/simd_support.h"
+
+/* moves the bytes of v up or down by n positions across both lanes, n < 16 */
+#define SHIFT_UP(v, n)   _mm256_alignr_epi8(v, _mm256_permute2x128_si256(v, v, 0x08), 16-(n))
+#define SHIFT_DOWN(v, n) _mm256_alignr_epi8(_mm256_permute2x128_si256(v, v, 0x81), v, n)
+
+/* maximum of each byte and all bytes below it */
+static inline __m256i
+running_max_up(__m256i v)
+{
+    v = _mm256_max_epu8(v, SHIFT_UP(v, 1));
+    v = _mm256_max_epu8(v, SHIFT_UP(v, 2));
+    v = _mm256_max_epu8(v, SHIFT_UP(v, 4));
+    v = _mm256_max_epu8(v, SHIFT_UP(v, 8));
+    return _mm256_max_epu8(v, _mm256_permute2x128_si256(v, v, 0x08));
+}
+
+/* maximum of each byte and all bytes above it */
+static inline __m256i
+running_max_down(__m256i v)
+{
+    v = _mm256_max_epu8(v, SHIFT_DOWN(v, 1));
+    v = _mm256_max_epu8(v, SHIFT_DOWN(v, 2));
+    v = _mm256_max_epu8(v, SHIFT_DOWN(v, 4));
+    v = _mm256_max_epu8(v, SHIFT_DOWN(v, 8));
+    return _mm256_max_epu8(v, _mm256_permute2x128_si256(v, v, 0x81));
+}
+
+/**
+ * Limits the difference between neighbouring exponents g[0] to g[n-1] to 2,
+ * with the same result as the two passes
+ *     g[i] = MIN(g[i], g[i-1]+2)    for i = 1 to n-1
+ *     g[i] = MIN(g[i], g[i+1]+2)    for i = n-2 down to 0
+ * The first pass gives g[i] = MIN(g[j] + 2*(i-j)) over all j <= i. For each
+ * vector of 32 exponents starting at b, this is 25 + 2*(i-b) minus the
+ * running maximum of 25 + 2*(j-b) - g[j], which fits in a byte since the
+ * exponents are at most 24. The maximum of the vector below, less 64, is
+ * carried into the next one. The second pass runs the same way downwards.
+ * g has to hold a whole number of vectors.
+ */
+static void
+limit_exp_deltas(uint8_t *g, int n)
+{
+    const __m256i vup = _mm256_setr_epi8(
+        25, 27, 29, 31, 33, 35, 37, 39, 41, 43, 45, 47, 49, 51, 53, 55,
+        57, 59, 61, 63, 65, 67, 69, 71, 73, 75, 77, 79, 81, 83, 85, 87);
+    const __m256i vdown = _mm256_setr_epi8(
+        87, 85, 83, 81, 79, 77, 75, 73, 71, 69, 67, 65, 63, 61, 59, 57,
+        55, 53, 51, 49, 47, 45, 43, 41, 39, 37, 35, 33, 31, 29, 27, 25);
+    const __m256i vindex = _mm256_setr_epi8(
+         0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+        16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31);
+    const __m256i v64 = _mm256_set1_epi8(64);
+    __m256i carry;
+    int nvec, i;
+
+    nvec = (n + 31) >> 5;
+
+    // exponents above n-1 only change exponents above them
+    carry = _mm256_setzero_si256();
+    for (i = 0; i < nvec; i++) {
+        __m256i w = _mm256_sub_epi8(vup, _mm256_loadu_si256((__m256i*)&g[i*32]));
+        w = _mm256_max_epu8(running_max_up(w), carry);
+        _mm256_storeu_si256((__m256i*)&g[i*32], _mm256_sub_epi8(vup, w));
+        // byte 31 to all bytes
+        carry = _mm256_shuffle_epi8(_mm256_permute4x64_epi64(w, 0xFF),
+                                    _mm256_set1_epi8(15));
+        carry = _mm256_subs_epu8(carry, v64);
+    }
+
+    // exponents above n-1 must not count going down
+    carry = _mm256_setzero_si256();
+    for (i = nvec-1; i >= 0; i--) {
+        __m256i w = _mm256_sub_epi8(vdown, _mm256_loadu_si256((__m256i*)&g[i*32]));
+        if (i*32 + 32 > n)
+            w = _mm256_and_si256(w, _mm256_cmpgt_epi8(_mm256_set1_epi8(n - i*32), vindex));
+        w = _mm256_max_epu8(running_max_down(w), carry);
+        _mm256_storeu_si256((__m256i*)&g[i*32], _mm256_sub_epi8(vdown, w));
+        carry = _mm256_broadcastb_epi8(_mm256_castsi256_si128(w));
+        carry = _mm256_subs_epu8(carry, v64);
+    }
+}
+
+void
+exponent_min_avx2(uint8_t *expTarget, uint8_t *exp, uint8_t *exp1, int n)
+{
+    int i;
+
+    for (i = 0; i < (n & ~31); i += 32) {
+        __m256i vexp = _mm256_loadu_si256((__m256i*)&exp[i]);
+        __m256i vexp1 = _mm256_loadu_si256((__m256i*)&exp1[i]);
+        _mm256_storeu_si256((__m256i*)&expTarget[i], _mm256_min_epu8(vexp, vexp1));
+    }
+    if (i + 16 <= n) {
+        __m128i vexp = _mm_loadu_si128((__m128i*)&exp[i]);
+        __m128i vexp1 = _mm_loadu_si128((__m128i*)&exp1[i]);
+        _mm_storeu_si128((__m128i*)&expTarget[i], _mm_min_epu8(vexp, vexp1));
+        i += 16;
+    }
+    for (; i < n; ++i)
+        expTarget[i] = MIN(exp[i], exp1[i]);
+}
+
+void
+encode_exp_blk_ch_avx2(uint8_t *exp, int ncoefs, int exp_strategy)
+{
+    // copy with room for whole vectors past the last group
+    ALIGN16(uint8_t) e[256+128];
+    ALIGN16(uint8_t) g[256+32];
+    int ngrps, i, j;
+
+    ngrps = nexpgrptab[exp_strategy-1][ncoefs] * 3;
+
+    memcpy(e, exp, 256);
+    memset(&e[256], 0, 128);
+
+    // constraint for DC exponent
+    e[0] = MIN(e[0], 15);
+
+    // for D15 strategy, there is no need to group/ungroup exponents
+    if (exp_strategy == EXP_D15) {
+        limit_exp_deltas(e, ngrps+1);
+        memcpy(exp, e, ngrps+1);
+        return;
+    }
+
+    // for each group, compute the minimum exponent, 32 groups at a time
+    memset(g, 0, 256);
+    g[0] = e[0];
+    if (exp_strategy == EXP_D25) {
+        const __m256i vlow = _mm256_set1_epi16(0x00FF);
+        for (i = 0; i < ngrps; i += 32) {
+            __m256i v0 = _mm256_loadu_si256((__m256i*)&e[1+2*i]);
+            __m256i v1 = _mm256_loadu_si256((__m256i*)&e[33+2*i]);
+            v0 = _mm256_and_si256(_mm256_min_epu8(v0, _mm256_srli_epi16(v0, 8)), vlow);
+            v1 = _mm256_and_si256(_mm256_min_epu8(v1, _mm256_srli_epi16(v1, 8)), vlow);
+            v0 = _mm256_permute4x64_epi64(_mm256_packus_epi16(v0, v1), 0xD8);
+            _mm256_storeu_si256((__m256i*)&g[1+i], v0);
+        }
+    } else {
+        const __m256i vlow = _mm256_set1_epi32(0xFF);
+        const __m256i vorder = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+        for (i = 0; i < ngrps; i += 32) {
+            __m256i v[4];
+            for (j = 0; j < 4; j++) {
+                v[j] = _mm256_loadu_si256((__m256i*)&e[1+4*i+32*j]);
+                v[j] = _mm256_min_epu8(v[j], _mm256_srli_epi32(v[j], 8));
+                v[j] = _mm256_min_epu8(v[j], _mm256_srli_epi32(v[j], 16));
+                v[j] = _mm256_and_si256(v[j], vlow);
+            }
+            v[0] = _mm256_packus_epi16(_mm256_packus_epi32(v[0], v[1]),
+                                       _mm256_packus_epi32(v[2], v[3]));
+            v[0] = _mm256_permutevar8x32_epi32(v[0], vorder);
+            _mm256_storeu_si256((__m256i*)&g[1+i], v[0]);
+        }
+    }
+
+    // Decrease the delta between each groups to within 2
+    // so that they can be differentially encoded
+    limit_exp_deltas(g, ngrps+1);
+    e[0] = g[0];
+
+    // expand exponent groups to generate final set of exponents
+    if (exp_strategy == EXP_D25) {
+        for (i = 0; i < ngrps; i += 16) {
+            __m256i v = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i*)&g[1+i]));
+            v = _mm256_or_si256(v, _mm256_slli_epi16(v, 8));
+            _mm256_storeu_si256((__m256i*)&e[1+2*i], v);
+        }
+        memcpy(exp, e, 2*ngrps+1);
+    } else {
+        for (i = 0; i < ngrps; i += 8) {
+            __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)&g[1+i]));
+            v = _mm256_or_si256(v, _mm256_slli_epi32(v, 8));
+            v = _mm256_or_si256(v, _mm256_slli_epi32(v, 16));
+            _mm256_storeu_si256((__m256i*)&e[1+4*i], v);
+        }
+        memcpy(exp, e, 4*ngrps+1);
+    }
+}
+
+int
+exponent_sum_square_error_avx2(uint8_t *exp0, uint8_t *exp1, int ncoefs)
+{
+    int i, err;
+    int exp_error;
+    __m256i vones = _mm256_set1_epi16(1);
+    __m256i vres = _mm256_setzero_si256();
+    __m128i vsum;
+
+    // differences are small enough for the squares of two of them to be
+    // summed in 16 bits
+    for (i = 0; i < (ncoefs & ~31); i += 32) {
+        __m256i vexp = _mm256_loadu_si256((__m256i*)&exp0[i]);
+        __m256i vexp1 = _mm256_loadu_si256((__m256i*)&exp1[i]);
+        __m256i verr = _mm256_abs_epi8(_mm256_sub_epi8(vexp, vexp1));
+        verr = _mm256_maddubs_epi16(verr, verr);
+        vres = _mm256_add_epi32(vres, _mm256_madd_epi16(verr, vones));
+    }
+    vsum = _mm_add_epi32(_mm256_castsi256_si128(vres),
+                         _mm256_extracti128_si256(vres, 1));
+    if (i + 16 <= ncoefs) {
+        __m128i vexp = _mm_loadu_si128((__m128i*)&exp0[i]);
+        __m128i vexp1 = _mm_loadu_si128((__m128i*)&exp1[i]);
+        __m128i verr = _mm_abs_epi8(_mm_sub_epi8(vexp, vexp1));
+        verr = _mm_maddubs_epi16(verr, verr);
+        vsum = _mm_add_epi32(vsum, _mm_madd_epi16(verr, _mm256_castsi256_si128(vones)));
+        i += 16;
+    }
+    vsum = _mm_add_epi32(vsum, _mm_shuffle_epi32(vsum, 0x4E));
+    vsum = _mm_add_epi32(vsum, _mm_shuffle_epi32(vsum, 0xB1));
+    exp_error = _mm_cvtsi128_si32(vsum);
+
+    for (; i < ncoefs; ++i) {
+        err = exp0[i] - exp1[i];
+        exp_error += (err * err);
+    }
+    return exp_error;
+}
+
+/**
+ * Returns 23 - log2i(|c| * 2^24) for 8 MDCT coefficients c, read from the
+ * exponent field of their IEEE-754 representation. With a biased exponent E
+ * this is 126 - E for floats and 1022 - E for doubles.
+ */
+static inline __m256i
+coef_exponents_avx2(FLOAT *coef)
+{
+#ifndef CONFIG_DOUBLE
+    __m256i v = _mm256_loadu_si256((__m256i*)coef);
+    v = _mm256_srli_epi32(_mm256_slli_epi32(v, 1), 24);
+    return _mm256_sub_epi32(_mm256_set1_epi32(126), v);
+#else
+    __m256i v1 = _mm256_loadu_si256((__m256i*)coef);
+    __m256i v2 = _mm256_loadu_si256((__m256i*)(coef+4));
+    v1 = _mm256_srli_epi64(_mm256_slli_epi64(v1, 1), 53);
+    v2 = _mm256_srli_epi64(_mm256_slli_epi64(v2, 1), 53);
+    // gather the low halves of the 64-bit lanes
+    v1 = _mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(v1),
+                                               _mm256_castsi256_ps(v2), 0x88));
+    v1 = _mm256_permute4x64_epi64(v1, 0xD8);
+    return _mm256_sub_epi32(_mm256_set1_epi32(1022), v1);
+#endif
+}
+
+void
+extract_exponents_avx2(uint8_t *exp, FLOAT *coef)
+{
+    const __m256i v24 = _mm256_set1_epi16(24);
+    const __m256i vff = _mm256_set1_epi16(0xff);
+    const __m256i vorder = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int i;
+
+    for (i = 0; i < 256; i += 32) {
+        __m256i e0 = _mm256_packs_epi32(coef_exponents_avx2(&coef[i   ]),
+                                        coef_exponents_avx2(&coef[i+ 8]));
+        __m256i e1 = _mm256_packs_epi32(coef_exponents_avx2(&coef[i+16]),
+                                        coef_exponents_avx2(&coef[i+24]));
+        // anything below 2^-24, zero included, gets 24. coefficients of 1.0
+        // and more wrap around like they do in the C version.
+        e0 = _mm256_and_si256(_mm256_min_epi16(e0, v24), vff);
+        e1 = _mm256_and_si256(_mm256_min_epi16(e1, v24), vff);
+        // the packs work within each lane, put the 4-byte pieces back in order
+        e0 = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(e0, e1), vorder);
+        _mm256_storeu_si256((__m256i*)&exp[i], e0);
+    }
+}
@@ -311,3 +311,47 @@ exponent_sum_square_error_sse2(uint8_t *exp0, uint8_t *exp1, int ncoefs)
     }
     return exp_error;
 }
+
+/**
+ * Returns 23 - log2i(|c| * 2^24) for 4 MDCT coefficients c, read from the
+ * exponent field of their IEEE-754 representation. With a biased exponent E
+ * this is 126 - E for floats and 1022 - E for doubles.
+ */
+static inline __m128i
+coef_exponents_sse2(FLOAT *coef)
+{
+#ifndef CONFIG_DOUBLE
+    __m128i v = _mm_load_si128((__m128i*)coef);
+    v = _mm_srli_epi32(_mm_slli_epi32(v, 1), 24);
+    return _mm_sub_epi32(_mm_set1_epi32(126), v);
+#else
+    __m128i v1 = _mm_load_si128((__m128i*)coef);
+    __m128i v2 = _mm_load_si128((__m128i*)(coef+2));
+    v1 = _mm_srli_epi64(_mm_slli_epi64(v1, 1), 53);
+    v2 = _mm_srli_epi64(_mm_slli_epi64(v2, 1), 53);
+    // gather the low halves of the 64-bit lanes
+    v1 = _mm_unpacklo_epi64(_mm_shuffle_epi32(v1, 0x08),
+                            _mm_shuffle_epi32(v2, 0x08));
+    return _mm_sub_epi32(_mm_set1_epi32(1022), v1);
+#endif
+}
+
+void
+extract_exponents_sse2(uint8_t *exp, FLOAT *coef)
+{
+    const __m128i v24 = _mm_set1_epi16(24);
+    const __m128i vff = _mm_set1_epi16(0xff);
+    int i;
+
+    for (i = 0; i < 256; i += 16) {
+        __m128i e0 = _mm_packs_epi32(coef_exponents_sse2(&coef[i   ]),
+                                     coef_exponents_sse2(&coef[i+ 4]));
+        __m128i e1 = _mm_packs_epi32(coef_exponents_sse2(&coef[i+ 8]),
+                                     coef_exponents_sse2(&coef[i+12]));
+        // anything below 2^-24, zero included, gets 24. coefficients of 1.0
+        // and more wrap around like they do in the C version.
+        e0 = _mm_and_si128(_mm_min_epi16(e0, v24), vff);
+        e1 = _mm_and_si128(_mm_min_epi16(e1, v24), vff);
+        _mm_storeu_si128((__m128i*)&exp[i], _mm_packus_epi16(e0, e1));
+    }
+}
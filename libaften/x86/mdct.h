@@ -56,6 +56,10 @@ extern void mdct_init_sse(struct A52Context *ctx);
 #ifdef HAVE_SSE3
 extern void mdct_init_sse3(struct A52Context *ctx);
 #endif
+
+#if defined(HAVE_AVX2) && defined(HAVE_FMA)
+extern void mdct_init_avx2(struct A52Context *ctx);
+#endif
 #endif
 
 #endif /* X86_MDCT_H */
@@ -0,0 +1,468 @@
+/**
+ * Aften: A/52 audio encoder
+ *
+ * AVX2 MDCT functions
+ * This file is derived from libvorbis lancer patch
+ * Copyright (c) 2006-2007 prakash@punnoor.de
+ * Copyright (c) 2006, blacksword8192@hotmail.com
+ * Copyright (c) 2002, Xiph.org Foundation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * - Neither the name of the Xiph.org Foundation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file x86/mdct_avx2.c
+ * MDCT file, optimized for the AVX2 and FMA instruction sets
+ *
+ * Eight floats are handled at a time, with the twiddle factors of the SSE
+ * tables reordered so that each 256-bit load holds the factors of two
+ * consecutive SSE iterations. The buffers are only 16-byte aligned, so all
+ * 256-bit accesses are unaligned.
+ */
+
+#include "a52enc.h"
+#include "x86/simd_support.h"
+#include "mdct_common_sse.h"
+
+
+#define PERMUTE_PS(v, i) _mm256_permutevar_ps(v, i)
+#define SIGN_MASK        _mm256_set1_ps(-0.0f)
+
+/** reverses the order of the 8 floats of v */
+static inline __m256
+reverse_ps(__m256 v)
+{
+    return _mm256_permutevar8x32_ps(v, _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+}
+
+/** two 8 point butterflies, on the 8 floats of x and of y */
+static inline void
+mdct_butterfly_8x2_avx2(FLOAT *out, __m256 x, __m256 y)
+{
+    const __m256 nrrn = _mm256_castsi256_ps(_mm256_setr_epi32(
+        0, 0x80000000, 0x80000000, 0, 0, 0x80000000, 0x80000000, 0));
+    const __m256 nnrr = _mm256_castsi256_ps(_mm256_setr_epi32(
+        0x80000000, 0x80000000, 0, 0, 0x80000000, 0x80000000, 0, 0));
+    __m256 lo, hi, d, s;
+
+    lo = _mm256_permute2f128_ps(x, y, 0x20);
+    hi = _mm256_permute2f128_ps(x, y, 0x31);
+    d  = _mm256_sub_ps(hi, lo);
+    s  = _mm256_add_ps(hi, lo);
+    lo = _mm256_add_ps(_mm256_shuffle_ps(d, d, _MM_SHUFFLE(3,2,3,2)),
+                       _mm256_xor_ps(_mm256_shuffle_ps(d, d, _MM_SHUFFLE(0,1,0,1)), nrrn));
+    hi = _mm256_add_ps(_mm256_shuffle_ps(s, s, _MM_SHUFFLE(3,2,3,2)),
+                       _mm256_xor_ps(_mm256_shuffle_ps(s, s, _MM_SHUFFLE(1,0,1,0)), nnrr));
+    _mm256_storeu_ps(out  , _mm256_permute2f128_ps(lo, hi, 0x20));
+    _mm256_storeu_ps(out+8, _mm256_permute2f128_ps(lo, hi, 0x31));
+}
+
+/**
+ * 16 point butterfly on x (first half) and y (second half), followed by the
+ * two 8 point butterflies
+ */
+static inline void
+mdct_butterfly_16_avx2(FLOAT *out, __m256 x, __m256 y)
+{
+    const __m256i ia = _mm256_setr_epi32(1, 1, 3, 2, 0, 0, 2, 3);
+    const __m256i ib = _mm256_setr_epi32(0, 0, 3, 2, 1, 1, 2, 3);
+    const __m256 ca = _mm256_setr_ps( AFT_PI2_8,  AFT_PI2_8,  1.f, -1.f,
+                                     -AFT_PI2_8, -AFT_PI2_8, -1.f, -1.f);
+    const __m256 cb = _mm256_setr_ps( AFT_PI2_8, -AFT_PI2_8,  0.f,  0.f,
+                                      AFT_PI2_8, -AFT_PI2_8,  0.f,  0.f);
+    __m256 d, s;
+
+    d = _mm256_sub_ps(x, y);
+    s = _mm256_add_ps(y, x);
+    d = _mm256_fmadd_ps(PERMUTE_PS(d, ia), ca, _mm256_mul_ps(PERMUTE_PS(d, ib), cb));
+
+    mdct_butterfly_8x2_avx2(out, d, s);
+}
+
+/** 32 point butterfly */
+static void
+mdct_butterfly_32_avx2(FLOAT *x) {
+    const __m256i i0a = _mm256_setr_epi32(1, 1, 3, 3, 1, 1, 3, 2);
+    const __m256i i0b = _mm256_setr_epi32(0, 0, 2, 2, 0, 0, 3, 2);
+    const __m256i i1a = _mm256_setr_epi32(0, 1, 2, 2, 0, 0, 2, 3);
+    const __m256i i1b = _mm256_setr_epi32(1, 0, 3, 3, 1, 1, 2, 3);
+    const __m256 c0a = _mm256_setr_ps(-AFT_PI3_8, -AFT_PI1_8, -AFT_PI2_8, -AFT_PI2_8,
+                                      -AFT_PI1_8, -AFT_PI3_8,       -1.f,        1.f);
+    const __m256 c0b = _mm256_setr_ps(-AFT_PI1_8,  AFT_PI3_8, -AFT_PI2_8,  AFT_PI2_8,
+                                      -AFT_PI3_8,  AFT_PI1_8,        0.f,        0.f);
+    const __m256 c1a = _mm256_setr_ps( AFT_PI3_8,  AFT_PI3_8,  AFT_PI2_8,  AFT_PI2_8,
+                                       AFT_PI1_8,  AFT_PI3_8,        1.f,        1.f);
+    const __m256 c1b = _mm256_setr_ps(-AFT_PI1_8,  AFT_PI1_8, -AFT_PI2_8,  AFT_PI2_8,
+                                      -AFT_PI3_8,  AFT_PI1_8,        0.f,        0.f);
+    __m256 y0, y1, y2, y3, d0, d1;
+
+    y0 = _mm256_loadu_ps(x   );
+    y1 = _mm256_loadu_ps(x+ 8);
+    y2 = _mm256_loadu_ps(x+16);
+    y3 = _mm256_loadu_ps(x+24);
+    d0 = _mm256_sub_ps(y2, y0);
+    d1 = _mm256_sub_ps(y3, y1);
+    y2 = _mm256_add_ps(y2, y0);
+    y3 = _mm256_add_ps(y3, y1);
+    y0 = _mm256_fmadd_ps(PERMUTE_PS(d0, i0a), c0a, _mm256_mul_ps(PERMUTE_PS(d0, i0b), c0b));
+    y1 = _mm256_fmadd_ps(PERMUTE_PS(d1, i1a), c1a, _mm256_mul_ps(PERMUTE_PS(d1, i1b), c1b));
+
+    mdct_butterfly_16_avx2(x   , y0, y1);
+    mdct_butterfly_16_avx2(x+16, y2, y3);
+}
+
+/** N point first stage butterfly */
+static void
+mdct_butterfly_first_avx2(FLOAT *trig, FLOAT *x, int points)
+{
+    float   *X1  = x +  points - 8;
+    float   *X2  = x + (points>>1) - 8;
+
+    do {
+        __m256  Y1, Y2, D;
+        Y1       = _mm256_loadu_ps(X1);
+        Y2       = _mm256_loadu_ps(X2);
+        D        = _mm256_sub_ps(Y1, Y2);
+        _mm256_storeu_ps(X1, _mm256_add_ps(Y1, Y2));
+        D        = _mm256_fmadd_ps(_mm256_movehdup_ps(D), _mm256_loadu_ps(trig+8),
+                       _mm256_mul_ps(_mm256_moveldup_ps(D), _mm256_loadu_ps(trig)));
+        _mm256_storeu_ps(X2, D);
+        X1  -= 8;
+        X2  -= 8;
+        trig+= 16;
+    } while (X2 >= x);
+}
+
+/** N/stage point generic N stage butterfly */
+static void
+mdct_butterfly_generic_avx2(MDCTContext *mdct, FLOAT *x, int points, int trigint)
+{
+    float *T;
+    float *x1    = x +  points     - 8;
+    float *x2    = x + (points>>1) - 8;
+    switch (trigint) {
+    default :
+        T    = mdct->trig;
+        do {
+            float *T1 = T + trigint;
+            float *T2 = T + trigint*2;
+            float *T3 = T + trigint*3;
+            __m256  Y1, Y2, D, A, B;
+            Y1       = _mm256_loadu_ps(x1);
+            Y2       = _mm256_loadu_ps(x2);
+            D        = _mm256_sub_ps(Y1, Y2);
+            _mm256_storeu_ps(x1, _mm256_add_ps(Y1, Y2));
+            A        = _mm256_setr_ps(T3[1],  T3[0], T2[1],  T2[0],
+                                      T1[1],  T1[0],  T[1],   T[0]);
+            B        = _mm256_setr_ps(T3[0], -T3[1], T2[0], -T2[1],
+                                      T1[0], -T1[1],  T[0],  -T[1]);
+            D        = _mm256_fmadd_ps(_mm256_movehdup_ps(D), A,
+                           _mm256_mul_ps(_mm256_moveldup_ps(D), B));
+            _mm256_storeu_ps(x2, D);
+            T   += trigint*4;
+            x1  -= 8;
+            x2  -= 8;
+        } while (x2>=x);
+        return;
+    case  8:
+        T    = mdct->trig_butterfly_generic8;
+        break;
+    case 16:
+        T    = mdct->trig_butterfly_generic16;
+        break;
+    case 32:
+        T    = mdct->trig_butterfly_generic32;
+        break;
+    case 64:
+        T    = mdct->trig_butterfly_generic64;
+        break;
+    }
+    do {
+        __m256  Y1, Y2, D;
+        Y1       = _mm256_loadu_ps(x1);
+        Y2       = _mm256_loadu_ps(x2);
+        D        = _mm256_sub_ps(Y1, Y2);
+        _mm256_storeu_ps(x1, _mm256_add_ps(Y1, Y2));
+        D        = _mm256_fmadd_ps(_mm256_movehdup_ps(D), _mm256_loadu_ps(T),
+                       _mm256_mul_ps(_mm256_moveldup_ps(D), _mm256_loadu_ps(T+8)));
+        _mm256_storeu_ps(x2, D);
+        T   += 16;
+        x1  -= 8;
+        x2  -= 8;
+    } while (x2 >= x);
+}
+
+static void
+mdct_bitreverse_avx2(MDCTContext *mdct, FLOAT *x)
+{
+    const __m256 rnrn = _mm256_castsi256_ps(_mm256_setr_epi32(
+        0, 0x80000000, 0, 0x80000000, 0, 0x80000000, 0, 0x80000000));
+    const __m256 half = _mm256_set1_ps(0.5f);
+    int        n   = mdct->n;
+    int       *bit = mdct->bitrev;
+    float *w0      = x;
+    float *w1      = x = w0+(n>>1);
+    float *T       = mdct->trig_bitreverse;
+
+    do {
+        __m128  XMM0, XMM1;
+        __m256  A, B, S, D, R;
+        w1       -= 8;
+
+        /* A holds the pairs at bit[0], bit[2], bit[4], bit[6], B the others */
+        XMM0     = _mm_shuffle_ps(_mm_lddqu_ps(x+bit[0]), _mm_lddqu_ps(x+bit[2]), _MM_SHUFFLE(1,0,1,0));
+        XMM1     = _mm_shuffle_ps(_mm_lddqu_ps(x+bit[4]), _mm_lddqu_ps(x+bit[6]), _MM_SHUFFLE(1,0,1,0));
+        A        = _mm256_insertf128_ps(_mm256_castps128_ps256(XMM0), XMM1, 1);
+        XMM0     = _mm_shuffle_ps(_mm_lddqu_ps(x+bit[1]), _mm_lddqu_ps(x+bit[3]), _MM_SHUFFLE(1,0,1,0));
+        XMM1     = _mm_shuffle_ps(_mm_lddqu_ps(x+bit[5]), _mm_lddqu_ps(x+bit[7]), _MM_SHUFFLE(1,0,1,0));
+        B        = _mm256_insertf128_ps(_mm256_castps128_ps256(XMM0), XMM1, 1);
+
+        S        = _mm256_add_ps(_mm256_moveldup_ps(A), _mm256_moveldup_ps(B));
+        D        = _mm256_sub_ps(_mm256_movehdup_ps(A), _mm256_movehdup_ps(B));
+        A        = _mm256_permute_ps(A, _MM_SHUFFLE(2,3,0,1));
+        B        = _mm256_xor_ps(_mm256_permute_ps(B, _MM_SHUFFLE(2,3,0,1)), rnrn);
+        A        = _mm256_mul_ps(_mm256_add_ps(A, B), half);
+        S        = _mm256_fmadd_ps(S, _mm256_loadu_ps(T), _mm256_mul_ps(D, _mm256_loadu_ps(T+8)));
+
+        _mm256_storeu_ps(w0, _mm256_add_ps(A, S));
+        R        = _mm256_addsub_ps(_mm256_xor_ps(A, rnrn), S);
+        R        = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(R), _MM_SHUFFLE(0,1,2,3)));
+        _mm256_storeu_ps(w1, R);
+
+        T       += 16;
+        bit     += 8;
+        w0      += 8;
+    } while (w0 < w1);
+}
+
+static void
+mdct_butterflies_avx2(MDCTContext *mdct, FLOAT *x, int points)
+{
+    FLOAT *trig = mdct->trig_butterfly_first;
+    int stages = mdct->log2n-5;
+    int i, j;
+
+    if (--stages > 0)
+        mdct_butterfly_first_avx2(trig, x, points);
+
+    for (i = 1; --stages > 0; i++)
+        for (j = 0; j < (1<<i); j++)
+            mdct_butterfly_generic_avx2(mdct, x+(points>>i)*j, points>>i, 4<<i);
+
+    for (j = 0; j < points; j += 32)
+        mdct_butterfly_32_avx2(x+j);
+}
+
+static void
+mdct_avx2(MDCTThreadContext *tmdct, FLOAT *out, FLOAT *in)
+{
+    const __m256i swap = _mm256_setr_epi32(0, 1, 4, 5, 6, 7, 2, 3);
+    MDCTContext *mdct = tmdct->mdct;
+    int n = mdct->n;
+    int n2 = n>>1;
+    int n4 = n>>2;
+    int n8 = n>>3;
+    FLOAT *w = tmdct->buffer;
+    FLOAT *w2 = w+n2;
+    float *x0    = in+n2+n4-8;
+    float *x1    = in+n2+n4;
+    float *T     = mdct->trig_forward;
+
+    int i, j;
+
+    /* rotate; each pass stores 4 values forward from w2+i and 4 values
+       backward from w2+j+2 */
+    for (i = 0, j = n2-2; i < n8; i += 4, j -= 4) {
+        __m256  S, R;
+        S        = _mm256_add_ps(reverse_ps(_mm256_loadu_ps(x0)), _mm256_loadu_ps(x1));
+        R        = _mm256_fmsub_ps(_mm256_permute_ps(S, _MM_SHUFFLE(0,0,3,3)), _mm256_loadu_ps(T),
+                       _mm256_mul_ps(_mm256_permute_ps(S, _MM_SHUFFLE(2,2,1,1)), _mm256_loadu_ps(T+8)));
+        R        = _mm256_permutevar8x32_ps(R, swap);
+        _mm_store_ps(w2+i  , _mm256_castps256_ps128(R));
+        _mm_store_ps(w2+j-2, _mm256_extractf128_ps(R, 1));
+        x0  -= 8;
+        x1  += 8;
+        T   += 16;
+    }
+
+    x0   = in;
+    x1   = in+n2-8;
+
+    for (; i < n4; i += 4, j -= 4) {
+        __m256  S, R;
+        S        = _mm256_sub_ps(_mm256_loadu_ps(x0), reverse_ps(_mm256_loadu_ps(x1)));
+        R        = _mm256_fmadd_ps(_mm256_permute_ps(S, _MM_SHUFFLE(0,0,3,3)), _mm256_loadu_ps(T),
+                       _mm256_mul_ps(_mm256_permute_ps(S, _MM_SHUFFLE(2,2,1,1)), _mm256_loadu_ps(T+8)));
+        R        = _mm256_permutevar8x32_ps(R, swap);
+        _mm_store_ps(w2+i  , _mm256_castps256_ps128(R));
+        _mm_store_ps(w2+j-2, _mm256_extractf128_ps(R, 1));
+        x0  += 8;
+        x1  -= 8;
+        T   += 16;
+    }
+
+    mdct_butterflies_avx2(mdct, w2, n2);
+    mdct_bitreverse_avx2(mdct, w);
+
+    /* rotate + window */
+
+    T    = mdct->trig_forward+n;
+    x0    =out +n2;
+
+    for (i = 0; i < n4; i += 8) {
+        __m256  Y0, Y1, E, O;
+        x0  -= 8;
+        Y0       = _mm256_loadu_ps(w  );
+        Y1       = _mm256_loadu_ps(w+8);
+        /* even and odd values of w, in order */
+        E        = _mm256_shuffle_ps(Y0, Y1, _MM_SHUFFLE(2,0,2,0));
+        O        = _mm256_shuffle_ps(Y0, Y1, _MM_SHUFFLE(3,1,3,1));
+        E        = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(E), _MM_SHUFFLE(3,1,2,0)));
+        O        = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(O), _MM_SHUFFLE(3,1,2,0)));
+        Y0       = _mm256_fmadd_ps(E, _mm256_loadu_ps(T   ), _mm256_mul_ps(O, _mm256_loadu_ps(T+ 8)));
+        Y1       = _mm256_fmsub_ps(E, _mm256_loadu_ps(T+16), _mm256_mul_ps(O, _mm256_loadu_ps(T+24)));
+        _mm256_storeu_ps(out+i, Y0);
+        _mm256_storeu_ps(x0   , reverse_ps(Y1));
+        w   += 16;
+        T   += 32;
+    }
+}
+
+static void
+mdct_512_avx2(A52ThreadContext *tctx, FLOAT *out, FLOAT *in)
+{
+    mdct_avx2(&tctx->mdct_tctx_512, out, in);
+}
+
+static void
+mdct_256_avx2(A52ThreadContext *tctx, FLOAT *out, FLOAT *in)
+{
+    FLOAT *coef_a, *coef_b, *xx;
+    int i, j;
+
+    coef_a = in;
+    coef_b = &in[128];
+    xx = tctx->mdct_tctx_256.buffer1;
+
+    memcpy(xx, in+64, 192 * sizeof(FLOAT));
+    for (i = 0; i < 64; i += 8)
+        _mm256_storeu_ps(xx+192+i, _mm256_xor_ps(_mm256_loadu_ps(in+i), SIGN_MASK));
+
+    mdct_avx2(&tctx->mdct_tctx_256, coef_a, xx);
+
+    for (i = 0; i < 64; i += 8)
+        _mm256_storeu_ps(xx+i, _mm256_xor_ps(_mm256_loadu_ps(in+256+192+i), SIGN_MASK));
+    memcpy(xx+64, in+256, 128 * sizeof(FLOAT));
+    for (i = 0; i < 64; i += 8)
+        _mm256_storeu_ps(xx+192+i, _mm256_xor_ps(_mm256_loadu_ps(in+256+128+i), SIGN_MASK));
+
+    mdct_avx2(&tctx->mdct_tctx_256, coef_b, xx);
+
+    for (i = 0, j = 0; i < 128; i += 8, j += 16) {
+        __m256 A = _mm256_loadu_ps(coef_a + i);
+        __m256 B = _mm256_loadu_ps(coef_b + i);
+        __m256 L = _mm256_unpacklo_ps(A, B);
+        __m256 H = _mm256_unpackhi_ps(A, B);
+        _mm256_storeu_ps(out + j  , _mm256_permute2f128_ps(L, H, 0x20));
+        _mm256_storeu_ps(out + j+8, _mm256_permute2f128_ps(L, H, 0x31));
+    }
+}
+
+/**
+ * Reorders each group of 16 twiddle factors in t, seen as four vectors of 4,
+ * to the vectors q0 to q3 of the SSE layout.
+ */
+static void
+reorder_trig(FLOAT *t, int len, int q0, int q1, int q2, int q3)
+{
+    const int q[4] = { q0, q1, q2, q3 };
+    FLOAT tmp[16];
+    int i, k;
+
+    for (i = 0; i < len; i += 16) {
+        memcpy(tmp, t+i, sizeof(tmp));
+        for (k = 0; k < 4; k++)
+            memcpy(t+i+4*k, tmp+4*q[k], 4 * sizeof(FLOAT));
+    }
+}
+
+static void
+mdct_ctx_init_avx2(MDCTContext *mdct, int n)
+{
+    FLOAT *T, tmp[32];
+    int i, k;
+
+    mdct_ctx_init_sse(mdct, n);
+
+    /* factors of two SSE iterations side by side in each lane */
+    reorder_trig(mdct->trig_bitreverse, n>>1, 0, 2, 1, 3);
+    reorder_trig(mdct->trig_forward, n, 0, 2, 1, 3);
+    reorder_trig(mdct->trig_butterfly_first, n*2, 1, 0, 3, 2);
+    reorder_trig(mdct->trig_butterfly_generic8, n>>1, 0, 2, 1, 3);
+    reorder_trig(mdct->trig_butterfly_generic16, n>>2, 0, 2, 1, 3);
+    if (mdct->trig_butterfly_generic32)
+        reorder_trig(mdct->trig_butterfly_generic32, n>>3, 0, 2, 1, 3);
+    if (mdct->trig_butterfly_generic64)
+        reorder_trig(mdct->trig_butterfly_generic64, n>>4, 0, 2, 1, 3);
+
+    /* the last rotation works on the even and odd values of w in order, and
+       on reversed values for the part stored backwards */
+    T = mdct->trig_forward+n;
+    for (i = 0; i < n; i += 32) {
+        memcpy(tmp, T+i, sizeof(tmp));
+        for (k = 0; k < 4; k++) {
+            T[i   +k] = tmp[   8+k];
+            T[i+ 4+k] = tmp[16+8+k];
+            T[i+ 8+k] = tmp[  12+k];
+            T[i+12+k] = tmp[16+12+k];
+            T[i+16+k] = tmp[   3-k];
+            T[i+20+k] = tmp[16+3-k];
+            T[i+24+k] = tmp[   7-k];
+            T[i+28+k] = tmp[16+7-k];
+        }
+    }
+}
+
+void
+mdct_init_avx2(A52Context *ctx)
+{
+    mdct_ctx_init_avx2(&ctx->mdct_ctx_512, 512);
+    mdct_ctx_init_avx2(&ctx->mdct_ctx_256, 256);
+
+    ctx->mdct_ctx_512.mdct = mdct_512_avx2;
+    ctx->mdct_ctx_512.mdct_bitreverse = mdct_bitreverse_avx2;
+    ctx->mdct_ctx_512.mdct_butterfly_generic = mdct_butterfly_generic_avx2;
+    ctx->mdct_ctx_512.mdct_butterfly_first = mdct_butterfly_first_avx2;
+    ctx->mdct_ctx_512.mdct_butterfly_32 = mdct_butterfly_32_avx2;
+
+    ctx->mdct_ctx_256.mdct = mdct_256_avx2;
+    ctx->mdct_ctx_256.mdct_bitreverse = mdct_bitreverse_avx2;
+    ctx->mdct_ctx_256.mdct_butterfly_generic = mdct_butterfly_generic_avx2;
+    ctx->mdct_ctx_256.mdct_butterfly_first = mdct_butterfly_first_avx2;
+    ctx->mdct_ctx_256.mdct_butterfly_32 = mdct_butterfly_32_avx2;
+}
@@ -71,6 +71,10 @@ union __m128iui {
 
 #undef _mm_lddqu_ps
 #define _mm_lddqu_ps(x) _mm_castsi128_ps(_mm_lddqu_si128((__m128i*)(x)))
+
+#ifdef USE_AVX2
+#include <immintrin.h>
+#endif /* USE_AVX2 */
 #endif /* USE_SSE3 */
 #endif /* USE_SSE2 */
 
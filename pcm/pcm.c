@@ -146,6 +146,17 @@ pcm_print(PcmContext *pc, FILE *st)
         pcmfile_print(&pc->pcm_file[i], st);
 }
 
+int
+pcm_seek_samples(PcmContext *pc, int64_t offset, int whence)
+{
+    int i;
+    for (i = 0; i < pc->num_files; i++) {
+        if (pcmfile_seek_samples(&pc->pcm_file[i], offset, whence))
+            return -1;
+    }
+    return 0;
+}
+
 static const uint8_t sample_sizes[8] = { 1, 1, 2, 4, 4, 4, 4, 8 };
 
 #define CHANNEL_INTERLEAVE_COMMON(DATA_TYPE) \
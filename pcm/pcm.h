@@ -92,6 +92,13 @@ extern void pcm_set_read_format(PcmContext *pc, enum PcmSampleFormat read_format
  */
 extern void pcm_print(PcmContext *pc, FILE *st);
 
+/**
+ * Seeks all source files to the same sample position.
+ * Syntax works like fseek. use PCM_SEEK_SET, PCM_SEEK_CUR, or PCM_SEEK_END
+ * Returns non-zero value if an error occurs.
+ */
+extern int pcm_seek_samples(PcmContext *pc, int64_t offset, int whence);
+
 /**
  * Reads audio samples to the output buffer.
  * Output is channel-interleaved, native byte order.
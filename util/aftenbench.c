@@ -0,0 +1,507 @@
+/**
+ * Aften: A/52 audio encoder
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file aftenbench.c
+ * Console encoder throughput benchmark
+ *
+ * Encodes synthetic 5.1 audio through the public API with 1 to N threads
+ * in both threading modes and prints the number of frames encoded per
+ * second and the per-frame latency for each run. Then frame by frame
+ * encoding is compared with batch encoding through aften_encode_frames(),
+ * then several streams are encoded at once, each with its own threads and
+ * then on one shared pool. Then the thread counts are run again on mixed
+ * transient and tonal material, where the cost of a frame varies a lot.
+ * Finally the exponent strategy search is timed at search sizes 8 and 32 and
+ * with the optimal strategy, with and without the AVX2 exponent functions,
+ * along with the average quality (snroffst) each one reaches.
+ */
+
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
+#include "aften.h"
+
+#define BENCH_CHANNELS 6
+
+static int bench_block_switching = 0;
+
+static double
+get_time(void)
+{
+#ifdef _WIN32
+    return GetTickCount() / 1000.0;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+#endif
+}
+
+/* fills one frame of interleaved float samples: a tone per channel plus noise */
+static void
+generate_frame(float *buf, int frame)
+{
+    static unsigned int seed = 1;
+    int i, ch;
+
+    for (i = 0; i < A52_SAMPLES_PER_FRAME; i++) {
+        int n = frame * A52_SAMPLES_PER_FRAME + i;
+        for (ch = 0; ch < BENCH_CHANNELS; ch++) {
+            seed = seed * 1664525 + 1013904223;
+            buf[i*BENCH_CHANNELS+ch] = 0.2f * sinf(n * 0.01f * (ch + 1)) +
+                                       0.02f * ((int)(seed >> 16) - 32768) / 32768.0f;
+        }
+    }
+}
+
+/**
+ * fills one frame of mixed material: tonal passages, interrupted by bursts
+ * of decaying noise which trigger block switching, and some near silence
+ */
+static void
+generate_mixed_frame(float *buf, int frame)
+{
+    static unsigned int seed = 1;
+    int i, ch;
+    int kind = (frame * 7) % 5;
+    int attack = (frame * 331) % A52_SAMPLES_PER_FRAME;
+
+    for (i = 0; i < A52_SAMPLES_PER_FRAME; i++) {
+        int n = frame * A52_SAMPLES_PER_FRAME + i;
+        for (ch = 0; ch < BENCH_CHANNELS; ch++) {
+            float v = 0.3f * sinf(n * 0.005f * (ch + 1)) +
+                      0.1f * sinf(n * 0.0731f * (ch + 2));
+            seed = seed * 1664525 + 1013904223;
+            if (kind == 0 && i >= attack) {
+                // noise burst with a sharp attack
+                v += 0.8f * expf((attack - i) / 200.0f) *
+                     ((int)(seed >> 16) - 32768) / 32768.0f;
+            } else if (kind == 1) {
+                v *= 0.001f;
+            }
+            buf[i*BENCH_CHANNELS+ch] = v;
+        }
+    }
+}
+
+static void
+setup_context(AftenContext *s, int n_threads, AftenThreadingMode mode,
+              AftenPool *pool)
+{
+    aften_set_defaults(s);
+    s->channels = BENCH_CHANNELS;
+    s->acmod = A52_ACMOD_3_2;
+    s->lfe = 1;
+    s->samplerate = 48000;
+    s->sample_format = A52_SAMPLE_FMT_FLT;
+    s->params.bitrate = 448;
+    s->system.n_threads = n_threads;
+    s->system.threading_mode = mode;
+    s->system.pool = pool;
+    s->params.use_block_switching = bench_block_switching;
+}
+
+static int
+run_bench(int n_threads, AftenThreadingMode mode, int n_frames, float *samples,
+          int n_input_frames, double *submit_time)
+{
+    AftenContext s;
+    uint8_t frame[A52_MAX_CODED_FRAME_SIZE];
+    double t0, t1, now, latency, total_latency, max_latency;
+    double bit_alloc_calls;
+    int i, fs, out_frames;
+
+    setup_context(&s, n_threads, mode, NULL);
+    if (aften_encode_init(&s)) {
+        fprintf(stderr, "error initializing encoder\n");
+        aften_encode_close(&s);
+        return -1;
+    }
+
+    // latency is the time from passing a frame's samples to getting the
+    // encoded frame back. output frame n always belongs to input frame n.
+    out_frames = 0;
+    total_latency = max_latency = 0.0;
+    bit_alloc_calls = 0.0;
+    t0 = get_time();
+    for (i = 0; i < n_frames; i++) {
+        float *src = samples + (i % n_input_frames) * A52_SAMPLES_PER_FRAME * BENCH_CHANNELS;
+        submit_time[i] = get_time();
+        fs = aften_encode_frame(&s, frame, src, A52_SAMPLES_PER_FRAME);
+        if (fs < 0)
+            break;
+        if (fs > 0) {
+            now = get_time();
+            latency = now - submit_time[out_frames++];
+            total_latency += latency;
+            max_latency = MAX(max_latency, latency);
+            bit_alloc_calls += s.status.bit_alloc_calls;
+        }
+    }
+    // flush
+    do {
+        fs = aften_encode_frame(&s, frame, NULL, 0);
+        if (fs > 0 && out_frames < n_frames) {
+            now = get_time();
+            latency = now - submit_time[out_frames++];
+            total_latency += latency;
+            max_latency = MAX(max_latency, latency);
+            bit_alloc_calls += s.status.bit_alloc_calls;
+        }
+    } while (fs > 0);
+    t1 = get_time();
+
+    if (aften_encode_close(&s) || fs < 0 || !out_frames) {
+        fprintf(stderr, "error encoding with %d threads\n", n_threads);
+        return -1;
+    }
+
+    if (t1 <= t0)
+        t1 = t0 + 0.001;
+    fprintf(stdout, "threads: %2d %s | frames: %6d | %8.1f frames/s | "
+            "latency avg %7.3f ms, max %7.3f ms | bit alloc/frame %5.2f\n",
+            n_threads, mode == AFTEN_THREADS_INTRA ? "intra" : "frame",
+            out_frames, out_frames / (t1 - t0),
+            total_latency * 1000.0 / out_frames, max_latency * 1000.0,
+            bit_alloc_calls / out_frames);
+
+    return 0;
+}
+
+/**
+ * Compares encoding frame by frame, like the aften frontend does, with
+ * passing batches of frames to aften_encode_frames().
+ */
+static int
+run_batch_bench(int n_threads, int batch, int n_frames, float *samples,
+                int n_input_frames)
+{
+    AftenContext s;
+    uint8_t *frames;
+    int *frame_sizes;
+    double t0, t1;
+    int i, fs, out_frames;
+
+    frames = malloc(n_input_frames * A52_MAX_CODED_FRAME_SIZE);
+    frame_sizes = malloc(n_input_frames * sizeof(int));
+    if (!frames || !frame_sizes) {
+        free(frames);
+        free(frame_sizes);
+        return -1;
+    }
+    setup_context(&s, n_threads, AFTEN_THREADS_FRAME, NULL);
+    if (aften_encode_init(&s)) {
+        fprintf(stderr, "error initializing encoder\n");
+        aften_encode_close(&s);
+        free(frames);
+        free(frame_sizes);
+        return -1;
+    }
+
+    out_frames = 0;
+    t0 = get_time();
+    if (batch) {
+        for (i = 0; i < n_frames; i += n_input_frames) {
+            int nr = MIN(n_input_frames, n_frames - i);
+            fs = aften_encode_frames(&s, frames, frame_sizes, n_input_frames,
+                                     samples, nr * A52_SAMPLES_PER_FRAME);
+            if (fs < 0)
+                break;
+            out_frames += fs;
+        }
+        do {
+            fs = aften_encode_frames(&s, frames, frame_sizes, n_input_frames,
+                                     NULL, 0);
+            out_frames += MAX(fs, 0);
+        } while (fs > 0);
+    } else {
+        for (i = 0; i < n_frames; i++) {
+            float *src = samples + (i % n_input_frames) * A52_SAMPLES_PER_FRAME * BENCH_CHANNELS;
+            fs = aften_encode_frame(&s, frames, src, A52_SAMPLES_PER_FRAME);
+            if (fs < 0)
+                break;
+            out_frames += fs > 0;
+        }
+        do {
+            fs = aften_encode_frame(&s, frames, NULL, 0);
+            out_frames += fs > 0;
+        } while (fs > 0);
+    }
+    t1 = get_time();
+
+    free(frames);
+    free(frame_sizes);
+    if (aften_encode_close(&s) || fs < 0 || !out_frames) {
+        fprintf(stderr, "error encoding with %d threads\n", n_threads);
+        return -1;
+    }
+
+    if (t1 <= t0)
+        t1 = t0 + 0.001;
+    fprintf(stdout, "threads: %2d %s | frames: %6d | %8.1f frames/s\n",
+            n_threads, batch ? "batch" : "frame", out_frames,
+            out_frames / (t1 - t0));
+
+    return 0;
+}
+
+/* encodes n_streams streams at once, fed in turns from the calling thread */
+static int
+run_streams_bench(int n_streams, int n_threads, int use_pool, int n_frames,
+                  float *samples, int n_input_frames)
+{
+    AftenContext *s;
+    AftenPool *pool = NULL;
+    uint8_t frame[A52_MAX_CODED_FRAME_SIZE];
+    double t0, t1;
+    int i, j, fs, out_frames, ret = 0;
+
+    s = calloc(n_streams, sizeof(AftenContext));
+    if (!s)
+        return -1;
+    if (use_pool) {
+        pool = aften_pool_create(n_threads);
+        if (!pool) {
+            free(s);
+            return -1;
+        }
+    }
+    for (j = 0; j < n_streams; j++) {
+        // with a pool, every stream may keep all pool threads busy
+        setup_context(&s[j], use_pool ? 0 : n_threads, AFTEN_THREADS_FRAME, pool);
+        if (aften_encode_init(&s[j])) {
+            fprintf(stderr, "error initializing encoder\n");
+            n_streams = j + 1;
+            ret = -1;
+            break;
+        }
+    }
+
+    out_frames = 0;
+    t0 = get_time();
+    for (i = 0; i < n_frames && !ret; i++) {
+        float *src = samples + (i % n_input_frames) * A52_SAMPLES_PER_FRAME * BENCH_CHANNELS;
+        for (j = 0; j < n_streams; j++) {
+            fs = aften_encode_frame(&s[j], frame, src, A52_SAMPLES_PER_FRAME);
+            if (fs < 0) {
+                ret = -1;
+                break;
+            }
+            out_frames += fs > 0;
+        }
+    }
+    for (j = 0; j < n_streams && !ret; j++) {
+        do {
+            fs = aften_encode_frame(&s[j], frame, NULL, 0);
+            out_frames += fs > 0;
+        } while (fs > 0);
+        if (fs < 0)
+            ret = -1;
+    }
+    t1 = get_time();
+
+    for (j = 0; j < n_streams; j++) {
+        if (aften_encode_close(&s[j]))
+            ret = -1;
+    }
+    if (aften_pool_destroy(pool))
+        ret = -1;
+    free(s);
+    if (ret || !out_frames) {
+        fprintf(stderr, "error encoding %d streams\n", n_streams);
+        return -1;
+    }
+
+    if (t1 <= t0)
+        t1 = t0 + 0.001;
+    fprintf(stdout, "streams: %2d | threads: %2d %s | frames: %6d | %8.1f frames/s\n",
+            n_streams, n_threads, use_pool ? "shared" : "each  ",
+            out_frames, out_frames / (t1 - t0));
+
+    return 0;
+}
+
+/**
+ * Encodes n_frames frames on one thread with the given exponent strategy
+ * search size, or with the optimal strategy if it is 0. Returns the time per
+ * frame in ms, or a negative value on error, and the average quality.
+ */
+static double
+run_exps_bench(int expstr_search, int use_avx2, int n_frames, float *samples,
+               int n_input_frames, double *quality)
+{
+    AftenContext s;
+    uint8_t frame[A52_MAX_CODED_FRAME_SIZE];
+    double t0, t1, quality_sum;
+    int i, fs, out_frames;
+
+    setup_context(&s, 1, AFTEN_THREADS_FRAME, NULL);
+    if (expstr_search)
+        s.params.expstr_search = expstr_search;
+    else
+        s.params.expstr_optimal = 1;
+    if (!use_avx2)
+        s.system.wanted_simd_instructions.avx2 = 0;
+    if (aften_encode_init(&s)) {
+        fprintf(stderr, "error initializing encoder\n");
+        aften_encode_close(&s);
+        return -1.0;
+    }
+
+    out_frames = 0;
+    quality_sum = 0.0;
+    t0 = get_time();
+    for (i = 0; i < n_frames; i++) {
+        float *src = samples + (i % n_input_frames) * A52_SAMPLES_PER_FRAME * BENCH_CHANNELS;
+        fs = aften_encode_frame(&s, frame, src, A52_SAMPLES_PER_FRAME);
+        if (fs < 0)
+            break;
+        if (fs > 0) {
+            out_frames++;
+            quality_sum += s.status.quality;
+        }
+    }
+    do {
+        fs = aften_encode_frame(&s, frame, NULL, 0);
+        if (fs > 0) {
+            out_frames++;
+            quality_sum += s.status.quality;
+        }
+    } while (fs > 0);
+    t1 = get_time();
+
+    if (aften_encode_close(&s) || fs < 0 || !out_frames) {
+        fprintf(stderr, "error encoding with exps %d\n", expstr_search);
+        return -1.0;
+    }
+
+    *quality = quality_sum / out_frames;
+    return (t1 - t0) * 1000.0 / out_frames;
+}
+
+int
+main(int argc, char **argv)
+{
+    float *samples;
+    double *submit_time;
+    int n_frames = 2000;
+    int max_threads = 32;
+    int n_input_frames = 64;
+    int n_streams = 4;
+    int i, t;
+
+    if (argc > 1)
+        n_frames = atoi(argv[1]);
+    if (argc > 2)
+        max_threads = atoi(argv[2]);
+    if (argc > 3)
+        n_streams = atoi(argv[3]);
+    if (n_frames <= 0 || max_threads <= 0 || n_streams <= 0) {
+        fprintf(stderr, "\nusage: aftenbench [frames] [max threads] [streams]\n\n");
+        return 1;
+    }
+
+    samples = malloc(n_input_frames * A52_SAMPLES_PER_FRAME * BENCH_CHANNELS *
+                     sizeof(float));
+    submit_time = malloc(n_frames * sizeof(double));
+    if (!samples || !submit_time)
+        return 1;
+    for (i = 0; i < n_input_frames; i++)
+        generate_frame(samples + i * A52_SAMPLES_PER_FRAME * BENCH_CHANNELS, i);
+
+    fprintf(stdout, "Aften %s benchmark: 5.1 @ 48 kHz, 448 kbps\n",
+            aften_get_version());
+    for (t = 1; t <= max_threads; t *= 2) {
+        if (run_bench(t, AFTEN_THREADS_FRAME, n_frames, samples,
+                      n_input_frames, submit_time))
+            break;
+        if (t > 1 && run_bench(t, AFTEN_THREADS_INTRA, n_frames, samples,
+                               n_input_frames, submit_time))
+            break;
+    }
+
+    // one call per frame against one call per n_input_frames frames
+    for (t = 1; t <= max_threads; t *= 2) {
+        if (run_batch_bench(t, 0, n_frames, samples, n_input_frames) ||
+            run_batch_bench(t, 1, n_frames, samples, n_input_frames))
+            break;
+    }
+
+    // every stream with max_threads threads of its own against all streams
+    // sharing max_threads pool threads
+    if (!run_streams_bench(n_streams, max_threads, 0, n_frames / n_streams,
+                           samples, n_input_frames))
+        run_streams_bench(n_streams, max_threads, 1, n_frames / n_streams,
+                          samples, n_input_frames);
+
+    // frames with transients take the short block path and frames far from
+    // the previous snroffst need more bit allocation passes
+    for (i = 0; i < n_input_frames; i++)
+        generate_mixed_frame(samples + i * A52_SAMPLES_PER_FRAME * BENCH_CHANNELS, i);
+    bench_block_switching = 1;
+    fprintf(stdout, "mixed transient/tonal material, block switching on\n");
+    for (t = 1; t <= max_threads; t *= 2) {
+        if (run_bench(t, AFTEN_THREADS_FRAME, n_frames, samples,
+                      n_input_frames, submit_time))
+            break;
+    }
+
+    // a search size of 1 only tries the first strategy set, so the time on
+    // top of that is spent searching. search size 0 stands for the optimal
+    // strategy.
+    fprintf(stdout, "exponent strategy search, block switching on\n");
+    for (i = 1; i >= 0; i--) {
+        static const int exps_tab[3] = { 8, 32, 0 };
+        double t_base, t_exps, quality;
+        int j;
+
+        t_base = run_exps_bench(1, i, n_frames, samples, n_input_frames,
+                                &quality);
+        if (t_base < 0.0)
+            break;
+        for (j = 0; j < 3; j++) {
+            int exps = exps_tab[j];
+            t_exps = run_exps_bench(exps, i, n_frames, samples,
+                                    n_input_frames, &quality);
+            if (t_exps < 0.0)
+                break;
+            if (exps)
+                fprintf(stdout, "exps: %2d  ", exps);
+            else
+                fprintf(stdout, "exps: opt ");
+            fprintf(stdout, "%s | %7.3f ms/frame | search %7.3f ms/frame | "
+                    "quality %6.1f\n", i ? "avx2 " : "noavx", t_exps,
+                    t_exps - t_base, quality);
+        }
+    }
+
+    free(submit_time);
+    free(samples);
+
+    return 0;
+}
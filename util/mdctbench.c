@@ -0,0 +1,214 @@
+/**
+ * Aften: A/52 audio encoder
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file mdctbench.c
+ * MDCT throughput benchmark
+ *
+ * Runs the 512-point and 256-point transforms of every MDCT backend the CPU
+ * supports on the same random input and prints the number of transforms per
+ * second, along with the largest difference to the output of the C version.
+ * The 256-point transform uses its input as scratch space, so the time of the
+ * 256-point runs includes copying in the input again. Links against the
+ * static library, as it calls the encoder internals.
+ */
+
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
+#include "a52enc.h"
+#include "cpu_caps.h"
+#include "mem.h"
+
+typedef struct {
+    const char *name;
+    int sse, sse3, avx2, fma, altivec;
+} MDCTBackend;
+
+/* mdct_init() picks the best backend the restrictions leave over */
+static const MDCTBackend backends[] = {
+    { "C",        0, 0, 0, 0, 0 },
+    { "SSE",      1, 0, 0, 0, 0 },
+    { "SSE3",     1, 1, 0, 0, 0 },
+    { "AVX2/FMA", 1, 1, 1, 1, 0 },
+    { "Altivec",  0, 0, 0, 0, 1 },
+};
+
+#define N_BACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+static double
+get_time(void)
+{
+#ifdef _WIN32
+    return GetTickCount() / 1000.0;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+#endif
+}
+
+/* returns 0 if the CPU lacks an instruction set the backend needs */
+static int
+backend_available(const MDCTBackend *b, const AftenSimdInstructions *avail)
+{
+    return (!b->sse     || avail->sse)  &&
+           (!b->sse3    || avail->sse3) &&
+           (!b->avx2    || avail->avx2) &&
+           (!b->fma     || avail->fma)  &&
+           (!b->altivec || avail->altivec);
+}
+
+/**
+ * Times n_runs transforms of each size with the given backend. out512 and
+ * out256 receive the transform of in, work is 512 samples of scratch space.
+ */
+static int
+run_mdct_bench(const MDCTBackend *b, int n_runs, FLOAT *in, FLOAT *work,
+               FLOAT *out512, FLOAT *out256, double *rate512, double *rate256)
+{
+    AftenSimdInstructions simd;
+    A52Context *ctx;
+    A52ThreadContext *tctx;
+    double t0, t1;
+    int i;
+
+    memset(&simd, 0, sizeof(simd));
+    simd.sse     = b->sse;
+    simd.sse3    = b->sse3;
+    simd.avx2    = b->avx2;
+    simd.fma     = b->fma;
+    simd.altivec = b->altivec;
+    cpu_caps_detect();
+    apply_simd_restrictions(&simd);
+
+    ctx = calloc(sizeof(A52Context), 1);
+    tctx = calloc(sizeof(A52ThreadContext), 1);
+    if (!ctx || !tctx) {
+        fprintf(stderr, "error allocating memory for contexts\n");
+        free(ctx);
+        free(tctx);
+        return -1;
+    }
+    tctx->ctx = ctx;
+    mdct_init(ctx);
+    mdct_thread_init(tctx);
+
+    ctx->mdct_ctx_512.mdct(tctx, out512, in);
+    t0 = get_time();
+    for (i = 0; i < n_runs; i++)
+        ctx->mdct_ctx_512.mdct(tctx, out512, in);
+    t1 = get_time();
+    *rate512 = n_runs / MAX(t1 - t0, 1e-6);
+
+    t0 = get_time();
+    for (i = 0; i < n_runs; i++) {
+        memcpy(work, in, 512 * sizeof(FLOAT));
+        ctx->mdct_ctx_256.mdct(tctx, out256, work);
+    }
+    t1 = get_time();
+    *rate256 = n_runs / MAX(t1 - t0, 1e-6);
+
+    mdct_thread_close(tctx);
+    mdct_close(ctx);
+    free(tctx);
+    free(ctx);
+    return 0;
+}
+
+static double
+max_diff(const FLOAT *a, const FLOAT *b, int n)
+{
+    double d = 0.0;
+    int i;
+
+    for (i = 0; i < n; i++)
+        d = MAX(d, fabs(a[i] - b[i]));
+    return d;
+}
+
+int
+main(int argc, char **argv)
+{
+    AftenContext s;
+    FLOAT *in, *work, *ref512, *ref256, *out512, *out256;
+    unsigned int seed = 1;
+    int n_runs = 200000;
+    int i;
+
+    if (argc > 1)
+        n_runs = atoi(argv[1]);
+    if (n_runs <= 0) {
+        fprintf(stderr, "\nusage: mdctbench [transforms]\n\n");
+        return 1;
+    }
+
+    // the defaults hold the instruction sets that are available
+    aften_set_defaults(&s);
+
+    in     = aligned_malloc(512 * sizeof(FLOAT));
+    work   = aligned_malloc(512 * sizeof(FLOAT));
+    ref512 = aligned_malloc(256 * sizeof(FLOAT));
+    ref256 = aligned_malloc(256 * sizeof(FLOAT));
+    out512 = aligned_malloc(256 * sizeof(FLOAT));
+    out256 = aligned_malloc(256 * sizeof(FLOAT));
+    if (!in || !work || !ref512 || !ref256 || !out512 || !out256)
+        return 1;
+    for (i = 0; i < 512; i++) {
+        seed = seed * 1664525 + 1013904223;
+        in[i] = ((int)(seed >> 16) - 32768) / 32768.0f;
+    }
+
+    fprintf(stdout, "Aften %s MDCT benchmark, %d transforms per size\n",
+            aften_get_version(), n_runs);
+    for (i = 0; i < (int)N_BACKENDS; i++) {
+        const MDCTBackend *b = &backends[i];
+        double rate512, rate256;
+
+        if (!backend_available(b, &s.system.wanted_simd_instructions))
+            continue;
+        if (run_mdct_bench(b, n_runs, in, work, i ? out512 : ref512,
+                           i ? out256 : ref256, &rate512, &rate256))
+            break;
+        fprintf(stdout, "%-8s | 512: %9.0f transforms/s | 256: %9.0f "
+                "transforms/s", b->name, rate512, rate256);
+        if (i)
+            fprintf(stdout, " | max diff to C %.3g",
+                    MAX(max_diff(out512, ref512, 256),
+                        max_diff(out256, ref256, 256)));
+        fprintf(stdout, "\n");
+    }
+
+    aligned_free(out256);
+    aligned_free(out512);
+    aligned_free(ref256);
+    aligned_free(ref512);
+    aligned_free(work);
+    aligned_free(in);
+
+    return 0;
+}